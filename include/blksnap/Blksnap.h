@@ -41,6 +41,9 @@ namespace blksnap
     struct SBlksnapEventLowFreeSpace
     {
         unsigned long long requestedSectors;
+        unsigned long long capacitySectors;
+        unsigned long long filledSectors;
+        unsigned long long fillRate;
     };
 
     struct SBlksnapEventCorrupted
@@ -67,6 +70,7 @@ namespace blksnap
         ~CBlksnap();
 
         void Version(struct blk_snap_version& version);
+        void RemoveTracker(struct blk_snap_dev dev_id);
         void CollectTrackers(std::vector<struct blk_snap_cbt_info>& cbtInfoVector);
         void ReadCbtMap(struct blk_snap_dev dev_id, unsigned int offset, unsigned int length, uint8_t* buff);
 
@@ -81,6 +85,15 @@ namespace blksnap
 #ifdef BLK_SNAP_MODIFICATION
         /* Additional functional */
         bool Modification(struct blk_snap_mod& mod);
+        void ReadCbtRanges(struct blk_snap_dev dev_id, uint8_t snapNumber, uint64_t& sector,
+                           std::vector<struct blk_snap_block_range>& ranges);
+        void Create(const std::vector<struct blk_snap_dev>& devices, unsigned int chunkShift, uuid_t& id);
+        void CacheLimit(unsigned long long& limit, unsigned long long& used);
+        void GetLatency(struct blk_snap_get_latency& latency, bool reset);
+        void SetEventFd(const uuid_t& id, int fd);
+        bool WaitEvents(const uuid_t& id, unsigned int timeoutMs, std::vector<SBlksnapEvent>& events,
+                        unsigned int& lost);
+        void SetStoragePolicy(const uuid_t& id, enum blk_snap_storage_policy policy);
 #    ifdef BLK_SNAP_DEBUG_SECTOR_STATE
         void GetSectorState(struct blk_snap_dev image_dev_id, off_t offset, struct blk_snap_sector_state& state);
 #    endif
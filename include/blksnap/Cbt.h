@@ -21,9 +21,12 @@
  * The hi-level abstraction for the blksnap kernel module.
  * Allows to receive data from CBT.
  */
+#include <functional>
 #include <memory>
+#include <string>
 #include <uuid/uuid.h>
 #include <vector>
+#include "Sector.h"
 
 namespace blksnap
 {
@@ -70,6 +73,15 @@ namespace blksnap
 
         virtual std::shared_ptr<SCbtInfo> GetCbtInfo(const std::string& original) = 0;
         virtual std::shared_ptr<SCbtData> GetCbtData(const std::shared_ptr<SCbtInfo>& ptrCbtInfo) = 0;
+        /*
+         * Calls the callback for each range of sectors that have been changed
+         * since the snapshot described by ptrPrevious. The CBT map is read in
+         * windows of limited size, so the whole map is not kept in memory.
+         * Returns false if the generation of changes does not match, in this
+         * case the full backup is required.
+         */
+        virtual bool ForEachChangedRange(const std::shared_ptr<SCbtInfo>& ptrPrevious,
+                                         const std::function<void(const SRange&)>& callback) = 0;
 
         static std::shared_ptr<ICbt> Create();
     };
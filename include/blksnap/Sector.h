@@ -47,4 +47,15 @@ namespace blksnap
 
         SStorageRanges() {};
     };
+
+    /*
+     * The placement of the chunks on the devices of the difference storage.
+     * The linear policy fills the devices one after another. The round-robin
+     * policy spreads the chunks over all the devices.
+     */
+    enum class EStoragePolicy
+    {
+        Linear,
+        RoundRobin
+    };
 }
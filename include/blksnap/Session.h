@@ -41,6 +41,15 @@ namespace blksnap
                                                 const std::string& diffStorage);
         static std::shared_ptr<ISession> Create(const std::vector<std::string>& devices,
                                                 const SStorageRanges& diffStorageRanges);
+        static std::shared_ptr<ISession> Create(const std::vector<std::string>& devices,
+                                                const std::vector<SStorageRanges>& diffStorageRanges,
+                                                EStoragePolicy storagePolicy);
+        /*
+         * The chunk shift is a hint for the chunk size of the snapshot. The
+         * module can still increase the chunk size for a device.
+         */
+        static std::shared_ptr<ISession> Create(const std::vector<std::string>& devices,
+                                                const std::string& diffStorage, unsigned int chunkShift);
     };
 
 }
@@ -30,6 +30,34 @@ static const char* blksnap_filename = "/dev/" BLK_SNAP_CTL;
 
 using namespace blksnap;
 
+static void DecodeEvent(unsigned int code, long long time, const void* data, SBlksnapEvent& ev)
+{
+    ev.code = code;
+    ev.time = time;
+
+    switch (code)
+    {
+    case blk_snap_event_code_low_free_space:
+    {
+        const struct blk_snap_event_low_free_space* lowFreeSpace = (const struct blk_snap_event_low_free_space*)(data);
+
+        ev.lowFreeSpace.requestedSectors = lowFreeSpace->requested_nr_sect;
+        ev.lowFreeSpace.capacitySectors = lowFreeSpace->capacity_nr_sect;
+        ev.lowFreeSpace.filledSectors = lowFreeSpace->filled_nr_sect;
+        ev.lowFreeSpace.fillRate = lowFreeSpace->fill_rate;
+        break;
+    }
+    case blk_snap_event_code_corrupted:
+    {
+        const struct blk_snap_event_corrupted* corrupted = (const struct blk_snap_event_corrupted*)(data);
+
+        ev.corrupted.origDevId = corrupted->orig_dev_id;
+        ev.corrupted.errorCode = corrupted->err_code;
+        break;
+    }
+    }
+}
+
 CBlksnap::CBlksnap()
     : m_fd(0)
 {
@@ -63,8 +91,127 @@ bool CBlksnap::Modification(struct blk_snap_mod& mod)
     }
     return true;
 }
+
+void CBlksnap::ReadCbtRanges(struct blk_snap_dev dev_id, uint8_t snapNumber, uint64_t& sector,
+                             std::vector<struct blk_snap_block_range>& ranges)
+{
+    struct blk_snap_tracker_read_cbt_ranges param = {.dev_id = dev_id,
+                                                     .snap_number = snapNumber,
+                                                     .count = static_cast<__u32>(ranges.size()),
+                                                     .sector = sector,
+                                                     .ranges = ranges.data()};
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES, &param))
+        throw std::system_error(errno, std::generic_category(),
+                                "[TBD]Failed to read changed ranges from change tracking.");
+
+    ranges.resize(param.count);
+    sector = param.sector;
+}
+
+void CBlksnap::Create(const std::vector<struct blk_snap_dev>& devices, unsigned int chunkShift, uuid_t& id)
+{
+    struct blk_snap_snapshot_create_ex param = {0};
+
+    std::vector<struct blk_snap_dev> localDevices = devices;
+    param.count = localDevices.size();
+    param.dev_id_array = localDevices.data();
+    param.chunk_shift = chunkShift;
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_CREATE_EX, &param))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to create snapshot object.");
+
+    uuid_copy(id, param.id.b);
+}
+
+void CBlksnap::CacheLimit(unsigned long long& limit, unsigned long long& used)
+{
+    struct blk_snap_cache_limit param = {0};
+
+    param.limit = limit;
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_CACHE_LIMIT, &param))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to set cache limit.");
+
+    limit = param.limit;
+    used = param.used;
+}
+
+void CBlksnap::GetLatency(struct blk_snap_get_latency& latency, bool reset)
+{
+    latency.reset = reset ? 1 : 0;
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_GET_LATENCY, &latency))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to get latency.");
+}
+
+void CBlksnap::SetEventFd(const uuid_t& id, int fd)
+{
+    struct blk_snap_snapshot_event_fd param;
+
+    uuid_copy(param.id.b, id);
+    param.fd = fd;
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD, &param))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to set eventfd for snapshot.");
+}
+
+/*
+ * Receives the events that are in the queue of the snapshot, up to the size
+ * of the events vector.
+ */
+bool CBlksnap::WaitEvents(const uuid_t& id, unsigned int timeoutMs, std::vector<SBlksnapEvent>& events,
+                          unsigned int& lost)
+{
+    std::vector<struct blk_snap_event_record> records(events.size());
+    struct blk_snap_snapshot_wait_events param;
+
+    uuid_copy(param.id.b, id);
+    param.timeout_ms = timeoutMs;
+    param.count = static_cast<__u32>(records.size());
+    param.lost = 0;
+    param.records = records.data();
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENTS, &param))
+    {
+        if ((errno == ENOENT) || (errno == EINTR))
+        {
+            events.clear();
+            lost = 0;
+            return false;
+        }
+        else
+            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to get events from snapshot.");
+    }
+
+    events.resize(param.count);
+    for (size_t inx = 0; inx < events.size(); inx++)
+        DecodeEvent(records[inx].code, records[inx].time_label, records[inx].data, events[inx]);
+    lost = param.lost;
+    return true;
+}
+
+void CBlksnap::SetStoragePolicy(const uuid_t& id, enum blk_snap_storage_policy policy)
+{
+    struct blk_snap_snapshot_storage_policy param;
+
+    uuid_copy(param.id.b, id);
+    param.policy = policy;
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_POLICY, &param))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to set storage policy.");
+}
 #endif
 
+void CBlksnap::RemoveTracker(struct blk_snap_dev dev_id)
+{
+    struct blk_snap_tracker_remove param = {.dev_id = dev_id};
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_TRACKER_REMOVE, &param))
+        throw std::system_error(errno, std::generic_category(),
+                                "[TBD]Failed to remove block device from change tracking.");
+}
+
 void CBlksnap::CollectTrackers(std::vector<struct blk_snap_cbt_info>& cbtInfoVector)
 {
     struct blk_snap_tracker_collect param = {0};
@@ -178,27 +325,7 @@ bool CBlksnap::WaitEvent(const uuid_t& id, unsigned int timeoutMs, SBlksnapEvent
         else
             throw std::system_error(errno, std::generic_category(), "[TBD]Failed to get event from snapshot.");
     }
-    ev.code = param.code;
-    ev.time = param.time_label;
-
-    switch (param.code)
-    {
-    case blk_snap_event_code_low_free_space:
-    {
-        struct blk_snap_event_low_free_space* lowFreeSpace = (struct blk_snap_event_low_free_space*)(param.data);
-
-        ev.lowFreeSpace.requestedSectors = lowFreeSpace->requested_nr_sect;
-        break;
-    }
-    case blk_snap_event_code_corrupted:
-    {
-        struct blk_snap_event_corrupted* corrupted = (struct blk_snap_event_corrupted*)(param.data);
-
-        ev.corrupted.origDevId = corrupted->orig_dev_id;
-        ev.corrupted.errorCode = corrupted->err_code;
-        break;
-    }
-    }
+    DecodeEvent(param.code, param.time_label, param.data, ev);
     return true;
 }
 
@@ -16,6 +16,7 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <algorithm>
 #include <blksnap/Blksnap.h>
 #include <blksnap/Cbt.h>
 #include <sys/stat.h>
@@ -25,6 +26,11 @@
 
 using namespace blksnap;
 
+/*
+ * The size of the CBT map portion that is read from the kernel module at once.
+ */
+static const unsigned int cbtWindowSize = 64 * 1024;
+
 class CCbt : public ICbt
 {
 public:
@@ -33,6 +39,8 @@ public:
 
     std::shared_ptr<SCbtInfo> GetCbtInfo(const std::string& original) override;
     std::shared_ptr<SCbtData> GetCbtData(const std::shared_ptr<SCbtInfo>& ptrCbtInfo) override;
+    bool ForEachChangedRange(const std::shared_ptr<SCbtInfo>& ptrPrevious,
+                             const std::function<void(const SRange&)>& callback) override;
 
 private:
     const struct blk_snap_cbt_info& GetCbtInfoInternal(unsigned int mj, unsigned int mn);
@@ -84,3 +92,55 @@ std::shared_ptr<SCbtData> CCbt::GetCbtData(const std::shared_ptr<SCbtInfo>& ptrC
 
     return ptrCbtMap;
 }
+
+bool CCbt::ForEachChangedRange(const std::shared_ptr<SCbtInfo>& ptrPrevious,
+                               const std::function<void(const SRange&)>& callback)
+{
+    struct blk_snap_dev originalDevId = {.mj = ptrPrevious->originalMajor, .mn = ptrPrevious->originalMinor};
+
+    m_blksnap.CollectTrackers(m_cbtInfos);
+    const struct blk_snap_cbt_info& cbtInfo = GetCbtInfoInternal(originalDevId.mj, originalDevId.mn);
+
+    if (uuid_compare(ptrPrevious->generationId, cbtInfo.generation_id.b) != 0)
+        return false;
+
+    const sector_t blockSectors = cbtInfo.blk_size >> SECTOR_SHIFT;
+    const sector_t capacity = cbtInfo.device_capacity >> SECTOR_SHIFT;
+    std::vector<uint8_t> window(std::min(cbtWindowSize, cbtInfo.blk_count));
+    bool isRange = false;
+    unsigned int first = 0;
+
+    auto rangeFound = [&](unsigned int from, unsigned int to) {
+        sector_t sector = from * blockSectors;
+
+        callback(SRange(sector, std::min(to * blockSectors, capacity) - sector));
+    };
+
+    for (unsigned int offset = 0; offset < cbtInfo.blk_count; offset += window.size())
+    {
+        unsigned int length = std::min(static_cast<unsigned int>(window.size()), cbtInfo.blk_count - offset);
+
+        m_blksnap.ReadCbtMap(originalDevId, offset, length, window.data());
+
+        for (unsigned int inx = 0; inx < length; inx++)
+        {
+            if (window[inx] > ptrPrevious->snapNumber)
+            {
+                if (!isRange)
+                {
+                    first = offset + inx;
+                    isRange = true;
+                }
+            }
+            else if (isRange)
+            {
+                rangeFound(first, offset + inx);
+                isRange = false;
+            }
+        }
+    }
+    if (isRange)
+        rangeFound(first, cbtInfo.blk_count);
+
+    return true;
+}
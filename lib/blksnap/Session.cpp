@@ -16,19 +16,26 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <algorithm>
 #include <atomic>
 #include <blksnap/Blksnap.h>
 #include <blksnap/Session.h>
 #include <boost/filesystem.hpp>
+#include <chrono>
+#include <condition_variable>
 #include <errno.h>
 #include <fcntl.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <linux/fiemap.h>
 #include <linux/fs.h>
+#include <map>
 #include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
@@ -59,6 +66,59 @@ struct SRangeVectorPos
     {};
 };
 
+/*
+ * The difference storage portion is not less than the amount that is filled
+ * in this number of seconds at the current fill rate.
+ */
+#define DIFF_STORAGE_LEAD_SECONDS 10
+/*
+ * If the previous portion was filled faster than in this number of seconds,
+ * the next portion is doubled.
+ */
+#define DIFF_STORAGE_FAST_FILL_SECONDS 10
+/*
+ * The portion can grow up to this number of the requested portions.
+ */
+#define DIFF_STORAGE_PORTION_MAX_FACTOR 64
+/*
+ * If the reserve cannot be prepared, the next attempt is made no earlier
+ * than in this number of seconds.
+ */
+#define DIFF_STORAGE_RESERVE_RETRY_SECONDS 10
+
+/*
+ * The maximum number of events that are received from the module at once.
+ */
+#define EVENTS_BATCH_SIZE 16
+
+/*
+ * The file for the difference storage that is prepared in advance, so that
+ * it can be appended as soon as the module requests more space.
+ */
+struct SReserve
+{
+    std::string filename;
+    struct blk_snap_dev devId;
+    std::vector<struct blk_snap_block_range> ranges;
+    sector_t sectors;
+
+    SReserve()
+        : devId{0}
+        , sectors(0)
+    {};
+};
+
+/*
+ * The ranges of a block device of the difference storage and the position
+ * up to which they have already been appended.
+ */
+struct SStorageDevice
+{
+    struct blk_snap_dev devId;
+    std::vector<SRange> ranges;
+    SRangeVectorPos position;
+};
+
 struct SState
 {
     std::atomic<bool> stop;
@@ -67,17 +127,62 @@ struct SState
     std::mutex lock;
     std::list<std::string> errorMessage;
     std::vector<std::string> diffStorageFiles;
+    int diffStorageNumber;
+
+    std::vector<SStorageDevice> diffStorageDevices;
+    size_t diffStorageDeviceInx;
+    EStoragePolicy storagePolicy;
+
+    sector_t portionSectors;
+    std::chrono::steady_clock::time_point portionTime;
+    SReserve reserve;
+    std::chrono::steady_clock::time_point reserveRetryTime;
+
+    int eventFd;
+    bool isWaitEventsSupported;
+    std::condition_variable wakeup;
+    bool isEventPending;
+};
 
-    std::vector<SRange> diffStorageRanges;
-    int diffDeviceMajor;
-    int diffDeviceMinor;
-    SRangeVectorPos diffStoragePosition;
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * The reactor waits for the events of all sessions of the process in one
+ * thread. The module signals the eventfd of the session when an event appears
+ * in the queue of its snapshot, so the thread sleeps while there are no events.
+ * The handlers must not block: the events are processed by the worker thread
+ * of each session.
+ */
+class CEventReactor
+{
+public:
+    CEventReactor();
+    ~CEventReactor();
+
+    void Add(int fd, const std::function<void()>& handler);
+    void Remove(int fd);
+
+    static std::shared_ptr<CEventReactor> Get();
+
+private:
+    void Thread();
+
+    int m_epollFd;
+    int m_wakeupFd;
+    std::atomic<bool> m_stop;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::map<int, std::function<void()>> m_handlers;
+    int m_activeFd;
+    std::thread m_thread;
 };
+#endif
 
 class CSession : public ISession
 {
 public:
-    CSession(const std::vector<std::string>& devices, const std::string& diffStorage, const SStorageRanges& diffStorageRanges);
+    CSession(const std::vector<std::string>& devices, const std::string& diffStorage,
+             const std::vector<SStorageRanges>& diffStorageRanges, EStoragePolicy storagePolicy,
+             unsigned int chunkShift = 0);
     ~CSession() override;
 
     std::string GetImageDevice(const std::string& original) override;
@@ -91,20 +196,41 @@ private:
     std::shared_ptr<CBlksnap> m_ptrBlksnap;
     std::shared_ptr<SState> m_ptrState;
     std::shared_ptr<std::thread> m_ptrThread;
+#ifdef BLK_SNAP_MODIFICATION
+    std::shared_ptr<CEventReactor> m_ptrReactor;
+#endif
 };
 
 std::shared_ptr<ISession> ISession::Create(const std::vector<std::string>& devices, const std::string& diffStorage)
 {
-    SStorageRanges diffStorageRanges;
+    std::vector<SStorageRanges> diffStorageRanges;
 
-    return std::make_shared<CSession>(devices, diffStorage, diffStorageRanges);
+    return std::make_shared<CSession>(devices, diffStorage, diffStorageRanges, EStoragePolicy::Linear);
 }
 
 std::shared_ptr<ISession> ISession::Create(const std::vector<std::string>& devices, const SStorageRanges& diffStorageRanges)
 {
     std::string diffStorage;
 
-    return std::make_shared<CSession>(devices, diffStorage, diffStorageRanges);
+    return std::make_shared<CSession>(devices, diffStorage, std::vector<SStorageRanges>{diffStorageRanges},
+                                      EStoragePolicy::Linear);
+}
+
+std::shared_ptr<ISession> ISession::Create(const std::vector<std::string>& devices,
+                                           const std::vector<SStorageRanges>& diffStorageRanges,
+                                           EStoragePolicy storagePolicy)
+{
+    std::string diffStorage;
+
+    return std::make_shared<CSession>(devices, diffStorage, diffStorageRanges, storagePolicy);
+}
+
+std::shared_ptr<ISession> ISession::Create(const std::vector<std::string>& devices, const std::string& diffStorage,
+                                           unsigned int chunkShift)
+{
+    std::vector<SStorageRanges> diffStorageRanges;
+
+    return std::make_shared<CSession>(devices, diffStorage, diffStorageRanges, EStoragePolicy::Linear, chunkShift);
 }
 
 namespace
@@ -230,28 +356,22 @@ namespace
         mn = minor(st.st_rdev);
     }
 
-    static void AllocateDiffStorage(std::shared_ptr<SState> ptrState, sector_t requestedSectors,
-                                    struct blk_snap_dev& dev_id, std::vector<struct blk_snap_block_range>& ranges)
+    static sector_t AllocateDiffStorage(SStorageDevice& device, sector_t requestedSectors,
+                                        std::vector<struct blk_snap_block_range>& ranges)
     {
-        if (ptrState->diffStorageRanges.size() <= ptrState->diffStoragePosition.rangeInx)
-            throw std::runtime_error("Failed to allocate diff storage. Not enough free ranges");
+        sector_t allocatedSectors = 0;
 
-        dev_id.mj = ptrState->diffDeviceMajor;
-        dev_id.mn = ptrState->diffDeviceMinor;
-
-        while (requestedSectors)
+        while (requestedSectors && (device.position.rangeInx < device.ranges.size()))
         {
-            const SRange& rg = ptrState->diffStorageRanges[ptrState->diffStoragePosition.rangeInx];
+            const SRange& rg = device.ranges[device.position.rangeInx];
 
-            sector_t ofs = rg.sector + ptrState->diffStoragePosition.rangeOfs;
-            sector_t sz = std::min(rg.count - ptrState->diffStoragePosition.rangeOfs, requestedSectors);
+            sector_t ofs = rg.sector + device.position.rangeOfs;
+            sector_t sz = std::min(rg.count - device.position.rangeOfs, requestedSectors);
 
             if (sz == 0)
             {
-                ptrState->diffStoragePosition.rangeOfs = 0;
-                if (ptrState->diffStorageRanges.size() == ++ptrState->diffStoragePosition.rangeInx)
-                    break;
-
+                device.position.rangeOfs = 0;
+                device.position.rangeInx++;
                 continue;
             }
 
@@ -264,9 +384,11 @@ namespace
                 ranges.push_back(rg);
             }
 
-            ptrState->diffStoragePosition.rangeOfs += sz;
+            device.position.rangeOfs += sz;
             requestedSectors -= sz;
+            allocatedSectors += sz;
         }
+        return allocatedSectors;
     }
     static void LogAppendedRanges(std::vector<struct blk_snap_block_range>& ranges)
     {
@@ -283,62 +405,163 @@ namespace
         std::cout << "Total sectors append: " << totalSectors << std::endl;
 
     }
-} //
 
-static void BlksnapThread(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState)
-{
-    struct SBlksnapEvent ev;
-    int diffStorageNumber = 1;
-    bool is_eventReady;
+    /*
+     * Calculates the size of the next portion of the difference storage.
+     * The portion covers several seconds of filling at the current rate, and
+     * it is doubled each time the previous portion was filled too fast.
+     */
+    static sector_t CalculatePortion(std::shared_ptr<SState> ptrState, const SBlksnapEventLowFreeSpace& lowFreeSpace)
+    {
+        auto now = std::chrono::steady_clock::now();
+        sector_t portion = std::max<sector_t>(lowFreeSpace.requestedSectors, ptrState->portionSectors);
+
+        portion = std::max<sector_t>(portion, lowFreeSpace.fillRate * DIFF_STORAGE_LEAD_SECONDS);
+        if (ptrState->portionSectors
+            && ((now - ptrState->portionTime) < std::chrono::seconds(DIFF_STORAGE_FAST_FILL_SECONDS)))
+            portion = std::max<sector_t>(portion, ptrState->portionSectors * 2);
+        portion = std::min<sector_t>(portion, lowFreeSpace.requestedSectors * DIFF_STORAGE_PORTION_MAX_FACTOR);
+
+        ptrState->portionSectors = portion;
+        ptrState->portionTime = now;
+        return portion;
+    }
 
-    while (!ptrState->stop)
+    static std::string NewDiffStorageFile(std::shared_ptr<SState> ptrState, sector_t sectors)
+    {
+        fs::path filepath(ptrState->diffStorage);
+        filepath += std::string("diff_storage#" + std::to_string(ptrState->diffStorageNumber++));
+        if (fs::exists(filepath))
+            fs::remove(filepath);
+        std::string filename = filepath.string();
+
+        FallocateStorage(filename, sectors << SECTOR_SHIFT);
+        {
+            std::lock_guard<std::mutex> guard(ptrState->lock);
+            ptrState->diffStorageFiles.push_back(filename);
+        }
+        return filename;
+    }
+
+    /*
+     * Prepares the reserve file while there are no events, so that the
+     * next request of the module is satisfied without waiting for the file
+     * system. The reserve is optional, so a failure is only logged, and the
+     * next attempt is postponed.
+     */
+    static void PrepareReserve(std::shared_ptr<SState> ptrState)
     {
+        SReserve& reserve = ptrState->reserve;
+        auto now = std::chrono::steady_clock::now();
+
+        if (ptrState->diffStorage.empty() || !ptrState->portionSectors || reserve.sectors)
+            return;
+        if (now < ptrState->reserveRetryTime)
+            return;
+
         try
         {
-            is_eventReady = ptrBlksnap->WaitEvent(ptrState->id, 100, ev);
+            reserve.filename = NewDiffStorageFile(ptrState, ptrState->portionSectors);
+            reserve.ranges.clear();
+            FiemapStorage(reserve.filename, reserve.devId, reserve.ranges);
+            reserve.sectors = ptrState->portionSectors;
         }
         catch (std::exception& ex)
         {
-            std::cerr << ex.what() << std::endl;
-            std::lock_guard<std::mutex> guard(ptrState->lock);
-            ptrState->errorMessage.push_back(std::string(ex.what()));
-            break;
+            std::cerr << "Failed to prepare the reserve of the diff storage: " << ex.what() << std::endl;
+            reserve = SReserve();
+            ptrState->reserveRetryTime = now + std::chrono::seconds(DIFF_STORAGE_RESERVE_RETRY_SECONDS);
         }
+    }
 
-        if (!is_eventReady)
-            continue;
+    /*
+     * With the round-robin policy, the portion is divided between all the
+     * devices of the difference storage, so that the module can spread the
+     * chunks over all of them. Otherwise, the devices are filled one after
+     * another.
+     */
+    static void AppendStorageRanges(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState,
+                                    sector_t portion)
+    {
+        std::vector<SStorageDevice>& devices = ptrState->diffStorageDevices;
+        bool isRoundRobin = (ptrState->storagePolicy == EStoragePolicy::RoundRobin);
+        sector_t share = portion;
+        bool isAppended = false;
+
+        if (isRoundRobin && !devices.empty())
+            share = (portion + devices.size() - 1) / devices.size();
+
+        for (size_t cnt = 0; portion && (cnt < devices.size()); cnt++)
+        {
+            SStorageDevice& device = devices[ptrState->diffStorageDeviceInx];
+            std::vector<struct blk_snap_block_range> ranges;
+            sector_t requested = std::min(share, portion);
+            sector_t allocated = AllocateDiffStorage(device, requested, ranges);
+
+            if (allocated)
+            {
+                LogAppendedRanges(ranges);
+                ptrBlksnap->AppendDiffStorage(ptrState->id, device.devId, ranges);
+                portion -= allocated;
+                isAppended = true;
+            }
+
+            if (isRoundRobin || (allocated < requested))
+                ptrState->diffStorageDeviceInx = (ptrState->diffStorageDeviceInx + 1) % devices.size();
+        }
+
+        if (!isAppended)
+            throw std::runtime_error("Failed to allocate diff storage. Not enough free ranges");
+    }
+
+    static void ProvideDiffStorage(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState,
+                                   const SBlksnapEventLowFreeSpace& lowFreeSpace)
+    {
+        sector_t portion = CalculatePortion(ptrState, lowFreeSpace);
+
+        if (ptrState->diffStorage.empty())
+        {
+            AppendStorageRanges(ptrBlksnap, ptrState, portion);
+            return;
+        }
+
+        SReserve& reserve = ptrState->reserve;
+        if (reserve.sectors)
+        {
+            LogAppendedRanges(reserve.ranges);
+            ptrBlksnap->AppendDiffStorage(ptrState->id, reserve.devId, reserve.ranges);
+            portion -= std::min(portion, reserve.sectors);
+            reserve = SReserve();
+        }
+
+        if (portion)
+        {
+            struct blk_snap_dev dev_id;
+            std::vector<struct blk_snap_block_range> ranges;
+
+            FiemapStorage(NewDiffStorageFile(ptrState, portion), dev_id, ranges);
+            LogAppendedRanges(ranges);
+            ptrBlksnap->AppendDiffStorage(ptrState->id, dev_id, ranges);
+        }
+    }
 
+    static void PushError(std::shared_ptr<SState> ptrState, const std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        std::lock_guard<std::mutex> guard(ptrState->lock);
+        ptrState->errorMessage.push_back(std::string(ex.what()));
+    }
+
+    static void ProcessEvent(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState,
+                             const SBlksnapEvent& ev)
+    {
         try
         {
             switch (ev.code)
             {
             case blk_snap_event_code_low_free_space:
-            {
-                struct blk_snap_dev dev_id;
-                std::vector<struct blk_snap_block_range> ranges;
-
-                if (!ptrState->diffStorage.empty())
-                {
-                    fs::path filepath(ptrState->diffStorage);
-                    filepath += std::string("diff_storage#" + std::to_string(diffStorageNumber++));
-                    if (fs::exists(filepath))
-                        fs::remove(filepath);
-                    std::string filename = filepath.string();
-
-                    {
-                        std::lock_guard<std::mutex> guard(ptrState->lock);
-                        ptrState->diffStorageFiles.push_back(filename);
-                    }
-                    FallocateStorage(filename, ev.lowFreeSpace.requestedSectors << SECTOR_SHIFT);
-                    FiemapStorage(filename, dev_id, ranges);
-                }
-                else
-                    AllocateDiffStorage(ptrState, ev.lowFreeSpace.requestedSectors, dev_id, ranges);
-
-                LogAppendedRanges(ranges);
-                ptrBlksnap->AppendDiffStorage(ptrState->id, dev_id, ranges);
-            }
-            break;
+                ProvideDiffStorage(ptrBlksnap, ptrState, ev.lowFreeSpace);
+                break;
             case blk_snap_event_code_corrupted:
                 throw std::system_error(ev.corrupted.errorCode, std::generic_category(),
                                         std::string("Snapshot corrupted for device "
@@ -351,14 +574,293 @@ static void BlksnapThread(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<
         }
         catch (std::exception& ex)
         {
-            std::cerr << ex.what() << std::endl;
+            PushError(ptrState, ex);
+        }
+    }
+
+#ifdef BLK_SNAP_MODIFICATION
+    static bool IsCompatible(CBlksnap& blksnap, enum blk_snap_compat_flags flag)
+    {
+        struct blk_snap_mod mod;
+
+        if (!blksnap.Modification(mod))
+            return false;
+
+        return !!(mod.compatibility_flags & (1ull << flag));
+    }
+
+    static void ReceiveEvents(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState)
+    {
+        if (ptrState->isWaitEventsSupported)
+        {
+            std::vector<SBlksnapEvent> events(EVENTS_BATCH_SIZE);
+            unsigned int lost;
+
+            while (ptrBlksnap->WaitEvents(ptrState->id, 0, events, lost))
+            {
+                if (lost)
+                    PushError(ptrState, std::runtime_error(std::to_string(lost)
+                                                           + " events of the snapshot were lost."));
+
+                for (const SBlksnapEvent& ev : events)
+                    ProcessEvent(ptrBlksnap, ptrState, ev);
+
+                if (events.size() < EVENTS_BATCH_SIZE)
+                    break;
+                events.resize(EVENTS_BATCH_SIZE);
+            }
+        }
+        else
+        {
+            struct SBlksnapEvent ev;
+
+            while (ptrBlksnap->WaitEvent(ptrState->id, 0, ev))
+                ProcessEvent(ptrBlksnap, ptrState, ev);
+        }
+    }
+
+    /*
+     * Wakes up the worker thread of the session. The reactor thread does not
+     * wait for the file system, so the allocation of the difference storage
+     * for one session does not delay the events of the other sessions.
+     * The counter of the eventfd is reset before the worker reads the queue,
+     * so an event that appears after that signals the eventfd again.
+     */
+    static void SessionEventHandler(std::shared_ptr<SState> ptrState)
+    {
+        eventfd_t counter;
+
+        if (::eventfd_read(ptrState->eventFd, &counter) && (errno != EAGAIN))
+        {
+            PushError(ptrState, std::system_error(errno, std::generic_category(), "[TBD]Failed to read eventfd."));
+            return;
+        }
+
+        {
             std::lock_guard<std::mutex> guard(ptrState->lock);
-            ptrState->errorMessage.push_back(std::string(ex.what()));
+            ptrState->isEventPending = true;
+        }
+        ptrState->wakeup.notify_one();
+    }
+
+    /*
+     * Receives the events of the session and prepares the reserve of the
+     * difference storage each time the reactor wakes it up.
+     */
+    static void SessionWorkerThread(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState)
+    {
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> guard(ptrState->lock);
+
+                ptrState->wakeup.wait(guard, [ptrState] { return ptrState->stop || ptrState->isEventPending; });
+                if (ptrState->stop)
+                    break;
+                ptrState->isEventPending = false;
+            }
+
+            try
+            {
+                ReceiveEvents(ptrBlksnap, ptrState);
+                PrepareReserve(ptrState);
+            }
+            catch (std::exception& ex)
+            {
+                PushError(ptrState, ex);
+            }
         }
     }
+
+    static std::shared_ptr<CEventReactor> StartEventReactor(std::shared_ptr<CBlksnap> ptrBlksnap,
+                                                            std::shared_ptr<SState> ptrState)
+    {
+        ptrState->eventFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (ptrState->eventFd < 0)
+            throw std::system_error(errno, std::generic_category(), "[TBD]Failed to create eventfd.");
+
+        ptrBlksnap->SetEventFd(ptrState->id, ptrState->eventFd);
+
+        std::shared_ptr<CEventReactor> ptrReactor = CEventReactor::Get();
+        ptrReactor->Add(ptrState->eventFd, [ptrState]() { SessionEventHandler(ptrState); });
+
+        /*
+         * The first call of the handler prepares the reserve of the
+         * difference storage.
+         */
+        ::eventfd_write(ptrState->eventFd, 1);
+        return ptrReactor;
+    }
+#endif
+} //
+
+#ifdef BLK_SNAP_MODIFICATION
+CEventReactor::CEventReactor()
+    : m_stop(false)
+    , m_activeFd(-1)
+{
+    m_epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollFd < 0)
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to create epoll.");
+
+    m_wakeupFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wakeupFd < 0)
+    {
+        int err = errno;
+
+        ::close(m_epollFd);
+        throw std::system_error(err, std::generic_category(), "[TBD]Failed to create eventfd.");
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = m_wakeupFd;
+    if (::epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeupFd, &ev))
+    {
+        int err = errno;
+
+        ::close(m_wakeupFd);
+        ::close(m_epollFd);
+        throw std::system_error(err, std::generic_category(), "[TBD]Failed to add eventfd to epoll.");
+    }
+
+    m_thread = std::thread(&CEventReactor::Thread, this);
+}
+
+CEventReactor::~CEventReactor()
+{
+    m_stop = true;
+    ::eventfd_write(m_wakeupFd, 1);
+    m_thread.join();
+
+    ::close(m_wakeupFd);
+    ::close(m_epollFd);
+}
+
+void CEventReactor::Add(int fd, const std::function<void()>& handler)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    struct epoll_event ev = {0};
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (::epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev))
+        throw std::system_error(errno, std::generic_category(), "[TBD]Failed to add eventfd to epoll.");
+
+    m_handlers[fd] = handler;
+}
+
+/*
+ * After the removal, the handler is not running and will not be called.
+ */
+void CEventReactor::Remove(int fd)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+
+    ::epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, NULL);
+    m_handlers.erase(fd);
+
+    if (std::this_thread::get_id() != m_thread.get_id())
+        m_cond.wait(guard, [this, fd] { return m_activeFd != fd; });
+}
+
+std::shared_ptr<CEventReactor> CEventReactor::Get()
+{
+    static std::mutex lock;
+    static std::weak_ptr<CEventReactor> instance;
+    std::lock_guard<std::mutex> guard(lock);
+
+    std::shared_ptr<CEventReactor> ptrReactor = instance.lock();
+    if (!ptrReactor)
+    {
+        ptrReactor = std::make_shared<CEventReactor>();
+        instance = ptrReactor;
+    }
+    return ptrReactor;
 }
 
-CSession::CSession(const std::vector<std::string>& devices, const std::string& diffStorage, const SStorageRanges& diffStorageRanges)
+void CEventReactor::Thread()
+{
+    struct epoll_event events[16];
+
+    while (!m_stop)
+    {
+        int count = ::epoll_wait(m_epollFd, events, 16, -1);
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            std::cerr << "Failed to wait for blksnap events. errno=" << errno << std::endl;
+            break;
+        }
+
+        for (int inx = 0; inx < count; inx++)
+        {
+            int fd = events[inx].data.fd;
+            std::function<void()> handler;
+
+            if (fd == m_wakeupFd)
+            {
+                eventfd_t counter;
+
+                ::eventfd_read(m_wakeupFd, &counter);
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                auto it = m_handlers.find(fd);
+
+                if (it == m_handlers.end())
+                    continue;
+                handler = it->second;
+                m_activeFd = fd;
+            }
+
+            handler();
+
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_activeFd = -1;
+            }
+            m_cond.notify_all();
+        }
+    }
+}
+#endif
+
+static void BlksnapThread(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState)
+{
+    struct SBlksnapEvent ev;
+    bool is_eventReady;
+
+    while (!ptrState->stop)
+    {
+        try
+        {
+            is_eventReady = ptrBlksnap->WaitEvent(ptrState->id, 100, ev);
+        }
+        catch (std::exception& ex)
+        {
+            PushError(ptrState, ex);
+            break;
+        }
+
+        if (!is_eventReady)
+        {
+            PrepareReserve(ptrState);
+            continue;
+        }
+
+        ProcessEvent(ptrBlksnap, ptrState, ev);
+    }
+}
+
+CSession::CSession(const std::vector<std::string>& devices, const std::string& diffStorage,
+                   const std::vector<SStorageRanges>& diffStorageRanges, EStoragePolicy storagePolicy,
+                   unsigned int chunkShift)
 {
     m_ptrBlksnap = std::make_shared<CBlksnap>();
 
@@ -379,21 +881,53 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
     std::vector<struct blk_snap_dev> blk_snap_devs;
     for (const SSessionInfo& info : m_devices)
         blk_snap_devs.push_back(info.original);
-    m_ptrBlksnap->Create(blk_snap_devs, m_id);
+#ifdef BLK_SNAP_MODIFICATION
+    if (chunkShift)
+        m_ptrBlksnap->Create(blk_snap_devs, chunkShift, m_id);
+    else
+#endif
+        m_ptrBlksnap->Create(blk_snap_devs, m_id);
 
     /*
      * Prepare state structure for thread
      */
     m_ptrState = std::make_shared<SState>();
     m_ptrState->stop = false;
+    m_ptrState->diffStorageNumber = 0;
+    m_ptrState->portionSectors = 0;
+    m_ptrState->eventFd = -1;
+    m_ptrState->isWaitEventsSupported = false;
+    m_ptrState->isEventPending = false;
     if (!diffStorage.empty())
         m_ptrState->diffStorage = diffStorage;
-    if (!diffStorageRanges.ranges.empty())
-        m_ptrState->diffStorageRanges = diffStorageRanges.ranges;
-    if (!diffStorageRanges.device.empty())
-        DeviceNumberByName(diffStorageRanges.device, m_ptrState->diffDeviceMajor, m_ptrState->diffDeviceMinor);
+    for (const SStorageRanges& storageRanges : diffStorageRanges)
+    {
+        SStorageDevice device;
+        int mj = 0;
+        int mn = 0;
+
+        if (storageRanges.ranges.empty())
+            continue;
+        if (!storageRanges.device.empty())
+            DeviceNumberByName(storageRanges.device, mj, mn);
+        device.devId.mj = mj;
+        device.devId.mn = mn;
+        device.ranges = storageRanges.ranges;
+        m_ptrState->diffStorageDevices.push_back(device);
+    }
+    m_ptrState->diffStorageDeviceInx = 0;
+    m_ptrState->storagePolicy = storagePolicy;
     uuid_copy(m_ptrState->id, m_id);
 
+#ifdef BLK_SNAP_MODIFICATION
+    /*
+     * Spread the chunks over all the devices of the difference storage.
+     */
+    if ((storagePolicy == EStoragePolicy::RoundRobin) && (m_ptrState->diffStorageDevices.size() > 1)
+        && IsCompatible(*m_ptrBlksnap, blk_snap_compat_flag_storage_policy))
+        m_ptrBlksnap->SetStoragePolicy(m_id, blk_snap_storage_policy_round_robin);
+#endif
+
     /*
      * Append first portion for diff storage
      */
@@ -403,29 +937,8 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
         switch (ev.code)
         {
         case blk_snap_event_code_low_free_space:
-        {
-            struct blk_snap_dev dev_id;
-            std::vector<struct blk_snap_block_range> ranges;
-
-            if (!m_ptrState->diffStorage.empty())
-            {
-                fs::path filepath(m_ptrState->diffStorage);
-                filepath += std::string("diff_storage#" + std::to_string(0));
-                if (fs::exists(filepath))
-                    fs::remove(filepath);
-                std::string filename = filepath.string();
-
-                m_ptrState->diffStorageFiles.push_back(filename);
-                FallocateStorage(filename, ev.lowFreeSpace.requestedSectors << SECTOR_SHIFT);
-                FiemapStorage(filename, dev_id, ranges);
-            }
-            else
-                AllocateDiffStorage(m_ptrState, ev.lowFreeSpace.requestedSectors, dev_id, ranges);
-
-            LogAppendedRanges(ranges);
-            m_ptrBlksnap->AppendDiffStorage(m_id, dev_id, ranges);
-        }
-        break;
+            ProvideDiffStorage(m_ptrBlksnap, m_ptrState, ev.lowFreeSpace);
+            break;
         case blk_snap_event_code_corrupted:
             throw std::system_error(ev.corrupted.errorCode, std::generic_category(),
                                     std::string("Failed to create snapshot for device "
@@ -438,9 +951,21 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
     }
 
     /*
-     * Start stretch snapshot thread
+     * Start stretch snapshot thread.
+     * If the module can signal an eventfd, the common reactor thread waits
+     * for the events of all sessions and wakes up the worker thread of the
+     * session.
      */
-    m_ptrThread = std::make_shared<std::thread>(BlksnapThread, m_ptrBlksnap, m_ptrState);
+#ifdef BLK_SNAP_MODIFICATION
+    m_ptrState->isWaitEventsSupported = IsCompatible(*m_ptrBlksnap, blk_snap_compat_flag_wait_events);
+    if (IsCompatible(*m_ptrBlksnap, blk_snap_compat_flag_event_fd))
+    {
+        m_ptrReactor = StartEventReactor(m_ptrBlksnap, m_ptrState);
+        m_ptrThread = std::make_shared<std::thread>(SessionWorkerThread, m_ptrBlksnap, m_ptrState);
+    }
+    else
+#endif
+        m_ptrThread = std::make_shared<std::thread>(BlksnapThread, m_ptrBlksnap, m_ptrState);
     ::usleep(0);
 
     /*
@@ -475,8 +1000,23 @@ CSession::~CSession()
     /**
      * Stop thread
      */
-    m_ptrState->stop = true;
-    m_ptrThread->join();
+#ifdef BLK_SNAP_MODIFICATION
+    if (m_ptrReactor)
+    {
+        m_ptrReactor->Remove(m_ptrState->eventFd);
+        m_ptrReactor.reset();
+        ::close(m_ptrState->eventFd);
+    }
+#endif
+    if (m_ptrThread)
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_ptrState->lock);
+            m_ptrState->stop = true;
+        }
+        m_ptrState->wakeup.notify_all();
+        m_ptrThread->join();
+    }
 
     /**
      * Destroy snapshot
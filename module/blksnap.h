@@ -41,6 +41,13 @@ enum blk_snap_ioctl {
 	blk_snap_ioctl_mod = IOCTL_MOD,
 	blk_snap_ioctl_setlog,
 	blk_snap_ioctl_get_sector_state,
+	blk_snap_ioctl_tracker_read_cbt_ranges,
+	blk_snap_ioctl_snapshot_create_ex,
+	blk_snap_ioctl_cache_limit,
+	blk_snap_ioctl_get_latency,
+	blk_snap_ioctl_snapshot_event_fd,
+	blk_snap_ioctl_snapshot_wait_events,
+	blk_snap_ioctl_snapshot_storage_policy,
 	blk_snap_ioctl_end_mod
 #endif
 };
@@ -86,6 +93,13 @@ struct blk_snap_version {
 enum blk_snap_compat_flags {
 	blk_snap_compat_flag_debug_sector_state,
 	blk_snap_compat_flag_setlog,
+	blk_snap_compat_flag_cbt_ranges,
+	blk_snap_compat_flag_snapshot_create_ex,
+	blk_snap_compat_flag_cache_limit,
+	blk_snap_compat_flag_get_latency,
+	blk_snap_compat_flag_event_fd,
+	blk_snap_compat_flag_wait_events,
+	blk_snap_compat_flag_storage_policy,
 	/*
 	 * Reserved for new features
 	 */
@@ -589,9 +603,20 @@ static_assert(sizeof(struct blk_snap_snapshot_event) == 4096,
  *	&blk_snap_event_code_low_free_space event.
  * @requested_nr_sect:
  *	The required number of sectors.
+ * @capacity_nr_sect:
+ *	The number of sectors in the difference storage.
+ * @filled_nr_sect:
+ *	The number of sectors already filled in the difference storage.
+ * @fill_rate:
+ *	The average number of sectors filled per second. Allows user space
+ *	to append more than the required number of sectors, if the difference
+ *	storage is filled quickly.
  */
 struct blk_snap_event_low_free_space {
 	__u64 requested_nr_sect;
+	__u64 capacity_nr_sect;
+	__u64 filled_nr_sect;
+	__u64 fill_rate;
 };
 
 /**
@@ -660,6 +685,285 @@ struct blk_snap_get_sector_state {
 	_IOW(BLK_SNAP, blk_snap_ioctl_get_sector_state,                        \
 	     struct blk_snap_get_sector_state)
 
+/**
+ * struct blk_snap_tracker_read_cbt_ranges - Argument for the
+ *	&IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES control.
+ * @dev_id:
+ *	Device ID.
+ * @snap_number:
+ *	The sequential number of changes of the previous snapshot. The blocks
+ *	with a greater number in the CBT map are considered changed.
+ * @count:
+ *	Size of @ranges in the number of &struct blk_snap_block_range.
+ *	Returns the number of ranges filled.
+ * @sector:
+ *	Offset in sectors from which the search begins. Returns the offset
+ *	from which the search should be continued.
+ * @ranges:
+ *	Pointer to the array of &struct blk_snap_block_range.
+ */
+struct blk_snap_tracker_read_cbt_ranges {
+	struct blk_snap_dev dev_id;
+	__u32 snap_number;
+	__u32 count;
+	__u64 sector;
+	struct blk_snap_block_range *ranges;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES - Read the changed ranges
+ *	from the CBT map.
+ *
+ * Allows to get only the ranges of the changed blocks instead of reading
+ * the whole table of changes. The ranges are read in a loop, until
+ * &blk_snap_tracker_read_cbt_ranges.sector reaches the device capacity.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES                                 \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_tracker_read_cbt_ranges,                \
+	      struct blk_snap_tracker_read_cbt_ranges)
+
+/**
+ * struct blk_snap_snapshot_create_ex - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_CREATE_EX control.
+ * @count:
+ *	Size of @dev_id_array in the number of &struct blk_snap_dev.
+ * @dev_id_array:
+ *	Pointer to the array of &struct blk_snap_dev.
+ * @id:
+ *	Return ID of the created snapshot.
+ * @chunk_shift:
+ *	The power of 2 for the preferred chunk size of the snapshot. Zero
+ *	allows the module to select the chunk size by the properties of each
+ *	block device. Otherwise, it should be at least the page size shift
+ *	and not more than 24.
+ */
+struct blk_snap_snapshot_create_ex {
+	__u32 count;
+	struct blk_snap_dev *dev_id_array;
+	struct blk_snap_uuid id;
+	__u32 chunk_shift;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_CREATE_EX - Create snapshot with parameters.
+ *
+ * Works like &IOCTL_BLK_SNAP_SNAPSHOT_CREATE, but allows to give a hint
+ * for the chunk size. A small chunk reduces the copy-on-write overhead for
+ * small random writes, a large one is better for sequential writes. The
+ * chunk size can still be increased for a device, if its physical block or
+ * its minimal I/O size is larger, or if there are too many chunks.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_CREATE_EX                                      \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_snapshot_create_ex,                     \
+	      struct blk_snap_snapshot_create_ex)
+
+/**
+ * struct blk_snap_cache_limit - Argument for the &IOCTL_BLK_SNAP_CACHE_LIMIT
+ *	control.
+ * @limit:
+ *	The new limit of memory for the chunk cache in bytes. It is rounded
+ *	up to a mebibyte. Zero leaves the limit unchanged. Returns the current
+ *	limit.
+ * @used:
+ *	Returns the memory occupied by the chunk cache in bytes.
+ */
+struct blk_snap_cache_limit {
+	__u64 limit;
+	__u64 used;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_CACHE_LIMIT - Set the limit of memory for the chunk
+ *	cache.
+ *
+ * The chunks of all snapshots are cached within one limit. When the limit is
+ * exceeded, the memory is released by the block devices that use more than
+ * their fair share of the limit. Under memory pressure, the kernel can also
+ * release the cached chunks that do not need to be stored.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_CACHE_LIMIT                                             \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_cache_limit, struct blk_snap_cache_limit)
+
+/*
+ * The number of buckets in the latency histogram.
+ */
+#define BLK_SNAP_LATENCY_BUCKETS 24
+
+/**
+ * struct blk_snap_get_latency - Argument for the &IOCTL_BLK_SNAP_GET_LATENCY
+ *	control.
+ * @reset:
+ *	If not zero, the histogram is reset after reading.
+ * @read:
+ *	The histogram of the completion latency of the reads from the original
+ *	block devices and from the difference storage.
+ * @write:
+ *	The histogram of the completion latency of the writes to the
+ *	difference storage.
+ *
+ * The bucket N counts the requests that were completed in 2^N to 2^(N+1)
+ * microseconds. The first bucket also counts faster requests, and the last
+ * one counts all slower requests.
+ */
+struct blk_snap_get_latency {
+	__u32 reset;
+	__u64 read[BLK_SNAP_LATENCY_BUCKETS];
+	__u64 write[BLK_SNAP_LATENCY_BUCKETS];
+};
+
+/**
+ * define IOCTL_BLK_SNAP_GET_LATENCY - Get the histogram of the completion
+ *	latency of the copy-on-write requests.
+ *
+ * The latency is counted from the submission of the request to the start of
+ * its completion processing, so it includes the time spent in the queue of
+ * the workqueue.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_GET_LATENCY                                             \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_get_latency, struct blk_snap_get_latency)
+
+/**
+ * struct blk_snap_snapshot_event_fd - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD control.
+ * @id:
+ *	Snapshot ID.
+ * @fd:
+ *	The file descriptor of the eventfd object. A negative value detaches
+ *	the eventfd that was attached before.
+ */
+struct blk_snap_snapshot_event_fd {
+	struct blk_snap_uuid id;
+	__s32 fd;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD - Attach an eventfd to the snapshot.
+ *
+ * The eventfd is signaled each time an event is added to the queue of the
+ * snapshot, and at once if the queue is not empty when it is attached.
+ * This allows to wait for the events of many snapshots in one thread using
+ * poll() or epoll, and then to receive them with
+ * &IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENT with a zero timeout.
+ * The eventfd is released when the snapshot is destroyed.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD                                       \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_event_fd,                       \
+	     struct blk_snap_snapshot_event_fd)
+
+/*
+ * The size of the data of the event record.
+ */
+#define BLK_SNAP_EVENT_RECORD_DATA_SIZE 48
+
+/**
+ * struct blk_snap_event_record - An event of the snapshot.
+ * @time_label:
+ *	Timestamp of the event.
+ * @code:
+ *	Code of the event.
+ * @data_size:
+ *	The number of bytes in the data of the event.
+ * @data:
+ *	The data of the event. Its structure depends on the code.
+ */
+struct blk_snap_event_record {
+	__s64 time_label;
+	__u32 code;
+	__u32 data_size;
+	__u8 data[BLK_SNAP_EVENT_RECORD_DATA_SIZE];
+};
+
+/**
+ * struct blk_snap_snapshot_wait_events - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENTS control.
+ * @id:
+ *	Snapshot ID.
+ * @timeout_ms:
+ *	Timeout for waiting in milliseconds.
+ * @count:
+ *	The size of the &records array on input, and the number of received
+ *	events on output.
+ * @lost:
+ *	The number of events that were lost since the previous call because
+ *	the queue of the snapshot was full.
+ * @records:
+ *	Pointer to the array of &struct blk_snap_event_record.
+ */
+struct blk_snap_snapshot_wait_events {
+	struct blk_snap_uuid id;
+	__u32 timeout_ms;
+	__u32 count;
+	__u32 lost;
+	struct blk_snap_event_record *records;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENTS - Wait and get several events
+ *	from the snapshot.
+ *
+ * The same as &IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENT, but all the events that
+ * are in the queue of the snapshot, up to the size of the array, are received
+ * at once.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENTS                                    \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_snapshot_wait_events,                   \
+	      struct blk_snap_snapshot_wait_events)
+
+/**
+ * enum blk_snap_storage_policy - The placement of the chunks on the block
+ *	devices of the difference storage.
+ * @blk_snap_storage_policy_linear:
+ *	The chunks are stored on one block device while it has free space.
+ *	This is the default.
+ * @blk_snap_storage_policy_round_robin:
+ *	Each next chunk is stored on the next block device, so the
+ *	copy-on-write throughput scales with the number of block devices.
+ */
+enum blk_snap_storage_policy {
+	blk_snap_storage_policy_linear,
+	blk_snap_storage_policy_round_robin,
+};
+
+/**
+ * struct blk_snap_snapshot_storage_policy - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_POLICY control.
+ * @id:
+ *	Snapshot ID.
+ * @policy:
+ *	The policy of placement. See &enum blk_snap_storage_policy.
+ */
+struct blk_snap_snapshot_storage_policy {
+	struct blk_snap_uuid id;
+	__u32 policy;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_POLICY - Set the placement policy of
+ *	the difference storage.
+ *
+ * The policy should be set after the snapshot is created and before it is
+ * taken, but it can also be changed later. To take advantage of the
+ * round-robin policy, the user space should append the ranges of all block
+ * devices of the difference storage in equal portions.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_STORAGE_POLICY                                 \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_storage_policy,                 \
+	     struct blk_snap_snapshot_storage_policy)
+
 #endif /* BLK_SNAP_MODIFICATION */
 
 #endif /* _UAPI_LINUX_BLK_SNAP_H */
@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: GPL-2.0
+#define pr_fmt(fmt) KBUILD_MODNAME "-cache-manager: " fmt
+
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
+#include "cache_manager.h"
+#include "diff_area.h"
+#include "diff_io.h"
+#include "log.h"
+
+extern int chunk_cache_memory_limit;
+
+/*
+ * The list of difference areas is protected by the mutex. The difference
+ * area cannot be released while it is in the list.
+ */
+static DEFINE_MUTEX(diff_areas_lock);
+static LIST_HEAD(diff_areas);
+static atomic_t diff_areas_count = ATOMIC_INIT(0);
+
+/*
+ * The memory occupied by the buffers of the cached chunks of all difference
+ * areas in bytes.
+ */
+static atomic64_t cache_used = ATOMIC64_INIT(0);
+
+static void cache_manager_balance_work(struct work_struct *work);
+static DECLARE_WORK(balance_work, cache_manager_balance_work);
+
+static inline u64 diff_area_cache_size(struct diff_area *diff_area)
+{
+	return (u64)diff_area_cache_count(diff_area) << diff_area->chunk_shift;
+}
+
+u64 cache_manager_limit(void)
+{
+	return (u64)max(READ_ONCE(chunk_cache_memory_limit), 0) << 20;
+}
+
+void cache_manager_set_limit(u64 limit)
+{
+	u64 limit_mb = DIV_ROUND_UP_ULL(limit, 1ull << 20);
+
+	WRITE_ONCE(chunk_cache_memory_limit,
+		   (int)min_t(u64, limit_mb, INT_MAX));
+	pr_debug("The limit of memory for the chunk cache is %llu MiB\n",
+		 limit_mb);
+
+	if ((u64)atomic64_read(&cache_used) > cache_manager_limit())
+		queue_work(system_wq, &balance_work);
+}
+
+u64 cache_manager_used(void)
+{
+	return (u64)atomic64_read(&cache_used);
+}
+
+/**
+ * cache_manager_is_over_limit() - Check whether the difference area should
+ *	release its cache.
+ * @diff_area:
+ *	Pointer to &struct diff_area.
+ *
+ * Return: true if the total memory of the cache exceeds the limit and the
+ *	difference area uses more than its fair share of the limit.
+ */
+bool cache_manager_is_over_limit(struct diff_area *diff_area)
+{
+	u64 limit = cache_manager_limit();
+	u64 share;
+
+	if ((u64)atomic64_read(&cache_used) <= limit)
+		return false;
+
+	share = div_u64(limit, max(atomic_read(&diff_areas_count), 1));
+	share = max_t(u64, share,
+		      (u64)CACHE_MANAGER_MINIMUM_CHUNKS << diff_area->chunk_shift);
+
+	return diff_area_cache_size(diff_area) > share;
+}
+
+/*
+ * The chunk has been placed in the cache of the difference area.
+ * If the limit is exceeded, the release of the cache is initiated for the
+ * difference area itself or for the difference areas that use more than
+ * their fair share.
+ */
+void cache_manager_charge(struct diff_area *diff_area)
+{
+	u64 used;
+
+	used = atomic64_add_return(1ll << diff_area->chunk_shift, &cache_used);
+	if (used <= cache_manager_limit())
+		return;
+
+	if (cache_manager_is_over_limit(diff_area))
+		queue_work(diff_io_wq, &diff_area->cache_release_work);
+	else
+		queue_work(system_wq, &balance_work);
+}
+
+/*
+ * The chunks have been removed from the cache of the difference area.
+ */
+void cache_manager_uncharge(struct diff_area *diff_area, unsigned long count)
+{
+	atomic64_sub((s64)count << diff_area->chunk_shift, &cache_used);
+}
+
+static void cache_manager_balance_work(struct work_struct *work)
+{
+	struct diff_area *diff_area;
+
+	mutex_lock(&diff_areas_lock);
+	list_for_each_entry(diff_area, &diff_areas, cache_manager_link) {
+		if (cache_manager_is_over_limit(diff_area))
+			queue_work(diff_io_wq, &diff_area->cache_release_work);
+	}
+	mutex_unlock(&diff_areas_lock);
+}
+
+void cache_manager_register(struct diff_area *diff_area)
+{
+	mutex_lock(&diff_areas_lock);
+	list_add_tail(&diff_area->cache_manager_link, &diff_areas);
+	atomic_inc(&diff_areas_count);
+	mutex_unlock(&diff_areas_lock);
+}
+
+/*
+ * After the difference area is unregistered, the cache manager no longer
+ * initiates the release of its cache. But the chunks that remain in its
+ * cache are still charged, so they should be uncharged when they are
+ * released.
+ */
+void cache_manager_unregister(struct diff_area *diff_area)
+{
+	mutex_lock(&diff_areas_lock);
+	if (!list_empty(&diff_area->cache_manager_link)) {
+		list_del_init(&diff_area->cache_manager_link);
+		atomic_dec(&diff_areas_count);
+	}
+	mutex_unlock(&diff_areas_lock);
+}
+
+/*
+ * The shrinker is called in the memory reclaim context. The mutex may
+ * be held by a thread that is waiting for memory, so it is only tried.
+ */
+static unsigned long cache_manager_count_objects(struct shrinker *shrinker,
+						 struct shrink_control *sc)
+{
+	struct diff_area *diff_area;
+	unsigned long count = 0;
+
+	if (!mutex_trylock(&diff_areas_lock))
+		return 0;
+	list_for_each_entry(diff_area, &diff_areas, cache_manager_link)
+		count += diff_area_cache_clean_count(diff_area);
+	mutex_unlock(&diff_areas_lock);
+
+	return count;
+}
+
+static unsigned long cache_manager_scan_objects(struct shrinker *shrinker,
+						struct shrink_control *sc)
+{
+	struct diff_area *diff_area;
+	unsigned long freed = 0;
+
+	if (!mutex_trylock(&diff_areas_lock))
+		return SHRINK_STOP;
+	list_for_each_entry(diff_area, &diff_areas, cache_manager_link) {
+		freed += diff_area_cache_shrink(diff_area,
+						sc->nr_to_scan - freed);
+		if (freed >= sc->nr_to_scan)
+			break;
+	}
+	/*
+	 * The next scan starts from the next difference area, so that the
+	 * pressure is distributed between all of them.
+	 */
+	if (!list_empty(&diff_areas))
+		list_rotate_left(&diff_areas);
+	mutex_unlock(&diff_areas_lock);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+#ifdef HAVE_SHRINKER_ALLOC
+static struct shrinker *cache_shrinker;
+#else
+static struct shrinker cache_shrinker = {
+	.count_objects = cache_manager_count_objects,
+	.scan_objects = cache_manager_scan_objects,
+	.seeks = DEFAULT_SEEKS,
+};
+#endif
+
+int cache_manager_init(void)
+{
+#if defined(HAVE_SHRINKER_ALLOC)
+	cache_shrinker = shrinker_alloc(0, "blksnap-cache");
+	if (!cache_shrinker)
+		return -ENOMEM;
+
+	cache_shrinker->count_objects = cache_manager_count_objects;
+	cache_shrinker->scan_objects = cache_manager_scan_objects;
+	shrinker_register(cache_shrinker);
+	return 0;
+#elif defined(HAVE_REGISTER_SHRINKER_NAME)
+	return register_shrinker(&cache_shrinker, "blksnap-cache");
+#else
+	return register_shrinker(&cache_shrinker);
+#endif
+}
+
+void cache_manager_done(void)
+{
+#ifdef HAVE_SHRINKER_ALLOC
+	shrinker_free(cache_shrinker);
+	cache_shrinker = NULL;
+#else
+	unregister_shrinker(&cache_shrinker);
+#endif
+	cancel_work_sync(&balance_work);
+}
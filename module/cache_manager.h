@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __BLK_SNAP_CACHE_MANAGER_H
+#define __BLK_SNAP_CACHE_MANAGER_H
+
+#include <linux/types.h>
+
+struct diff_area;
+
+/*
+ * The number of chunks that each difference area is allowed to keep in the
+ * cache, even if its fair share of the memory limit is less.
+ */
+#define CACHE_MANAGER_MINIMUM_CHUNKS 4
+
+/**
+ * DOC: Cache manager
+ *
+ * The chunks of all difference areas are cached within one memory limit.
+ * The manager counts the memory occupied by the buffers of the cached chunks.
+ * While the limit is not reached, any difference area can use as much of it
+ * as it needs. When the limit is exceeded, the memory is released by the
+ * difference areas that use more than their fair share. The fair share is
+ * the limit divided by the number of difference areas.
+ *
+ * The manager also registers a shrinker. Under memory pressure, the kernel
+ * can release the buffers of clean chunks and the pools of free buffers.
+ */
+int cache_manager_init(void);
+void cache_manager_done(void);
+
+void cache_manager_register(struct diff_area *diff_area);
+void cache_manager_unregister(struct diff_area *diff_area);
+
+void cache_manager_charge(struct diff_area *diff_area);
+void cache_manager_uncharge(struct diff_area *diff_area, unsigned long count);
+bool cache_manager_is_over_limit(struct diff_area *diff_area);
+
+u64 cache_manager_limit(void);
+void cache_manager_set_limit(u64 limit);
+u64 cache_manager_used(void);
+
+#endif /* __BLK_SNAP_CACHE_MANAGER_H */
@@ -51,59 +51,76 @@ static void cbt_map_calculate_block_size(struct cbt_map *cbt_map)
 	cbt_map->blk_count = count;
 }
 
+static inline unsigned char *cbt_map_buffer_alloc(size_t size)
+{
+	unsigned char *buffer;
+
+	/*
+	 * The tables are updated by words, so their size is aligned to
+	 * the size of the word.
+	 */
+	buffer = __vmalloc(round_up(size, sizeof(unsigned long)),
+			   GFP_NOIO | __GFP_ZERO);
+	if (buffer)
+		memory_object_inc(memory_object_cbt_buffer);
+	return buffer;
+}
+
+static inline void cbt_map_buffer_free(unsigned char **buffer)
+{
+	if (*buffer) {
+		memory_object_dec(memory_object_cbt_buffer);
+		vfree(*buffer);
+		*buffer = NULL;
+	}
+}
+
+static void cbt_map_deallocate(struct cbt_map *cbt_map)
+{
+	cbt_map_buffer_free(&cbt_map->read_map);
+	cbt_map_buffer_free(&cbt_map->write_map);
+	cbt_map_buffer_free(&cbt_map->read_summary);
+	cbt_map_buffer_free(&cbt_map->write_summary);
+}
+
 static int cbt_map_allocate(struct cbt_map *cbt_map)
 {
-	unsigned char *read_map = NULL;
-	unsigned char *write_map = NULL;
-	size_t size = cbt_map->blk_count;
+	size_t summary_size =
+		DIV_ROUND_UP(cbt_map->blk_count, CBT_MAP_SUMMARY_BLOCKS);
 
-	pr_debug("Allocate CBT map of %zu blocks\n", size);
+	pr_debug("Allocate CBT map of %zu blocks\n", cbt_map->blk_count);
 
 	if (cbt_map->read_map || cbt_map->write_map)
 		return -EINVAL;
 
-	read_map = __vmalloc(size, GFP_NOIO | __GFP_ZERO);
-	if (!read_map)
-		return -ENOMEM;
-
-	write_map = __vmalloc(size, GFP_NOIO | __GFP_ZERO);
-	if (!write_map) {
-		vfree(read_map);
+	cbt_map->read_map = cbt_map_buffer_alloc(cbt_map->blk_count);
+	cbt_map->write_map = cbt_map_buffer_alloc(cbt_map->blk_count);
+	cbt_map->read_summary = cbt_map_buffer_alloc(summary_size);
+	cbt_map->write_summary = cbt_map_buffer_alloc(summary_size);
+	if (!cbt_map->read_map || !cbt_map->write_map ||
+	    !cbt_map->read_summary || !cbt_map->write_summary) {
+		cbt_map_deallocate(cbt_map);
 		return -ENOMEM;
 	}
 
-	cbt_map->read_map = read_map;
-	memory_object_inc(memory_object_cbt_buffer);
-	cbt_map->write_map = write_map;
-	memory_object_inc(memory_object_cbt_buffer);
-
 	cbt_map->snap_number_previous = 0;
 	cbt_map->snap_number_active = 1;
 	generate_random_uuid(cbt_map->generation_id.b);
+	cbt_map->is_merge_needed = false;
 	cbt_map->is_corrupted = false;
 
 	return 0;
 }
 
-static void cbt_map_deallocate(struct cbt_map *cbt_map)
-{
-	cbt_map->is_corrupted = false;
-
-	if (cbt_map->read_map) {
-		memory_object_dec(memory_object_cbt_buffer);
-		vfree(cbt_map->read_map);
-		cbt_map->read_map = NULL;
-	}
-
-	if (cbt_map->write_map) {
-		memory_object_dec(memory_object_cbt_buffer);
-		vfree(cbt_map->write_map);
-		cbt_map->write_map = NULL;
-	}
-}
-
 int cbt_map_reset(struct cbt_map *cbt_map, sector_t device_capacity)
 {
+	/*
+	 * Forbid new updates of the tables and wait for the completion of
+	 * the updates that are already in progress before releasing them.
+	 */
+	WRITE_ONCE(cbt_map->is_corrupted, true);
+	synchronize_srcu(&cbt_map->srcu);
+
 	cbt_map_deallocate(cbt_map);
 
 	cbt_map->device_capacity = device_capacity;
@@ -117,6 +134,7 @@ static inline void cbt_map_destroy(struct cbt_map *cbt_map)
 	pr_debug("CBT map destroy\n");
 
 	cbt_map_deallocate(cbt_map);
+	cleanup_srcu_struct(&cbt_map->srcu);
 	kfree(cbt_map);
 	memory_object_dec(memory_object_cbt_map);
 }
@@ -133,6 +151,14 @@ struct cbt_map *cbt_map_create(struct block_device *bdev)
 		return NULL;
 	memory_object_inc(memory_object_cbt_map);
 
+	ret = init_srcu_struct(&cbt_map->srcu);
+	if (ret) {
+		pr_err("Failed to initialize SRCU. errno=%d\n", abs(ret));
+		kfree(cbt_map);
+		memory_object_dec(memory_object_cbt_map);
+		return NULL;
+	}
+
 	cbt_map->device_capacity = bdev_nr_sectors(bdev);
 	cbt_map_calculate_block_size(cbt_map);
 
@@ -155,71 +181,267 @@ void cbt_map_destroy_cb(struct kref *kref)
 	cbt_map_destroy(container_of(kref, struct cbt_map, kref));
 }
 
+#define CBT_MAP_WORD_SIZE sizeof(unsigned long)
+
+union cbt_map_word {
+	unsigned long word;
+	u8 bytes[CBT_MAP_WORD_SIZE];
+};
+
+/*
+ * Fills the word with the same byte value.
+ */
+static inline unsigned long cbt_map_word_pattern(u8 snap_number)
+{
+	return (ULONG_MAX / 0xFF) * snap_number;
+}
+
+/*
+ * Raises the bytes from @from to @to of the word to the sequential number.
+ * The word is exchanged atomically, so concurrent updates of neighbouring
+ * blocks are not lost.
+ */
+static inline void cbt_map_word_max(unsigned long *ptr, size_t from,
+				    size_t to, u8 snap_number)
+{
+	union cbt_map_word old, new;
+	unsigned long prev;
+	size_t ofs;
+
+	old.word = READ_ONCE(*ptr);
+	for (;;) {
+		new.word = old.word;
+		for (ofs = from; ofs < to; ofs++)
+			if (new.bytes[ofs] < snap_number)
+				new.bytes[ofs] = snap_number;
+		if (new.word == old.word)
+			break;
+
+		prev = cmpxchg(ptr, old.word, new.word);
+		if (prev == old.word)
+			break;
+		old.word = prev;
+	}
+}
+
+/*
+ * Raises each byte of the word to the value of the corresponding byte in
+ * @value.
+ */
+static inline void cbt_map_word_merge(unsigned long *ptr,
+				      union cbt_map_word value)
+{
+	union cbt_map_word old, new;
+	unsigned long prev;
+	size_t ofs;
+
+	old.word = READ_ONCE(*ptr);
+	for (;;) {
+		for (ofs = 0; ofs < CBT_MAP_WORD_SIZE; ofs++)
+			new.bytes[ofs] = max(old.bytes[ofs], value.bytes[ofs]);
+		if (new.word == old.word)
+			break;
+
+		prev = cmpxchg(ptr, old.word, new.word);
+		if (prev == old.word)
+			break;
+		old.word = prev;
+	}
+}
+
+/**
+ * cbt_map_switch() - Switch the tables at the moment of taking a snapshot.
+ * @cbt_map:
+ *	Pointer to the change tracking map.
+ *
+ * Instead of copying the writable table to the readable one, the tables are
+ * swapped. The new writable table still lacks the changes made since the
+ * previous snapshot, so cbt_map_merge() must be called to complete the
+ * switch. Except for the start of a new generation, when the writable
+ * table is cleared, the operation does not depend on the size of the
+ * tables, so it can be called while the queue of the block device is frozen.
+ */
 void cbt_map_switch(struct cbt_map *cbt_map)
 {
+	unsigned long snap_number;
+	unsigned char *map;
+
 	pr_debug("CBT map switch\n");
 	spin_lock(&cbt_map->locker);
 
 	cbt_map->snap_number_previous = cbt_map->snap_number_active;
-	++cbt_map->snap_number_active;
-	if (cbt_map->snap_number_active == 256) {
-		cbt_map->snap_number_active = 1;
-
+	snap_number = cbt_map->snap_number_active + 1;
+	if (snap_number == 256) {
+		snap_number = 1;
+		/*
+		 * The bytes of the previous generation cannot be told apart
+		 * from the new ones, so the writable table is cleared before
+		 * the new number is published.
+		 */
 		memset(cbt_map->write_map, 0, cbt_map->blk_count);
-
+		memset(cbt_map->write_summary, 0,
+		       DIV_ROUND_UP(cbt_map->blk_count, CBT_MAP_SUMMARY_BLOCKS));
+		cbt_map->is_merge_needed = false;
 		generate_random_uuid(cbt_map->generation_id.b);
 
 		pr_debug("CBT reset\n");
-	} else
-		memcpy(cbt_map->read_map, cbt_map->write_map, cbt_map->blk_count);
+	} else {
+		map = cbt_map->read_map;
+		WRITE_ONCE(cbt_map->read_map, cbt_map->write_map);
+		WRITE_ONCE(cbt_map->write_map, map);
+
+		map = cbt_map->read_summary;
+		WRITE_ONCE(cbt_map->read_summary, cbt_map->write_summary);
+		WRITE_ONCE(cbt_map->write_summary, map);
+
+		cbt_map->is_merge_needed = true;
+	}
+	/*
+	 * Whoever sees the new sequential number should see the new writable
+	 * table too.
+	 */
+	smp_wmb();
+	WRITE_ONCE(cbt_map->snap_number_active, snap_number);
+
 	spin_unlock(&cbt_map->locker);
 }
 
+/*
+ * Merges two tables of the same size word by word, so that each byte
+ * of both tables gets the greatest value.
+ */
+static void cbt_map_merge_tables(unsigned char *read_table,
+				 unsigned char *write_table, size_t size)
+{
+	unsigned long *read_ptr = (unsigned long *)read_table;
+	unsigned long *write_ptr = (unsigned long *)write_table;
+	union cbt_map_word read_value, write_value;
+	size_t count = DIV_ROUND_UP(size, CBT_MAP_WORD_SIZE);
+	size_t inx;
+
+	for (inx = 0; inx < count; inx++) {
+		read_value.word = READ_ONCE(read_ptr[inx]);
+		write_value.word = READ_ONCE(write_ptr[inx]);
+		if (read_value.word != write_value.word) {
+			cbt_map_word_merge(&write_ptr[inx], read_value);
+			cbt_map_word_merge(&read_ptr[inx], write_value);
+		}
+
+		if (!(inx % (PAGE_SIZE / CBT_MAP_WORD_SIZE)))
+			cond_resched();
+	}
+}
+
+/**
+ * cbt_map_merge() - Complete the switch of the tables.
+ * @cbt_map:
+ *	Pointer to the change tracking map.
+ *
+ * Waits for the completion of the updates that could use the previous
+ * sequential number. Then the tables are merged word by word without
+ * locking, so the writes to the block device are not stalled. After that,
+ * the writable table contains all changes, and the readable one contains
+ * all changes made before the switch. The blocks that are changed during
+ * the merge may get into the readable table with the new number, but this
+ * can only increase the number of changed blocks.
+ */
+void cbt_map_merge(struct cbt_map *cbt_map)
+{
+	bool is_merge_needed;
+	size_t summary_size =
+		DIV_ROUND_UP(cbt_map->blk_count, CBT_MAP_SUMMARY_BLOCKS);
+
+	synchronize_srcu(&cbt_map->srcu);
+
+	spin_lock(&cbt_map->locker);
+	is_merge_needed = cbt_map->is_merge_needed;
+	cbt_map->is_merge_needed = false;
+	spin_unlock(&cbt_map->locker);
+
+	if (!is_merge_needed)
+		return;
+
+	cbt_map_merge_tables(cbt_map->read_map, cbt_map->write_map,
+			     cbt_map->blk_count);
+	cbt_map_merge_tables(cbt_map->read_summary, cbt_map->write_summary,
+			     summary_size);
+}
+
+/*
+ * Raises the bytes of the table from @first to @last to the sequential
+ * number. The table is processed word by word. For a large range, most of
+ * the words have already been marked with the current number, and they
+ * are skipped without writing to the cache line.
+ */
+static inline void cbt_map_fill_max(unsigned char *table, size_t first,
+				    size_t last, u8 snap_number)
+{
+	unsigned long *ptr = (unsigned long *)table;
+	unsigned long pattern = cbt_map_word_pattern(snap_number);
+	size_t word_first = first / CBT_MAP_WORD_SIZE;
+	size_t word_last = last / CBT_MAP_WORD_SIZE;
+	size_t inx;
+	size_t from;
+	size_t to;
+
+	for (inx = word_first; inx <= word_last; inx++) {
+		from = (inx == word_first) ? (first % CBT_MAP_WORD_SIZE) : 0;
+		to = (inx == word_last) ? (last % CBT_MAP_WORD_SIZE) + 1 :
+					  CBT_MAP_WORD_SIZE;
+
+		if ((from == 0) && (to == CBT_MAP_WORD_SIZE) &&
+		    (READ_ONCE(ptr[inx]) == pattern))
+			continue;
+
+		cbt_map_word_max(&ptr[inx], from, to, snap_number);
+	}
+}
+
 static inline int _cbt_map_set(struct cbt_map *cbt_map, sector_t sector_start,
 			       sector_t sector_cnt, u8 snap_number,
-			       unsigned char *map)
+			       unsigned char *map, unsigned char *summary)
 {
-	int res = 0;
-	u8 num;
-	size_t inx;
 	size_t cbt_block_first = (size_t)(
 		sector_start >> (cbt_map->blk_size_shift - SECTOR_SHIFT));
 	size_t cbt_block_last = (size_t)(
 		(sector_start + sector_cnt - 1) >>
 		(cbt_map->blk_size_shift - SECTOR_SHIFT));
 
-	for (inx = cbt_block_first; inx <= cbt_block_last; ++inx) {
-		if (unlikely(inx >= cbt_map->blk_count)) {
-			pr_err("Block index is too large.\n");
-			pr_err("Block #%zu was demanded, map size %zu blocks.\n",
-			       inx, cbt_map->blk_count);
-			res = -EINVAL;
-			break;
-		}
-
-		num = map[inx];
-		if (num < snap_number)
-			map[inx] = snap_number;
+	if (unlikely(cbt_block_last >= cbt_map->blk_count)) {
+		pr_err("Block index is too large.\n");
+		pr_err("Block #%zu was demanded, map size %zu blocks.\n",
+		       cbt_block_last, cbt_map->blk_count);
+		return -EINVAL;
 	}
-	return res;
+
+	cbt_map_fill_max(map, cbt_block_first, cbt_block_last, snap_number);
+	cbt_map_fill_max(summary, cbt_block_first >> CBT_MAP_SUMMARY_SHIFT,
+			 cbt_block_last >> CBT_MAP_SUMMARY_SHIFT, snap_number);
+
+	return 0;
 }
 
 int cbt_map_set(struct cbt_map *cbt_map, sector_t sector_start,
 		sector_t sector_cnt)
 {
 	int res;
+	int srcu_idx;
+	u8 snap_number;
 
-	spin_lock(&cbt_map->locker);
-	if (unlikely(cbt_map->is_corrupted)) {
-		spin_unlock(&cbt_map->locker);
-		return -EINVAL;
+	srcu_idx = srcu_read_lock(&cbt_map->srcu);
+	if (unlikely(READ_ONCE(cbt_map->is_corrupted))) {
+		res = -EINVAL;
+		goto out;
 	}
-	res = _cbt_map_set(cbt_map, sector_start, sector_cnt,
-			   (u8)cbt_map->snap_number_active, cbt_map->write_map);
+	snap_number = (u8)READ_ONCE(cbt_map->snap_number_active);
+	smp_rmb();
+	res = _cbt_map_set(cbt_map, sector_start, sector_cnt, snap_number,
+			   READ_ONCE(cbt_map->write_map),
+			   READ_ONCE(cbt_map->write_summary));
 	if (unlikely(res))
-		cbt_map->is_corrupted = true;
-
-	spin_unlock(&cbt_map->locker);
+		WRITE_ONCE(cbt_map->is_corrupted, true);
+out:
+	srcu_read_unlock(&cbt_map->srcu, srcu_idx);
 
 	return res;
 }
@@ -228,19 +450,37 @@ int cbt_map_set_both(struct cbt_map *cbt_map, sector_t sector_start,
 		     sector_t sector_cnt)
 {
 	int res;
+	int srcu_idx;
+	u8 snap_number_active;
+	u8 snap_number_previous;
+	unsigned char *write_map;
+	unsigned char *write_summary;
+	unsigned char *read_map;
+	unsigned char *read_summary;
+
+	srcu_idx = srcu_read_lock(&cbt_map->srcu);
+	if (unlikely(READ_ONCE(cbt_map->is_corrupted))) {
+		res = -EINVAL;
+		goto out;
+	}
 
 	spin_lock(&cbt_map->locker);
-	if (unlikely(cbt_map->is_corrupted)) {
-		spin_unlock(&cbt_map->locker);
-		return -EINVAL;
-	}
+	snap_number_active = (u8)cbt_map->snap_number_active;
+	snap_number_previous = (u8)cbt_map->snap_number_previous;
+	write_map = cbt_map->write_map;
+	write_summary = cbt_map->write_summary;
+	read_map = cbt_map->read_map;
+	read_summary = cbt_map->read_summary;
+	spin_unlock(&cbt_map->locker);
+
 	res = _cbt_map_set(cbt_map, sector_start, sector_cnt,
-			   (u8)cbt_map->snap_number_active, cbt_map->write_map);
+			   snap_number_active, write_map, write_summary);
 	if (!res)
 		res = _cbt_map_set(cbt_map, sector_start, sector_cnt,
-				   (u8)cbt_map->snap_number_previous,
-				   cbt_map->read_map);
-	spin_unlock(&cbt_map->locker);
+				   snap_number_previous, read_map,
+				   read_summary);
+out:
+	srcu_read_unlock(&cbt_map->srcu, srcu_idx);
 
 	return res;
 }
@@ -250,14 +490,25 @@ size_t cbt_map_read_to_user(struct cbt_map *cbt_map, char __user *user_buff,
 {
 	size_t readed = 0;
 	size_t left_size;
-	size_t real_size = min((cbt_map->blk_count - offset), size);
+	size_t real_size;
+	int srcu_idx;
+
+	if (unlikely(offset > cbt_map->blk_count)) {
+		pr_err("CBT table offset %zu is out of range\n", offset);
+		return -EINVAL;
+	}
+	real_size = min((cbt_map->blk_count - offset), size);
 
-	if (unlikely(cbt_map->is_corrupted)) {
+	srcu_idx = srcu_read_lock(&cbt_map->srcu);
+	if (unlikely(READ_ONCE(cbt_map->is_corrupted))) {
+		srcu_read_unlock(&cbt_map->srcu, srcu_idx);
 		pr_err("CBT table was corrupted\n");
 		return -EFAULT;
 	}
 
-	left_size = copy_to_user(user_buff, cbt_map->read_map, real_size);
+	left_size = copy_to_user(user_buff, cbt_map->read_map + offset,
+				 real_size);
+	srcu_read_unlock(&cbt_map->srcu, srcu_idx);
 
 	if (left_size == 0)
 		readed = real_size;
@@ -270,6 +521,134 @@ size_t cbt_map_read_to_user(struct cbt_map *cbt_map, char __user *user_buff,
 	return readed;
 }
 
+static inline void cbt_map_range_add(struct cbt_map *cbt_map,
+				     struct blk_snap_block_range *range,
+				     size_t first, size_t last)
+{
+	size_t shift = cbt_map->blk_size_shift - SECTOR_SHIFT;
+	sector_t from = (sector_t)first << shift;
+	sector_t to = min_t(sector_t, (sector_t)last << shift,
+			    cbt_map->device_capacity);
+
+	range->sector_offset = from;
+	range->sector_count = to - from;
+}
+
+/*
+ * Searches the readable table for the blocks with a number greater than
+ * @snap_number and joins adjacent blocks to ranges. The groups of blocks
+ * without changes are skipped by the summary table.
+ */
+static int cbt_map_read_ranges(struct cbt_map *cbt_map, u8 snap_number,
+			       sector_t *sector,
+			       struct blk_snap_block_range *ranges,
+			       unsigned int count)
+{
+	size_t shift = cbt_map->blk_size_shift - SECTOR_SHIFT;
+	size_t blk = (size_t)(*sector >> shift);
+	size_t group_end;
+	size_t first = 0;
+	bool is_range = false;
+	unsigned int nr = 0;
+	unsigned char *map;
+	unsigned char *summary;
+	int srcu_idx;
+
+	srcu_idx = srcu_read_lock(&cbt_map->srcu);
+	if (unlikely(READ_ONCE(cbt_map->is_corrupted))) {
+		srcu_read_unlock(&cbt_map->srcu, srcu_idx);
+		pr_err("CBT table was corrupted\n");
+		return -EFAULT;
+	}
+	map = READ_ONCE(cbt_map->read_map);
+	summary = READ_ONCE(cbt_map->read_summary);
+
+	while (blk < cbt_map->blk_count) {
+		if (READ_ONCE(summary[blk >> CBT_MAP_SUMMARY_SHIFT]) <=
+		    snap_number) {
+			if (is_range) {
+				cbt_map_range_add(cbt_map, &ranges[nr++], first,
+						  blk);
+				is_range = false;
+			}
+			blk = round_down(blk, CBT_MAP_SUMMARY_BLOCKS) +
+			      CBT_MAP_SUMMARY_BLOCKS;
+			continue;
+		}
+
+		group_end = min_t(size_t,
+				  round_down(blk, CBT_MAP_SUMMARY_BLOCKS) +
+					  CBT_MAP_SUMMARY_BLOCKS,
+				  cbt_map->blk_count);
+		for (; blk < group_end; blk++) {
+			if (READ_ONCE(map[blk]) > snap_number) {
+				if (is_range)
+					continue;
+				if (nr == count)
+					goto out;
+				first = blk;
+				is_range = true;
+			} else if (is_range) {
+				cbt_map_range_add(cbt_map, &ranges[nr++], first,
+						  blk);
+				is_range = false;
+			}
+		}
+	}
+	if (is_range)
+		cbt_map_range_add(cbt_map, &ranges[nr++], first, blk);
+out:
+	srcu_read_unlock(&cbt_map->srcu, srcu_idx);
+
+	if (blk < cbt_map->blk_count)
+		*sector = (sector_t)blk << shift;
+	else
+		*sector = cbt_map->device_capacity;
+	return nr;
+}
+
+int cbt_map_read_ranges_to_user(struct cbt_map *cbt_map, u8 snap_number,
+				sector_t *sector,
+				struct blk_snap_block_range __user *user_ranges,
+				unsigned int *count)
+{
+	int ret = 0;
+	unsigned int filled = 0;
+	unsigned int portion;
+	unsigned int limit = PAGE_SIZE / sizeof(struct blk_snap_block_range);
+	struct blk_snap_block_range *ranges;
+
+	ranges = kcalloc(limit, sizeof(struct blk_snap_block_range),
+			 GFP_KERNEL);
+	if (!ranges)
+		return -ENOMEM;
+	memory_object_inc(memory_object_blk_snap_block_range);
+
+	while ((filled < *count) && (*sector < cbt_map->device_capacity)) {
+		portion = min(*count - filled, limit);
+
+		ret = cbt_map_read_ranges(cbt_map, snap_number, sector, ranges,
+					  portion);
+		if (ret < 0)
+			break;
+
+		if (copy_to_user(user_ranges + filled, ranges,
+				 ret * sizeof(struct blk_snap_block_range))) {
+			pr_err("Unable to read CBT ranges: invalid user buffer\n");
+			ret = -ENODATA;
+			break;
+		}
+		filled += ret;
+		ret = 0;
+	}
+
+	kfree(ranges);
+	memory_object_dec(memory_object_blk_snap_block_range);
+
+	*count = filled;
+	return ret;
+}
+
 int cbt_map_mark_dirty_blocks(struct cbt_map *cbt_map,
 			      struct blk_snap_block_range *block_ranges,
 			      unsigned int count)
@@ -294,6 +673,7 @@ int cbt_map_get_sector_state(struct cbt_map *cbt_map, sector_t sector,
 			     u8 *snap_number_prev, u8 *snap_number_curr)
 {
 	int ret = 0;
+	int srcu_idx;
 	size_t cbt_block =
 		(size_t)(sector >> (cbt_map->blk_size_shift - SECTOR_SHIFT));
 
@@ -304,15 +684,15 @@ int cbt_map_get_sector_state(struct cbt_map *cbt_map, sector_t sector,
 		return -EINVAL;
 	}
 
-	spin_lock(&cbt_map->locker);
-	if (unlikely(cbt_map->is_corrupted)) {
+	srcu_idx = srcu_read_lock(&cbt_map->srcu);
+	if (unlikely(READ_ONCE(cbt_map->is_corrupted))) {
 		ret = -EINVAL;
 		goto out;
 	}
-	*snap_number_curr = cbt_map->write_map[cbt_block];
-	*snap_number_prev = cbt_map->read_map[cbt_block];
+	*snap_number_curr = READ_ONCE(cbt_map->write_map[cbt_block]);
+	*snap_number_prev = READ_ONCE(cbt_map->read_map[cbt_block]);
 out:
-	spin_unlock(&cbt_map->locker);
+	srcu_read_unlock(&cbt_map->srcu, srcu_idx);
 
 	return ret;
 }
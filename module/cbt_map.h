@@ -6,10 +6,18 @@
 #include <linux/kref.h>
 #include <linux/uuid.h>
 #include <linux/spinlock.h>
+#include <linux/srcu.h>
 #include <linux/blkdev.h>
 
 struct blk_snap_block_range;
 
+/*
+ * Each byte of the summary table covers 4096 blocks of the change tracking
+ * table.
+ */
+#define CBT_MAP_SUMMARY_SHIFT 12
+#define CBT_MAP_SUMMARY_BLOCKS (1ul << CBT_MAP_SUMMARY_SHIFT)
+
 /**
  * struct cbt_map - The table of changes for a block device.
  *
@@ -17,6 +25,9 @@ struct blk_snap_block_range;
  *	Reference counter.
  * @locker:
  *	Locking for atomic modification of structure members.
+ * @srcu:
+ *	Protects the tables from being switched or released while the change
+ *	tracking mechanism is updating them.
  * @blk_size_shift:
  *	The power of 2 used to specify the change tracking block size.
  * @blk_count:
@@ -28,6 +39,10 @@ struct blk_snap_block_range;
  *	be read after taking a snapshot.
  * @write_map:
  *	The current table for tracking changes.
+ * @read_summary:
+ *	The summary for the readable table.
+ * @write_summary:
+ *	The summary for the writable table.
  * @snap_number_active:
  *	The current sequential number of changes. This is the number that is written to
  *	the current table when the block data changes.
@@ -38,6 +53,8 @@ struct blk_snap_block_range;
  *	UUID of the generation of changes.
  * @is_corrupted:
  *	A flag that the change tracking data is no longer reliable.
+ * @is_merge_needed:
+ *	The tables were swapped, but have not been merged yet.
  *
  * The change block tracking map is a byte table. Each byte stores the
  * sequential number of changes for one block. To determine which blocks have changed
@@ -51,19 +68,30 @@ struct blk_snap_block_range;
  *
  * There are two tables on the change block tracking map. One is
  * available for reading, and the other is available for writing. At the moment of taking
- * a snapshot, the tables are synchronized. The user's process, when
+ * a snapshot, the tables are swapped and then synchronized. The user's process, when
  * calling the corresponding ioctl, can read the readable table.
  * At the same time, the change tracking mechanism continues to work with
  * the writable table.
  *
+ * Each table has a summary. A byte of the summary stores the greatest
+ * sequential number of changes in a group of blocks. This allows to skip
+ * the groups without changes when searching for changed ranges.
+ *
  * To provide the ability to mount a snapshot image as writeable, it is
  * possible to make changes to both of these tables simultaneously.
  *
+ * The tables are updated without locking. Each byte is raised to the
+ * sequential number with an atomic compare-and-exchange of the word that
+ * contains it, so writes from different CPUs do not serialize. The moment
+ * of taking a snapshot is an epoch boundary: the new sequential number is
+ * published, and the switch waits until all updates that could use the
+ * previous number are completed before synchronizing the tables.
  */
 struct cbt_map {
 	struct kref kref;
 
 	spinlock_t locker;
+	struct srcu_struct srcu;
 
 	size_t blk_size_shift;
 	size_t blk_count;
@@ -71,12 +99,15 @@ struct cbt_map {
 
 	unsigned char *read_map;
 	unsigned char *write_map;
+	unsigned char *read_summary;
+	unsigned char *write_summary;
 
 	unsigned long snap_number_active;
 	unsigned long snap_number_previous;
 	uuid_t generation_id;
 
 	bool is_corrupted;
+	bool is_merge_needed;
 };
 
 struct cbt_map *cbt_map_create(struct block_device *bdev);
@@ -94,6 +125,7 @@ static inline void cbt_map_put(struct cbt_map *cbt_map)
 };
 
 void cbt_map_switch(struct cbt_map *cbt_map);
+void cbt_map_merge(struct cbt_map *cbt_map);
 int cbt_map_set(struct cbt_map *cbt_map, sector_t sector_start,
 		sector_t sector_cnt);
 int cbt_map_set_both(struct cbt_map *cbt_map, sector_t sector_start,
@@ -101,6 +133,10 @@ int cbt_map_set_both(struct cbt_map *cbt_map, sector_t sector_start,
 
 size_t cbt_map_read_to_user(struct cbt_map *cbt_map, char __user *user_buffer,
 			    size_t offset, size_t size);
+int cbt_map_read_ranges_to_user(struct cbt_map *cbt_map, u8 snap_number,
+				sector_t *sector,
+				struct blk_snap_block_range __user *user_ranges,
+				unsigned int *count);
 
 static inline size_t cbt_map_blk_size(struct cbt_map *cbt_map)
 {
@@ -2,9 +2,11 @@
 #define pr_fmt(fmt) KBUILD_MODNAME "-chunk: " fmt
 
 #include <linux/slab.h>
+#include <linux/mempool.h>
 #include <linux/dm-io.h>
 #include <linux/sched/mm.h>
 #include "memory_checker.h"
+#include "cache_manager.h"
 #include "chunk.h"
 #include "diff_io.h"
 #include "diff_buffer.h"
@@ -12,14 +14,74 @@
 #include "diff_storage.h"
 #include "log.h"
 
-extern int chunk_maximum_in_cache;
+extern int chunk_maximum_in_prefetch;
+
+static struct kmem_cache *chunk_cache;
+static struct kmem_cache *chunk_batch_cache;
+static mempool_t chunk_batch_pool;
+
+/*
+ * The number of batches, for which the reserve of the pool is kept. A batch
+ * is allocated on each copy of several chunks, and the reserve allows the
+ * copy-on-write algorithm to progress under memory pressure.
+ */
+#define CHUNK_BATCH_POOL_RESERVE 16
+
+/*
+ * The number of sectors of the difference storage occupied by the chunk.
+ * The last chunk of the device can be shorter than the others, but the
+ * regions must stay aligned to the page size.
+ */
+static inline sector_t chunk_region_sectors(struct chunk *chunk)
+{
+	return round_up(chunk->sector_count, (sector_t)PAGE_SECTORS);
+}
+
+int chunk_init(void)
+{
+	int ret;
+
+	chunk_cache = kmem_cache_create("blksnap_chunk", sizeof(struct chunk),
+					0, 0, NULL);
+	if (!chunk_cache)
+		return -ENOMEM;
+
+	chunk_batch_cache = kmem_cache_create("blksnap_chunk_batch",
+					      sizeof(struct chunk_batch), 0, 0,
+					      NULL);
+	if (!chunk_batch_cache) {
+		ret = -ENOMEM;
+		goto fail_chunk_batch_cache;
+	}
+	ret = mempool_init_slab_pool(&chunk_batch_pool,
+				     CHUNK_BATCH_POOL_RESERVE,
+				     chunk_batch_cache);
+	if (ret)
+		goto fail_chunk_batch_pool;
+
+	return 0;
+
+fail_chunk_batch_pool:
+	kmem_cache_destroy(chunk_batch_cache);
+fail_chunk_batch_cache:
+	kmem_cache_destroy(chunk_cache);
+	return ret;
+}
+
+void chunk_done(void)
+{
+	mempool_exit(&chunk_batch_pool);
+	kmem_cache_destroy(chunk_batch_cache);
+	kmem_cache_destroy(chunk_cache);
+}
 
 void chunk_diff_buffer_release(struct chunk *chunk)
 {
 	if (unlikely(!chunk->diff_buffer))
 		return;
 
-	chunk_state_unset(chunk, CHUNK_ST_BUFFER_READY);
+	chunk_state_unset(chunk, CHUNK_ST_BUFFER_READY | CHUNK_ST_PREFETCHED |
+				 CHUNK_ST_HOT);
 	diff_buffer_release(chunk->diff_area, chunk->diff_buffer);
 	chunk->diff_buffer = NULL;
 }
@@ -29,15 +91,31 @@ void chunk_store_failed(struct chunk *chunk, int error)
 	struct diff_area *diff_area = chunk->diff_area;
 
 	chunk_state_set(chunk, CHUNK_ST_FAILED);
+	chunk_state_unset(chunk, CHUNK_ST_PARTIAL);
+	chunk->valid_map = 0;
+	chunk->pending_map = 0;
 	chunk_diff_buffer_release(chunk);
 	diff_storage_free_region(chunk->diff_region);
 	chunk->diff_region = NULL;
 
-	up(&chunk->lock);
+	chunk_unlock(chunk);
 	if (error)
 		diff_area_set_corrupted(diff_area, error);
 };
 
+/*
+ * Releases the buffer of the chunk and unlocks it, keeping the sub-blocks
+ * and the region that have already been stored. It is used when the copy of
+ * the chunk cannot be started without waiting and will be retried, so the
+ * snapshot is not corrupted.
+ */
+void chunk_store_cancel(struct chunk *chunk)
+{
+	chunk->pending_map = 0;
+	chunk_diff_buffer_release(chunk);
+	chunk_unlock(chunk);
+}
+
 int chunk_schedule_storing(struct chunk *chunk, bool is_nowait)
 {
 	struct diff_area *diff_area = chunk->diff_area;
@@ -48,7 +126,7 @@ int chunk_schedule_storing(struct chunk *chunk, bool is_nowait)
 
 #ifdef BLK_SNAP_ALLOW_DIFF_STORAGE_IN_MEMORY
 	if (diff_area->in_memory) {
-		up(&chunk->lock);
+		chunk_unlock(chunk);
 		return 0;
 	}
 #endif
@@ -56,8 +134,7 @@ int chunk_schedule_storing(struct chunk *chunk, bool is_nowait)
 		struct diff_region *diff_region;
 
 		diff_region = diff_storage_new_region(
-			diff_area->diff_storage,
-			diff_area_chunk_sectors(diff_area));
+			diff_area->diff_storage, chunk_region_sectors(chunk));
 		if (IS_ERR(diff_region)) {
 			pr_debug("Cannot get store for chunk #%ld\n",
 				 chunk->number);
@@ -72,7 +149,7 @@ int chunk_schedule_storing(struct chunk *chunk, bool is_nowait)
 
 void chunk_schedule_caching(struct chunk *chunk)
 {
-	int in_cache_count = 0;
+	int in_prefetch_count = 0;
 	struct diff_area *diff_area = chunk->diff_area;
 
 	might_sleep();
@@ -95,67 +172,37 @@ void chunk_schedule_caching(struct chunk *chunk)
 	if (chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
 		list_add_tail(&chunk->cache_link,
 			      &diff_area->write_cache_queue);
-		in_cache_count =
-			atomic_inc_return(&diff_area->write_cache_count);
+		atomic_inc(&diff_area->write_cache_count);
+	} else if (chunk_state_check(chunk, CHUNK_ST_PREFETCHED)) {
+		list_add_tail(&chunk->cache_link,
+			      &diff_area->prefetch_cache_queue);
+		in_prefetch_count =
+			atomic_inc_return(&diff_area->prefetch_cache_count);
+	} else if (chunk_state_check(chunk, CHUNK_ST_HOT)) {
+		list_add_tail(&chunk->cache_link, &diff_area->hot_cache_queue);
+		atomic_inc(&diff_area->hot_cache_count);
 	} else {
 		list_add_tail(&chunk->cache_link, &diff_area->read_cache_queue);
-		in_cache_count =
-			atomic_inc_return(&diff_area->read_cache_count);
+		atomic_inc(&diff_area->read_cache_count);
 	}
 	spin_unlock(&diff_area->caches_lock);
 
-	up(&chunk->lock);
+	/*
+	 * The chunk is charged while it is locked, so it cannot be released
+	 * from the cache and uncharged before that.
+	 */
+	cache_manager_charge(diff_area);
+	chunk_unlock(chunk);
 
 	/* Initiate the cache clearing process */
-	if (in_cache_count > chunk_maximum_in_cache)
-		queue_work(system_wq, &diff_area->cache_release_work);
-}
-
-static void chunk_notify_load(void *ctx)
-{
-	struct chunk *chunk = ctx;
-	int error = chunk->diff_io->error;
-
-	diff_io_free(chunk->diff_io);
-	chunk->diff_io = NULL;
-
-	might_sleep();
-
-	if (unlikely(error)) {
-		chunk_store_failed(chunk, error);
-		goto out;
-	}
-
-	if (unlikely(chunk_state_check(chunk, CHUNK_ST_FAILED))) {
-		pr_err("Chunk in a failed state\n");
-		up(&chunk->lock);
-		goto out;
-	}
-
-	if (chunk_state_check(chunk, CHUNK_ST_LOADING)) {
-		int ret;
-		unsigned int current_flag;
-
-		chunk_state_unset(chunk, CHUNK_ST_LOADING);
-		chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
-
-		current_flag = memalloc_noio_save();
-		ret = chunk_schedule_storing(chunk, false);
-		memalloc_noio_restore(current_flag);
-		if (ret)
-			chunk_store_failed(chunk, ret);
-		goto out;
-	}
-
-	pr_err("invalid chunk state 0x%x\n", atomic_read(&chunk->state));
-	up(&chunk->lock);
-out:
-	atomic_dec(&chunk->diff_area->pending_io_count);
+	if (in_prefetch_count > chunk_maximum_in_prefetch)
+		queue_work(diff_io_wq, &diff_area->cache_release_work);
 }
 
 static void chunk_notify_store(void *ctx)
 {
 	struct chunk *chunk = ctx;
+	struct diff_area *diff_area = chunk->diff_area;
 	int error = chunk->diff_io->error;
 
 	diff_io_free(chunk->diff_io);
@@ -174,8 +221,13 @@ static void chunk_notify_store(void *ctx)
 		goto out;
 	}
 	if (chunk_state_check(chunk, CHUNK_ST_STORING)) {
-		chunk_state_unset(chunk, CHUNK_ST_STORING);
+		/*
+		 * The whole chunk has been stored, including the sub-blocks
+		 * that have been copied before.
+		 */
+		chunk_state_unset(chunk, CHUNK_ST_STORING | CHUNK_ST_PARTIAL);
 		chunk_state_set(chunk, CHUNK_ST_STORE_READY);
+		diff_storage_written(diff_area->diff_storage);
 
 		if (chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
 			/*
@@ -195,26 +247,59 @@ static void chunk_notify_store(void *ctx)
 			goto out;
 		}
 	} else
-		pr_err("invalid chunk state 0x%x\n", atomic_read(&chunk->state));
-	up(&chunk->lock);
+		pr_err("invalid chunk state 0x%x\n",
+		       diff_area_chunk_state(diff_area, chunk->number));
+	chunk_unlock(chunk);
+out:
+	atomic_dec(&diff_area->pending_io_count);
+}
+
+static void chunk_notify_load_image(void *ctx)
+{
+	struct chunk *chunk = ctx;
+	struct diff_area *diff_area = chunk->diff_area;
+	int error = chunk->diff_io->error;
+	unsigned int current_flag;
+
+	diff_io_free(chunk->diff_io);
+	chunk->diff_io = NULL;
+
+	might_sleep();
+
+	chunk_state_unset(chunk, CHUNK_ST_LOADING);
+	if (unlikely(error)) {
+		/*
+		 * The reader of the snapshot image will try to load the chunk
+		 * synchronously and will get the error itself.
+		 */
+		pr_err("Failed to load chunk #%ld\n", chunk->number);
+		chunk_diff_buffer_release(chunk);
+		chunk_unlock(chunk);
+		goto out;
+	}
+
+	chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
+
+	current_flag = memalloc_noio_save();
+	chunk_schedule_caching(chunk);
+	memalloc_noio_restore(current_flag);
 out:
-	atomic_dec(&chunk->diff_area->pending_io_count);
+	atomic_dec(&diff_area->pending_io_count);
 }
 
-struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number)
+struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number,
+			  gfp_t gfp_mask)
 {
 	struct chunk *chunk;
 
-	chunk = kzalloc(sizeof(struct chunk), GFP_KERNEL);
+	chunk = kmem_cache_zalloc(chunk_cache, gfp_mask);
 	if (!chunk)
 		return NULL;
 	memory_object_inc(memory_object_chunk);
 
 	INIT_LIST_HEAD(&chunk->cache_link);
-	sema_init(&chunk->lock, 1);
 	chunk->diff_area = diff_area;
 	chunk->number = number;
-	atomic_set(&chunk->state, 0);
 
 	return chunk;
 }
@@ -224,16 +309,47 @@ void chunk_free(struct chunk *chunk)
 	if (unlikely(!chunk))
 		return;
 
-	down(&chunk->lock);
 	chunk_diff_buffer_release(chunk);
 	diff_storage_free_region(chunk->diff_region);
-	chunk_state_set(chunk, CHUNK_ST_FAILED);
-	up(&chunk->lock);
 
-	kfree(chunk);
+	kmem_cache_free(chunk_cache, chunk);
 	memory_object_dec(memory_object_chunk);
 }
 
+/*
+ * Releases the lock of the chunk. If the chunk has no data in the memory,
+ * is not in the cache and has no I/O in progress, its object is no longer
+ * needed. In this case, only the region of the chunk in the difference
+ * storage is left in the chunk map, and the object is released.
+ * A partially stored chunk keeps its object, since its valid map is needed.
+ */
+void chunk_unlock(struct chunk *chunk)
+{
+	struct diff_area *diff_area = chunk->diff_area;
+	unsigned long number = chunk->number;
+
+	if (!chunk->diff_buffer && !chunk->diff_io &&
+	    list_empty(&chunk->cache_link) &&
+	    !chunk_state_check(chunk, CHUNK_ST_PARTIAL)) {
+		/*
+		 * Replacing an existing entry does not require memory
+		 * allocation, so it cannot fail.
+		 */
+		if (chunk->diff_region)
+			xa_store(&diff_area->chunk_map, number,
+				 xa_tag_pointer(chunk->diff_region,
+						CHUNK_MAP_REGION_TAG),
+				 GFP_NOIO);
+		else
+			xa_erase(&diff_area->chunk_map, number);
+
+		kmem_cache_free(chunk_cache, chunk);
+		memory_object_dec(memory_object_chunk);
+	}
+
+	diff_area_chunk_unlock(diff_area, number);
+}
+
 /*
  * Starts asynchronous storing of a chunk to the  difference storage.
  */
@@ -270,21 +386,515 @@ int chunk_async_store_diff(struct chunk *chunk, bool is_nowait)
 	return ret;
 }
 
+static struct chunk_batch *chunk_batch_new(struct diff_area *diff_area,
+					   const bool is_nowait)
+{
+	struct chunk_batch *batch;
+	gfp_t gfp_mask = is_nowait ? GFP_NOWAIT : GFP_NOIO;
+
+	batch = mempool_alloc(&chunk_batch_pool, gfp_mask);
+	if (!batch)
+		return NULL;
+	memory_object_inc(memory_object_chunk_batch);
+
+	memset(batch, 0, sizeof(struct chunk_batch));
+	batch->diff_area = diff_area;
+	return batch;
+}
+
+static void chunk_batch_free(struct chunk_batch *batch)
+{
+	mempool_free(batch, &chunk_batch_pool);
+	memory_object_dec(memory_object_chunk_batch);
+}
+
+/*
+ * Adds a locked chunk with the taken buffer to the batch. Returns an error
+ * if the chunk cannot be added; in this case the chunk remains locked.
+ */
+int chunk_batch_add(struct chunk_batch **batch_ptr, struct chunk *chunk,
+		    const bool is_nowait)
+{
+	struct chunk_batch *batch = *batch_ptr;
+
+	if (!batch) {
+		batch = chunk_batch_new(chunk->diff_area, is_nowait);
+		if (!batch)
+			return is_nowait ? -EAGAIN : -ENOMEM;
+		*batch_ptr = batch;
+	}
+
+	if (WARN_ON(batch->count &&
+		    (batch->chunks[batch->count - 1]->number + 1 !=
+		     chunk->number)))
+		return -EINVAL;
+
+	batch->chunks[batch->count] = chunk;
+	batch->diff_buffers[batch->count] = chunk->diff_buffer;
+	batch->count++;
+	return 0;
+}
+
+/*
+ * Marks all chunks of the batch as failed, unlocks them and releases
+ * the batch.
+ */
+void chunk_batch_failed(struct chunk_batch *batch, int error)
+{
+	unsigned int inx;
+
+	for (inx = 0; inx < batch->count; inx++)
+		chunk_store_failed(batch->chunks[inx], error);
+	chunk_batch_free(batch);
+}
+
+/*
+ * Unlocks all chunks of the batch without marking them as failed and
+ * releases the batch.
+ */
+void chunk_batch_cancel(struct chunk_batch *batch)
+{
+	unsigned int inx;
+
+	for (inx = 0; inx < batch->count; inx++)
+		chunk_store_cancel(batch->chunks[inx]);
+	chunk_batch_free(batch);
+}
+
+static void chunk_batch_notify_store(void *ctx)
+{
+	struct chunk_batch *batch = ctx;
+	struct diff_area *diff_area = batch->diff_area;
+	int error = batch->diff_io->error;
+	unsigned int current_flag;
+	unsigned int inx;
+
+	diff_io_free(batch->diff_io);
+	batch->diff_io = NULL;
+
+	might_sleep();
+
+	if (unlikely(error)) {
+		chunk_batch_failed(batch, error);
+		goto out;
+	}
+
+	for (inx = 0; inx < batch->count; inx++) {
+		chunk_state_unset(batch->chunks[inx], CHUNK_ST_STORING);
+		chunk_state_set(batch->chunks[inx], CHUNK_ST_STORE_READY);
+	}
+	diff_storage_written(diff_area->diff_storage);
+
+	current_flag = memalloc_noio_save();
+	for (inx = 0; inx < batch->count; inx++)
+		chunk_schedule_caching(batch->chunks[inx]);
+	memalloc_noio_restore(current_flag);
+
+	chunk_batch_free(batch);
+out:
+	atomic_dec(&diff_area->pending_io_count);
+}
+
+/*
+ * Allocates one region in the difference storage for the chunks of the batch
+ * from @first to @first + @count and gives each chunk its own part of it.
+ * A request for several chunks does not overflow the difference storage, so
+ * the caller can retry with fewer chunks. The descriptors of the parts are
+ * allocated before the space of the difference storage is taken, so that
+ * a failure does not leave the space or the chunks half assigned.
+ */
+static int chunk_batch_new_region(struct chunk_batch *batch,
+				  unsigned int first, unsigned int count,
+				  struct diff_region *region)
+{
+	struct diff_storage *diff_storage = batch->diff_area->diff_storage;
+	struct diff_region *parts[CHUNK_BATCH_MAX];
+	struct diff_region *diff_region;
+	sector_t offset = 0;
+	sector_t sectors = 0;
+	unsigned int inx;
+	int ret;
+
+	for (inx = 0; inx < count; inx++) {
+		sectors += chunk_region_sectors(batch->chunks[first + inx]);
+		if (inx == 0)
+			continue;
+
+		parts[inx] = diff_region_new(GFP_NOIO);
+		if (!parts[inx]) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	if (count > 1)
+		diff_region = diff_storage_try_new_region(diff_storage, sectors);
+	else
+		diff_region = diff_storage_new_region(diff_storage, sectors);
+	if (IS_ERR(diff_region)) {
+		ret = PTR_ERR(diff_region);
+		goto fail;
+	}
+	*region = *diff_region;
+	parts[0] = diff_region;
+
+	for (inx = 0; inx < count; inx++) {
+		struct chunk *chunk = batch->chunks[first + inx];
+
+		diff_region = parts[inx];
+		diff_region->bdev = region->bdev;
+		diff_region->sector = region->sector + offset;
+		diff_region->count = chunk_region_sectors(chunk);
+		offset += diff_region->count;
+
+		WARN_ON(chunk->diff_region);
+		chunk->diff_region = diff_region;
+	}
+	return 0;
+fail:
+	while (inx-- > 1)
+		diff_region_free(parts[inx]);
+	return ret;
+}
+
+/*
+ * Allocates the regions in the difference storage for all chunks of the batch
+ * and starts writing them with a single I/O operation. If the difference
+ * storage does not have a free extent for the whole batch, the request is
+ * halved down to a single chunk. Only the lack of space for a single chunk
+ * is an overflow of the difference storage. With the round-robin policy,
+ * each chunk of the batch is stored on the next block device.
+ */
+static int chunk_batch_schedule_storing(struct chunk_batch *batch)
+{
+	int ret;
+	unsigned int inx;
+	struct diff_area *diff_area = batch->diff_area;
+	struct diff_region regions[CHUNK_BATCH_MAX];
+	unsigned int region_count = 0;
+	unsigned int first = 0;
+	unsigned int count;
+	struct diff_io *diff_io;
+
+#ifdef BLK_SNAP_ALLOW_DIFF_STORAGE_IN_MEMORY
+	if (diff_area->in_memory) {
+		for (inx = 0; inx < batch->count; inx++)
+			chunk_unlock(batch->chunks[inx]);
+		chunk_batch_free(batch);
+		return 0;
+	}
+#endif
+	if (diff_storage_is_striped(diff_area->diff_storage))
+		count = 1;
+	else
+		count = batch->count;
+
+	while (first < batch->count) {
+		count = min(count, batch->count - first);
+
+		ret = chunk_batch_new_region(batch, first, count,
+					     &regions[region_count]);
+		if ((ret == -ENOSPC) && (count > 1)) {
+			count /= 2;
+			continue;
+		}
+		if (ret) {
+			pr_debug("Cannot get store for %u chunks from #%ld\n",
+				 count, batch->chunks[first]->number);
+			return ret;
+		}
+		region_count++;
+		first += count;
+	}
+
+	diff_io = diff_io_new_async_write(chunk_batch_notify_store, batch,
+					  false);
+	if (unlikely(!diff_io))
+		return -ENOMEM;
+
+	batch->diff_io = diff_io;
+	for (inx = 0; inx < batch->count; inx++)
+		chunk_state_set(batch->chunks[inx], CHUNK_ST_STORING);
+	atomic_inc(&diff_area->pending_io_count);
+
+	ret = diff_io_do_regions(diff_io, regions, region_count,
+				 batch->diff_buffers, batch->count, false);
+	if (ret) {
+		for (inx = 0; inx < batch->count; inx++)
+			chunk_state_unset(batch->chunks[inx],
+					  CHUNK_ST_STORING);
+		atomic_dec(&diff_area->pending_io_count);
+		diff_io_free(batch->diff_io);
+		batch->diff_io = NULL;
+	}
+	return ret;
+}
+
+static void chunk_batch_notify_load(void *ctx)
+{
+	struct chunk_batch *batch = ctx;
+	struct diff_area *diff_area = batch->diff_area;
+	int error = batch->diff_io->error;
+	unsigned int current_flag;
+	unsigned int inx;
+	int ret;
+
+	diff_io_free(batch->diff_io);
+	batch->diff_io = NULL;
+
+	might_sleep();
+
+	if (unlikely(error)) {
+		chunk_batch_failed(batch, error);
+		goto out;
+	}
+
+	for (inx = 0; inx < batch->count; inx++) {
+		chunk_state_unset(batch->chunks[inx], CHUNK_ST_LOADING);
+		chunk_state_set(batch->chunks[inx], CHUNK_ST_BUFFER_READY);
+	}
+
+	current_flag = memalloc_noio_save();
+	ret = chunk_batch_schedule_storing(batch);
+	memalloc_noio_restore(current_flag);
+	if (ret)
+		chunk_batch_failed(batch, ret);
+out:
+	atomic_dec(&diff_area->pending_io_count);
+}
+
 /*
- * Starts asynchronous loading of a chunk from the original block device.
+ * Starts asynchronous loading of the batch of chunks from the original block
+ * device. When loading is completed, the chunks are stored in the difference
+ * storage. In case of an error, all chunks of the batch are marked as failed
+ * and the batch is released. If the loading cannot be started without
+ * waiting, the chunks are only unlocked.
  */
-int chunk_async_load_orig(struct chunk *chunk, const bool is_nowait)
+int chunk_batch_async_load_orig(struct chunk_batch *batch, const bool is_nowait)
 {
 	int ret;
+	unsigned int inx;
 	struct diff_io *diff_io;
+	struct diff_area *diff_area = batch->diff_area;
 	struct diff_region region = {
+		.bdev = diff_area->orig_bdev,
+		.sector = (sector_t)(batch->chunks[0]->number) *
+			  diff_area_chunk_sectors(diff_area),
+		.count = 0,
+	};
+
+	for (inx = 0; inx < batch->count; inx++)
+		region.count += batch->chunks[inx]->sector_count;
+
+	diff_io = diff_io_new_async_read(chunk_batch_notify_load, batch,
+					 is_nowait);
+	if (unlikely(!diff_io)) {
+		ret = is_nowait ? -EAGAIN : -ENOMEM;
+		goto fail;
+	}
+
+	batch->diff_io = diff_io;
+	for (inx = 0; inx < batch->count; inx++)
+		chunk_state_set(batch->chunks[inx], CHUNK_ST_LOADING);
+	atomic_inc(&diff_area->pending_io_count);
+
+	ret = diff_io_do_batch(diff_io, &region, batch->diff_buffers,
+			       batch->count, is_nowait);
+	if (ret) {
+		for (inx = 0; inx < batch->count; inx++)
+			chunk_state_unset(batch->chunks[inx],
+					  CHUNK_ST_LOADING);
+		atomic_dec(&diff_area->pending_io_count);
+		diff_io_free(batch->diff_io);
+		batch->diff_io = NULL;
+		goto fail;
+	}
+	return 0;
+fail:
+	if (ret == -EAGAIN)
+		chunk_batch_cancel(batch);
+	else
+		chunk_batch_failed(batch, ret);
+	return ret;
+}
+
+static void chunk_notify_store_subblocks(void *ctx)
+{
+	struct chunk *chunk = ctx;
+	struct diff_area *diff_area = chunk->diff_area;
+	int error = chunk->diff_io->error;
+
+	diff_io_free(chunk->diff_io);
+	chunk->diff_io = NULL;
+
+	might_sleep();
+
+	if (unlikely(error)) {
+		chunk_store_failed(chunk, error);
+		goto out;
+	}
+
+	chunk_state_unset(chunk, CHUNK_ST_STORING);
+	chunk->valid_map |= chunk->pending_map;
+	chunk->pending_map = 0;
+	if (chunk->valid_map == chunk_subblock_mask_full(chunk)) {
+		chunk_state_unset(chunk, CHUNK_ST_PARTIAL);
+		chunk_state_set(chunk, CHUNK_ST_STORE_READY);
+	} else
+		chunk_state_set(chunk, CHUNK_ST_PARTIAL);
+	diff_storage_written(diff_area->diff_storage);
+
+	/*
+	 * The buffer contains only the copied sub-blocks, so it cannot be
+	 * placed in the cache.
+	 */
+	chunk_diff_buffer_release(chunk);
+	chunk_unlock(chunk);
+out:
+	atomic_dec(&diff_area->pending_io_count);
+}
+
+/*
+ * Starts writing the loaded sub-blocks to the same offsets of the chunk
+ * region in the difference storage. The region is allocated for the whole
+ * chunk when the first sub-blocks are stored.
+ */
+static int chunk_store_subblocks(struct chunk *chunk)
+{
+	int ret;
+	struct diff_io *diff_io;
+	struct diff_area *diff_area = chunk->diff_area;
+
+	if (!chunk->diff_region) {
+		struct diff_region *diff_region;
+
+		diff_region = diff_storage_new_region(
+			diff_area->diff_storage, chunk_region_sectors(chunk));
+		if (IS_ERR(diff_region)) {
+			pr_debug("Cannot get store for chunk #%ld\n",
+				 chunk->number);
+			return PTR_ERR(diff_region);
+		}
+
+		chunk->diff_region = diff_region;
+	}
+
+	diff_io = diff_io_new_async_write(chunk_notify_store_subblocks, chunk,
+					  false);
+	if (unlikely(!diff_io))
+		return -ENOMEM;
+
+	WARN_ON(chunk->diff_io);
+	chunk->diff_io = diff_io;
+	chunk_state_set(chunk, CHUNK_ST_STORING);
+	atomic_inc(&diff_area->pending_io_count);
+
+	ret = diff_io_do_blocks(diff_io, chunk->diff_region, chunk->diff_buffer,
+				chunk->pending_map, diff_area->subblock_shift,
+				false);
+	if (ret) {
+		chunk_state_unset(chunk, CHUNK_ST_STORING);
+		atomic_dec(&diff_area->pending_io_count);
+		diff_io_free(chunk->diff_io);
+		chunk->diff_io = NULL;
+	}
+	return ret;
+}
+
+static void chunk_notify_load_subblocks(void *ctx)
+{
+	struct chunk *chunk = ctx;
+	struct diff_area *diff_area = chunk->diff_area;
+	int error = chunk->diff_io->error;
+	unsigned int current_flag;
+
+	diff_io_free(chunk->diff_io);
+	chunk->diff_io = NULL;
+
+	might_sleep();
+
+	chunk_state_unset(chunk, CHUNK_ST_LOADING);
+	if (unlikely(error)) {
+		chunk_store_failed(chunk, error);
+		goto out;
+	}
+
+	current_flag = memalloc_noio_save();
+	error = chunk_store_subblocks(chunk);
+	memalloc_noio_restore(current_flag);
+	if (error)
+		chunk_store_failed(chunk, error);
+out:
+	atomic_dec(&diff_area->pending_io_count);
+}
+
+/*
+ * Starts asynchronous copying of the sub-blocks of a chunk from the original
+ * block device to the difference storage. Only the sub-blocks specified by
+ * the mask are read and stored. The chunk must be locked and must have
+ * a buffer. The lock is released when the copying is completed.
+ */
+int chunk_async_copy_subblocks(struct chunk *chunk, unsigned long mask,
+			       const bool is_nowait)
+{
+	int ret;
+	struct diff_io *diff_io;
+	struct diff_area *diff_area = chunk->diff_area;
+	struct diff_region region = {
+		.bdev = diff_area->orig_bdev,
+		.sector = (sector_t)(chunk->number) *
+			  diff_area_chunk_sectors(diff_area),
+		.count = chunk->sector_count,
+	};
+
+	diff_io = diff_io_new_async_read(chunk_notify_load_subblocks, chunk,
+					 is_nowait);
+	if (unlikely(!diff_io))
+		return is_nowait ? -EAGAIN : -ENOMEM;
+
+	WARN_ON(chunk->diff_io);
+	chunk->diff_io = diff_io;
+	chunk->pending_map = mask;
+	chunk_state_set(chunk, CHUNK_ST_LOADING);
+	atomic_inc(&diff_area->pending_io_count);
+
+	ret = diff_io_do_blocks(diff_io, &region, chunk->diff_buffer, mask,
+				diff_area->subblock_shift, is_nowait);
+	if (ret) {
+		chunk_state_unset(chunk, CHUNK_ST_LOADING);
+		atomic_dec(&diff_area->pending_io_count);
+		diff_io_free(chunk->diff_io);
+		chunk->diff_io = NULL;
+		chunk->pending_map = 0;
+	}
+	return ret;
+}
+
+/*
+ * Starts asynchronous loading of a chunk for the snapshot image. The data
+ * is read from the difference storage if the chunk has already been stored,
+ * otherwise from the original block device. When loading is completed, the
+ * chunk gets into the read cache and its lock is released.
+ */
+int chunk_async_load_image(struct chunk *chunk, const bool is_nowait)
+{
+	int ret;
+	struct diff_io *diff_io;
+	struct diff_region *region;
+	struct diff_region orig_region = {
 		.bdev = chunk->diff_area->orig_bdev,
 		.sector = (sector_t)(chunk->number) *
 			  diff_area_chunk_sectors(chunk->diff_area),
 		.count = chunk->sector_count,
 	};
 
-	diff_io = diff_io_new_async_read(chunk_notify_load, chunk, is_nowait);
+	if (chunk_state_check(chunk, CHUNK_ST_STORE_READY))
+		region = chunk->diff_region;
+	else
+		region = &orig_region;
+
+	diff_io = diff_io_new_async_read(chunk_notify_load_image, chunk,
+					 is_nowait);
 	if (unlikely(!diff_io)) {
 		if (is_nowait)
 			return -EAGAIN;
@@ -297,8 +907,9 @@ int chunk_async_load_orig(struct chunk *chunk, const bool is_nowait)
 	chunk_state_set(chunk, CHUNK_ST_LOADING);
 	atomic_inc(&chunk->diff_area->pending_io_count);
 
-	ret = diff_io_do(chunk->diff_io, &region, chunk->diff_buffer, is_nowait);
+	ret = diff_io_do(chunk->diff_io, region, chunk->diff_buffer, is_nowait);
 	if (ret) {
+		chunk_state_unset(chunk, CHUNK_ST_LOADING);
 		atomic_dec(&chunk->diff_area->pending_io_count);
 		diff_io_free(chunk->diff_io);
 		chunk->diff_io = NULL;
@@ -353,3 +964,28 @@ int chunk_load_diff(struct chunk *chunk)
 
 	return ret;
 }
+
+/*
+ * Performs synchronous loading of the stored sub-blocks of a partially
+ * stored chunk from the difference storage. They are loaded over the data
+ * read from the original block device.
+ */
+int chunk_load_diff_subblocks(struct chunk *chunk)
+{
+	int ret;
+	struct diff_io *diff_io;
+
+	diff_io = diff_io_new_sync_read();
+	if (unlikely(!diff_io))
+		return -ENOMEM;
+
+	ret = diff_io_do_blocks(diff_io, chunk->diff_region, chunk->diff_buffer,
+				chunk->valid_map,
+				chunk->diff_area->subblock_shift, false);
+	if (!ret)
+		ret = diff_io->error;
+
+	diff_io_free(diff_io);
+
+	return ret;
+}
@@ -4,10 +4,9 @@
 
 #include <linux/blk_types.h>
 #include <linux/blkdev.h>
-#include <linux/rwsem.h>
 #include <linux/atomic.h>
+#include "diff_area.h"
 
-struct diff_area;
 struct diff_region;
 struct diff_io;
 
@@ -34,11 +33,30 @@ struct diff_io;
  * @CHUNK_ST_STORING:
  *	The data is being saved to the difference storage.
  *	The flag is replaced with the CHUNK_ST_STORE_READY flag.
+ * @CHUNK_ST_PREFETCHED:
+ *	The data of the chunk was loaded in advance when reading the
+ *	snapshot image and has not been read yet. Such a chunk is kept in
+ *	the prefetch cache. The flag is removed when the chunk is read or
+ *	its buffer is released.
+ * @CHUNK_ST_PARTIAL:
+ *	Only some sub-blocks of the chunk have been written to the difference
+ *	storage. They are marked in the valid map of the chunk. The flag is
+ *	replaced with the CHUNK_ST_STORE_READY flag when all sub-blocks are
+ *	stored.
+ * @CHUNK_ST_HOT:
+ *	The chunk was accessed again while it was in the cache. Such a chunk
+ *	is kept in the hot cache. The flag is removed when its buffer is
+ *	released.
+ *
+ * The state of every chunk is stored in the chunk state map of the
+ * &struct diff_area, regardless of whether the chunk object exists.
  *
  * Chunks life circle.
  * Copy-on-write when writing to original:
  *	0 -> LOADING -> BUFFER_READY -> BUFFER_READY | STORING ->
  *	BUFFER_READY | STORE_READY -> STORE_READY
+ * Copy-on-write of several sub-blocks when writing to original:
+ *	0 -> LOADING -> STORING -> PARTIAL -> ... -> STORE_READY
  * Write to snapshot image:
  *	0 -> LOADING -> BUFFER_READY | DIRTY -> DIRTY | STORING ->
  *	BUFFER_READY | STORE_READY -> STORE_READY
@@ -50,6 +68,9 @@ enum chunk_st {
 	CHUNK_ST_STORE_READY = (1 << 3),
 	CHUNK_ST_LOADING = (1 << 4),
 	CHUNK_ST_STORING = (1 << 5),
+	CHUNK_ST_PREFETCHED = (1 << 6),
+	CHUNK_ST_PARTIAL = (1 << 7),
+	CHUNK_ST_HOT = (1 << 8),
 };
 
 /**
@@ -64,11 +85,6 @@ enum chunk_st {
  * @sector_count:
  *	Number of sectors in the current chunk. This is especially true
  *	for the	last chunk.
- * @lock:
- *	Binary semaphore. Syncs access to the chunks fields: state,
- *	diff_buffer, diff_region and diff_io.
- * @state:
- *	Defines the state of a chunk. May contain CHUNK_ST_* bits.
  * @diff_buffer:
  *	Pointer to &struct diff_buffer. Describes a buffer in the memory
  *	for storing the chunk data.
@@ -77,6 +93,11 @@ enum chunk_st {
  *	on the difference storage.
  * @diff_io:
  *	Provides I/O operations for a chunk.
+ * @valid_map:
+ *	The bitmap of the sub-blocks that have been stored in the difference
+ *	storage. It makes sense only in the CHUNK_ST_PARTIAL state.
+ * @pending_map:
+ *	The bitmap of the sub-blocks that are being copied.
  *
  * This structure describes the block of data that the module operates
  * with when executing the copy-on-write algorithm and when performing I/O
@@ -85,10 +106,17 @@ enum chunk_st {
  * If the data of the chunk has been changed or has just been read, then
  * the chunk gets into cache.
  *
- * The semaphore is blocked for writing if there is no actual data in the
- * buffer, since a block of data is being read from the original device or
- * from a diff storage. If data is being read from or written to the
- * diff_buffer, the semaphore must be locked.
+ * The chunk object exists only while the chunk is locked, is in the cache
+ * or keeps its data in the buffer. An idle chunk is represented in the chunk
+ * map only by a tagged pointer to its region on the difference storage, or
+ * is not present in the map at all if it has never been stored. Its state
+ * remains in the chunk state map.
+ *
+ * The lock bit of the chunk in the chunk state map is held if there is no
+ * actual data in the buffer, since a block of data is being read from the
+ * original device or from a diff storage. If data is being read from or
+ * written to the diff_buffer, or the fields of the chunk object are
+ * changed, the lock must be held.
  */
 struct chunk {
 	struct list_head cache_link;
@@ -97,43 +125,122 @@ struct chunk {
 	unsigned long number;
 	sector_t sector_count;
 
-	struct semaphore lock;
-
-	atomic_t state;
 	struct diff_buffer *diff_buffer;
 	struct diff_region *diff_region;
 	struct diff_io *diff_io;
+
+	unsigned long valid_map;
+	unsigned long pending_map;
+};
+
+/*
+ * The maximum number of adjacent chunks that are copied by a single
+ * I/O operation.
+ */
+#define CHUNK_BATCH_MAX 16
+
+/**
+ * struct chunk_batch - A run of adjacent chunks copied together.
+ *
+ * @diff_area:
+ *	Pointer to the difference area of the chunks.
+ * @diff_io:
+ *	Provides I/O operations for the batch.
+ * @count:
+ *	The number of chunks in the batch.
+ * @chunks:
+ *	Locked chunks in ascending order of their numbers.
+ * @diff_buffers:
+ *	The buffers of the chunks in the same order.
+ *
+ * When a write to the original block device requires copying several
+ * adjacent chunks, they are read from the original block device and
+ * written to a contiguous region of the difference storage with large
+ * I/O units instead of one operation per chunk.
+ */
+struct chunk_batch {
+	struct diff_area *diff_area;
+	struct diff_io *diff_io;
+	unsigned int count;
+	struct chunk *chunks[CHUNK_BATCH_MAX];
+	struct diff_buffer *diff_buffers[CHUNK_BATCH_MAX];
+};
+
+static inline bool chunk_batch_is_full(struct chunk_batch *batch)
+{
+	return batch->count == CHUNK_BATCH_MAX;
 };
 
+/*
+ * The tag of the pointer to the region of an idle chunk in the chunk map.
+ */
+#define CHUNK_MAP_REGION_TAG 1
+
 static inline void chunk_state_set(struct chunk *chunk, int st)
 {
-	atomic_or(st, &chunk->state);
+	diff_area_chunk_state_set(chunk->diff_area, chunk->number, st);
 };
 
 static inline void chunk_state_unset(struct chunk *chunk, int st)
 {
-	atomic_and(~st, &chunk->state);
+	diff_area_chunk_state_unset(chunk->diff_area, chunk->number, st);
 };
 
 static inline bool chunk_state_check(struct chunk *chunk, int st)
 {
-	return !!(atomic_read(&chunk->state) & st);
+	return !!(diff_area_chunk_state(chunk->diff_area, chunk->number) & st);
 };
 
-struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number);
+/*
+ * Returns the mask of all sub-blocks of the chunk. The last chunk may
+ * contain fewer sub-blocks.
+ */
+static inline unsigned long chunk_subblock_mask_full(struct chunk *chunk)
+{
+	sector_t subblock_sectors =
+		1ull << (chunk->diff_area->subblock_shift - SECTOR_SHIFT);
+	unsigned long count = DIV_ROUND_UP_SECTOR_T(chunk->sector_count,
+						    subblock_sectors);
+
+	if (count >= BITS_PER_LONG)
+		return ~0UL;
+	return (1UL << count) - 1;
+};
+
+static inline bool chunk_trylock(struct chunk *chunk)
+{
+	return diff_area_chunk_trylock(chunk->diff_area, chunk->number);
+};
+void chunk_unlock(struct chunk *chunk);
+
+int chunk_init(void);
+void chunk_done(void);
+
+struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number,
+			  gfp_t gfp_mask);
 void chunk_free(struct chunk *chunk);
 
 int chunk_schedule_storing(struct chunk *chunk, bool is_nowait);
 void chunk_diff_buffer_release(struct chunk *chunk);
 void chunk_store_failed(struct chunk *chunk, int error);
+void chunk_store_cancel(struct chunk *chunk);
 
 void chunk_schedule_caching(struct chunk *chunk);
 
 /* Asynchronous operations are used to implement the COW algorithm. */
 int chunk_async_store_diff(struct chunk *chunk, bool is_nowait);
-int chunk_async_load_orig(struct chunk *chunk, const bool is_nowait);
+int chunk_batch_add(struct chunk_batch **batch_ptr, struct chunk *chunk,
+		    const bool is_nowait);
+void chunk_batch_failed(struct chunk_batch *batch, int error);
+void chunk_batch_cancel(struct chunk_batch *batch);
+int chunk_batch_async_load_orig(struct chunk_batch *batch, const bool is_nowait);
+int chunk_async_copy_subblocks(struct chunk *chunk, unsigned long mask,
+			       const bool is_nowait);
+/* Asynchronous loading is used to prefetch chunks for the snapshot image. */
+int chunk_async_load_image(struct chunk *chunk, const bool is_nowait);
 
 /* Synchronous operations are used to implement reading and writing to the snapshot image. */
 int chunk_load_orig(struct chunk *chunk);
 int chunk_load_diff(struct chunk *chunk);
+int chunk_load_diff_subblocks(struct chunk *chunk);
 #endif /* __BLK_SNAP_CHUNK_H */
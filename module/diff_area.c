@@ -6,12 +6,15 @@
 #endif
 #include <linux/blkdev.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
 #else
 #include <uapi/linux/blksnap.h>
 #endif
 #include "memory_checker.h"
+#include "cache_manager.h"
 #include "chunk.h"
 #include "diff_area.h"
 #include "diff_buffer.h"
@@ -20,8 +23,10 @@
 #include "log.h"
 
 extern int chunk_minimum_shift;
+extern int chunk_minimum_shift_nonrot;
+extern int chunk_subblock_shift;
 extern int chunk_maximum_count;
-extern int chunk_maximum_in_cache;
+extern int chunk_maximum_in_prefetch;
 
 #ifndef HAVE_BDEV_NR_SECTORS
 static inline sector_t bdev_nr_sectors(struct block_device *bdev)
@@ -30,6 +35,13 @@ static inline sector_t bdev_nr_sectors(struct block_device *bdev)
 };
 #endif
 
+#ifndef HAVE_BDEV_NONROT
+static inline bool bdev_nonrot(struct block_device *bdev)
+{
+	return blk_queue_nonrot(bdev_get_queue(bdev));
+};
+#endif
+
 static inline unsigned long chunk_number(struct diff_area *diff_area,
 					 sector_t sector)
 {
@@ -61,19 +73,62 @@ static inline unsigned long long count_by_shift(sector_t capacity,
 	return round_up(capacity, (1ull << shift_sector)) >> shift_sector;
 }
 
-static void diff_area_calculate_chunk_size(struct diff_area *diff_area)
+/*
+ * Selects the initial chunk size for the block device.
+ * If the snapshot has a hint, it is used. Otherwise, the minimum size
+ * depends on whether the device is rotational. Random access to
+ * non-rotational devices is cheap, so small chunks reduce the amount of data
+ * copied on small random writes. For rotational devices, which are usually
+ * RAID arrays, the chunk should not be smaller than the optimal I/O size, so
+ * that the original device is read by full stripes.
+ */
+static unsigned long long
+diff_area_chunk_shift_policy(struct block_device *bdev,
+			     unsigned int chunk_shift_hint)
+{
+	unsigned long long shift;
+	unsigned int opt_io;
+
+	if (chunk_shift_hint)
+		return chunk_shift_hint;
+
+	if (bdev_nonrot(bdev))
+		return chunk_minimum_shift_nonrot;
+
+	shift = chunk_minimum_shift;
+	opt_io = bdev_io_opt(bdev);
+	pr_debug("Optimal IO size %u bytes\n", opt_io);
+	if (is_power_of_2(opt_io))
+		shift = clamp_t(unsigned long long, ilog2(opt_io), shift,
+				DIFF_AREA_CHUNK_SHIFT_MAX);
+	return shift;
+}
+
+static void diff_area_calculate_chunk_size(struct diff_area *diff_area,
+					   unsigned int chunk_shift_hint)
 {
-	unsigned long long shift = chunk_minimum_shift;
+	unsigned long long shift;
 	unsigned long long count;
 	sector_t capacity;
 	sector_t min_io_sect;
 
-	min_io_sect = (sector_t)(bdev_io_min(diff_area->orig_bdev) >>
-		SECTOR_SHIFT);
+	/*
+	 * The chunk smaller than the physical block or the minimal I/O size
+	 * would cause read-modify-write on the device.
+	 */
+	min_io_sect = (sector_t)(max(bdev_io_min(diff_area->orig_bdev),
+				     bdev_physical_block_size(diff_area->orig_bdev))
+				 >> SECTOR_SHIFT);
 	capacity = bdev_nr_sectors(diff_area->orig_bdev);
 	pr_debug("Minimal IO block %llu sectors\n", min_io_sect);
 	pr_debug("Device capacity %llu sectors\n", capacity);
 
+	shift = diff_area_chunk_shift_policy(diff_area->orig_bdev,
+					     chunk_shift_hint);
+	/* The buffer of the chunk consists of whole pages. */
+	if (shift < PAGE_SHIFT)
+		shift = PAGE_SHIFT;
+
 	count = count_by_shift(capacity, shift);
 	pr_debug("Chunks count %llu\n", count);
 	while ((count > chunk_maximum_count) ||
@@ -86,6 +141,21 @@ static void diff_area_calculate_chunk_size(struct diff_area *diff_area)
 	diff_area->chunk_shift = shift;
 	diff_area->chunk_count = count;
 
+	/*
+	 * The valid map of the chunk is a word, so the number of sub-blocks
+	 * in the chunk is limited. The sub-block cannot be smaller than the
+	 * page, the physical block or the minimal I/O size either.
+	 */
+	shift = chunk_subblock_shift ? chunk_subblock_shift : shift;
+	if (shift < PAGE_SHIFT)
+		shift = PAGE_SHIFT;
+	while ((1ull << (shift - SECTOR_SHIFT)) < min_io_sect)
+		shift++;
+	if ((shift + ilog2(BITS_PER_LONG)) < diff_area->chunk_shift)
+		shift = diff_area->chunk_shift - ilog2(BITS_PER_LONG);
+	diff_area->subblock_shift = min(shift, diff_area->chunk_shift);
+	pr_debug("Sub-block size %llu bytes\n", 1ull << diff_area->subblock_shift);
+
 	pr_debug("The optimal chunk size was calculated as %llu bytes for device [%d:%d]\n",
 		 (1ull << diff_area->chunk_shift),
 		 MAJOR(diff_area->orig_bdev->bd_dev),
@@ -96,11 +166,13 @@ void diff_area_free(struct kref *kref)
 {
 	unsigned long inx = 0;
 	u64 start_waiting;
-	struct chunk *chunk;
+	void *entry;
 	struct diff_area *diff_area =
 		container_of(kref, struct diff_area, kref);
 
 	might_sleep();
+	cache_manager_unregister(diff_area);
+
 	start_waiting = jiffies_64;
 	while (atomic_read(&diff_area->pending_io_count)) {
 		schedule_timeout_interruptible(1);
@@ -116,10 +188,20 @@ void diff_area_free(struct kref *kref)
 	}
 
 	flush_work(&diff_area->cache_release_work);
-	xa_for_each(&diff_area->chunk_map, inx, chunk)
-		chunk_free(chunk);
+	cache_manager_uncharge(diff_area, diff_area_cache_count(diff_area));
+	xa_for_each(&diff_area->chunk_map, inx, entry) {
+		if (xa_pointer_tag(entry) == CHUNK_MAP_REGION_TAG)
+			diff_storage_free_region(xa_untag_pointer(entry));
+		else
+			chunk_free(entry);
+	}
 	xa_destroy(&diff_area->chunk_map);
 
+	if (diff_area->chunk_states) {
+		vfree(diff_area->chunk_states);
+		memory_object_dec(memory_object_chunk_states);
+	}
+
 	if (diff_area->orig_bdev) {
 		blkdev_put(diff_area->orig_bdev, FMODE_READ | FMODE_WRITE);
 		diff_area->orig_bdev = NULL;
@@ -133,16 +215,17 @@ void diff_area_free(struct kref *kref)
 }
 
 static inline struct chunk *
-get_chunk_from_cache_and_write_lock(spinlock_t *caches_lock,
+get_chunk_from_cache_and_write_lock(struct diff_area *diff_area,
 				    struct list_head *cache_queue,
 				    atomic_t *cache_count)
 {
 	struct chunk *iter;
 	struct chunk *chunk = NULL;
+	int scanned = 0;
 
-	spin_lock(caches_lock);
+	spin_lock(&diff_area->caches_lock);
 	list_for_each_entry(iter, cache_queue, cache_link) {
-		if (!down_trylock(&iter->lock)) {
+		if (chunk_trylock(iter)) {
 			chunk = iter;
 			break;
 		}
@@ -151,46 +234,159 @@ get_chunk_from_cache_and_write_lock(spinlock_t *caches_lock,
 		 * then it is currently in use, and we try to clean up the
 		 * next chunk.
 		 */
+		if (++scanned >= DIFF_AREA_CACHE_SCAN_MAX)
+			break;
 	}
 	if (likely(chunk)) {
 		atomic_dec(cache_count);
 		list_del_init(&chunk->cache_link);
 	}
-	spin_unlock(caches_lock);
+	spin_unlock(&diff_area->caches_lock);
 
+	if (likely(chunk))
+		cache_manager_uncharge(diff_area, 1);
 	return chunk;
 }
 
+/*
+ * Returns the clean chunk to be released first. The chunks of the read cache
+ * have been read only once, so they are released first, unless there are
+ * too few of them. The chunks of the hot cache are released in the order of
+ * the last access.
+ */
 static struct chunk *
-diff_area_get_chunk_from_cache_and_write_lock(struct diff_area *diff_area)
+diff_area_get_clean_chunk_and_write_lock(struct diff_area *diff_area)
 {
 	struct chunk *chunk;
+	int read_count = atomic_read(&diff_area->read_cache_count);
+	int hot_count = atomic_read(&diff_area->hot_cache_count);
+
+	chunk = get_chunk_from_cache_and_write_lock(
+		diff_area, &diff_area->prefetch_cache_queue,
+		&diff_area->prefetch_cache_count);
+	if (chunk)
+		return chunk;
 
-	if (atomic_read(&diff_area->read_cache_count) >
-	    chunk_maximum_in_cache) {
+	if ((read_count * DIFF_AREA_READ_CACHE_SHARE) > (read_count + hot_count)) {
 		chunk = get_chunk_from_cache_and_write_lock(
-			&diff_area->caches_lock, &diff_area->read_cache_queue,
+			diff_area, &diff_area->read_cache_queue,
 			&diff_area->read_cache_count);
 		if (chunk)
 			return chunk;
 	}
 
-	if (atomic_read(&diff_area->write_cache_count) >
-	    chunk_maximum_in_cache) {
+	chunk = get_chunk_from_cache_and_write_lock(
+		diff_area, &diff_area->hot_cache_queue,
+		&diff_area->hot_cache_count);
+	if (chunk)
+		return chunk;
+
+	return get_chunk_from_cache_and_write_lock(
+		diff_area, &diff_area->read_cache_queue,
+		&diff_area->read_cache_count);
+}
+
+/*
+ * The prefetch cache has its own limit. Other chunks are released only when
+ * the cache manager decides that the difference area uses too much memory.
+ * Clean chunks are released first, since releasing a dirty chunk requires
+ * storing it.
+ */
+static struct chunk *
+diff_area_get_chunk_from_cache_and_write_lock(struct diff_area *diff_area)
+{
+	struct chunk *chunk;
+
+	if (atomic_read(&diff_area->prefetch_cache_count) >
+	    chunk_maximum_in_prefetch) {
 		chunk = get_chunk_from_cache_and_write_lock(
-			&diff_area->caches_lock, &diff_area->write_cache_queue,
-			&diff_area->write_cache_count);
+			diff_area, &diff_area->prefetch_cache_queue,
+			&diff_area->prefetch_cache_count);
 		if (chunk)
 			return chunk;
 	}
 
-	return NULL;
+	if (!cache_manager_is_over_limit(diff_area))
+		return NULL;
+
+	chunk = diff_area_get_clean_chunk_and_write_lock(diff_area);
+	if (chunk)
+		return chunk;
+
+	return get_chunk_from_cache_and_write_lock(
+		diff_area, &diff_area->write_cache_queue,
+		&diff_area->write_cache_count);
+}
+
+static int chunk_storing_cmp(const void *a, const void *b)
+{
+	const struct chunk *chunk_a = *(const struct chunk **)a;
+	const struct chunk *chunk_b = *(const struct chunk **)b;
+	const struct diff_region *region_a = chunk_a->diff_region;
+	const struct diff_region *region_b = chunk_b->diff_region;
+
+	/*
+	 * The chunks that already have a region are stored in the order of
+	 * the regions. The regions for other chunks are allocated one after
+	 * another, so they are stored in the order of the chunk numbers.
+	 */
+	if (region_a && region_b) {
+		if (region_a->bdev != region_b->bdev)
+			return region_a->bdev < region_b->bdev ? -1 : 1;
+		if (region_a->sector != region_b->sector)
+			return region_a->sector < region_b->sector ? -1 : 1;
+		return 0;
+	}
+	if (region_a || region_b)
+		return region_a ? -1 : 1;
+	if (chunk_a->number != chunk_b->number)
+		return chunk_a->number < chunk_b->number ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Stores the group of dirty chunks. Together with the first dirty chunk,
+ * several more dirty chunks are taken from the write cache, since they
+ * have to be stored anyway.
+ */
+static void diff_area_store_dirty(struct diff_area *diff_area,
+				  struct chunk *chunk)
+{
+	struct chunk *chunks[DIFF_AREA_WRITEBACK_BATCH];
+	int count = 0;
+	int inx;
+
+	chunks[count++] = chunk;
+	while (count < DIFF_AREA_WRITEBACK_BATCH) {
+		chunk = get_chunk_from_cache_and_write_lock(
+			diff_area, &diff_area->write_cache_queue,
+			&diff_area->write_cache_count);
+		if (!chunk)
+			break;
+		chunks[count++] = chunk;
+	}
+
+	sort(chunks, count, sizeof(struct chunk *), chunk_storing_cmp, NULL);
+
+	for (inx = 0; inx < count; inx++) {
+		int ret;
+
+		ret = chunk_schedule_storing(chunks[inx], false);
+		if (ret)
+			chunk_store_failed(chunks[inx], ret);
+	}
 }
 
 static void diff_area_cache_release(struct diff_area *diff_area)
 {
 	struct chunk *chunk;
+	struct blk_plug plug;
 
+	/*
+	 * Storing of dirty chunks is started for several chunks in a row.
+	 * Plugging allows to submit their I/O units as a batch.
+	 */
+	blk_start_plug(&plug);
 	while (!diff_area_is_corrupted(diff_area) &&
 	       (chunk = diff_area_get_chunk_from_cache_and_write_lock(
 			diff_area))) {
@@ -201,21 +397,18 @@ static void diff_area_cache_release(struct diff_area *diff_area)
 		if (WARN(!chunk_state_check(chunk, CHUNK_ST_BUFFER_READY),
 			 "Cannot release empty buffer for chunk #%ld",
 			 chunk->number)) {
-			up(&chunk->lock);
+			chunk_unlock(chunk);
 			continue;
 		}
 
 		if (chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
-			int ret;
-
-			ret = chunk_schedule_storing(chunk, false);
-			if (ret)
-				chunk_store_failed(chunk, ret);
+			diff_area_store_dirty(diff_area, chunk);
 		} else {
 			chunk_diff_buffer_release(chunk);
-			up(&chunk->lock);
+			chunk_unlock(chunk);
 		}
 	}
+	blk_finish_plug(&plug);
 }
 
 static void diff_area_cache_release_work(struct work_struct *work)
@@ -226,13 +419,51 @@ static void diff_area_cache_release_work(struct work_struct *work)
 	diff_area_cache_release(diff_area);
 }
 
-struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
+static void diff_area_free_work(struct work_struct *work)
+{
+	struct diff_area *diff_area =
+		container_of(work, struct diff_area, free_work);
+
+	diff_area_free(&diff_area->kref);
+}
+
+unsigned long diff_area_cache_clean_count(struct diff_area *diff_area)
+{
+	return atomic_read(&diff_area->read_cache_count) +
+	       atomic_read(&diff_area->hot_cache_count) +
+	       atomic_read(&diff_area->prefetch_cache_count) +
+	       atomic_read(&diff_area->free_diff_buffers_count);
+}
+
+/*
+ * Releases the buffers of the clean chunks and the pool of free buffers.
+ * The dirty chunks are not touched, since storing them requires I/O.
+ */
+unsigned long diff_area_cache_shrink(struct diff_area *diff_area,
+				     unsigned long nr_to_scan)
+{
+	struct chunk *chunk;
+	unsigned long freed = 0;
+
+	while (freed < nr_to_scan) {
+		chunk = diff_area_get_clean_chunk_and_write_lock(diff_area);
+		if (!chunk)
+			break;
+
+		chunk_diff_buffer_release(chunk);
+		chunk_unlock(chunk);
+		freed++;
+	}
+	freed += diff_buffer_shrink(diff_area);
+
+	return freed;
+}
+
+struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage,
+				unsigned int chunk_shift)
 {
-	int ret = 0;
 	struct diff_area *diff_area = NULL;
 	struct block_device *bdev;
-	unsigned long number;
-	struct chunk *chunk;
 
 	pr_debug("Open device [%u:%u]\n", MAJOR(dev_id), MINOR(dev_id));
 
@@ -254,16 +485,19 @@ struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
 	diff_area->orig_bdev = bdev;
 	diff_area->diff_storage = diff_storage;
 
-	diff_area_calculate_chunk_size(diff_area);
+	diff_area_calculate_chunk_size(diff_area, chunk_shift);
 	pr_debug("Chunk size %llu in bytes\n", 1ull << diff_area->chunk_shift);
 	pr_debug("Chunk count %lu\n", diff_area->chunk_count);
 
 	kref_init(&diff_area->kref);
+	INIT_LIST_HEAD(&diff_area->cache_manager_link);
 	xa_init(&diff_area->chunk_map);
 
 	if (!diff_storage->capacity) {
 #ifdef BLK_SNAP_ALLOW_DIFF_STORAGE_IN_MEMORY
 		diff_area->in_memory = true;
+		/* Chunks without a region are always kept in memory entirely. */
+		diff_area->subblock_shift = diff_area->chunk_shift;
 		pr_debug("Difference storage is empty.\n");
 		pr_debug("Only the memory cache will be used to store the snapshots difference.\n");
 #else
@@ -276,65 +510,142 @@ struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
 	spin_lock_init(&diff_area->caches_lock);
 	INIT_LIST_HEAD(&diff_area->read_cache_queue);
 	atomic_set(&diff_area->read_cache_count, 0);
+	INIT_LIST_HEAD(&diff_area->hot_cache_queue);
+	atomic_set(&diff_area->hot_cache_count, 0);
 	INIT_LIST_HEAD(&diff_area->write_cache_queue);
 	atomic_set(&diff_area->write_cache_count, 0);
+	INIT_LIST_HEAD(&diff_area->prefetch_cache_queue);
+	atomic_set(&diff_area->prefetch_cache_count, 0);
 	INIT_WORK(&diff_area->cache_release_work, diff_area_cache_release_work);
+	INIT_WORK(&diff_area->free_work, diff_area_free_work);
 
 	spin_lock_init(&diff_area->free_diff_buffers_lock);
 	INIT_LIST_HEAD(&diff_area->free_diff_buffers);
 	atomic_set(&diff_area->free_diff_buffers_count, 0);
+	if (diff_buffer_init(diff_area)) {
+		diff_area_put(diff_area);
+		return ERR_PTR(-ENOMEM);
+	}
 
 	diff_area->corrupt_flag = 0;
 	atomic_set(&diff_area->pending_io_count, 0);
 
-	/*
-	 * Allocating all chunks in advance allows to avoid doing this in
-	 * the process of filtering bio.
-	 * In addition, the chunk structure has an rw semaphore that allows
-	 * to lock data of a single chunk.
-	 * Different threads can read, write, or dump their data to diff storage
-	 * independently of each other, provided that different chunks are used.
-	 */
-	for (number = 0; number < diff_area->chunk_count; number++) {
-		chunk = chunk_alloc(diff_area, number);
-		if (!chunk) {
-			pr_err("Failed allocate chunk\n");
-			ret = -ENOMEM;
-			break;
-		}
-		chunk->sector_count = diff_area_chunk_sectors(diff_area);
-
-		ret = xa_insert(&diff_area->chunk_map, number, chunk,
-				GFP_KERNEL);
-		if (ret) {
-			pr_err("Failed insert chunk to chunk map\n");
-			chunk_free(chunk);
-			break;
-		}
-	}
-	if (ret) {
+	diff_area->chunk_states = __vmalloc(
+		DIV_ROUND_UP(diff_area->chunk_count, CHUNK_STATE_PER_LONG) *
+			sizeof(unsigned long),
+		GFP_KERNEL | __GFP_ZERO);
+	if (!diff_area->chunk_states) {
 		diff_area_put(diff_area);
-		return ERR_PTR(ret);
+		return ERR_PTR(-ENOMEM);
 	}
+	memory_object_inc(memory_object_chunk_states);
 
-	recalculate_last_chunk_size(chunk);
+	cache_manager_register(diff_area);
 
+	/*
+	 * The chunk objects are not allocated in advance. The object is
+	 * created when the chunk is taken for copying or for accessing the
+	 * snapshot image, and is released when the chunk becomes idle.
+	 * Only the state of the chunk is kept permanently.
+	 */
 	return diff_area;
 }
 
+/*
+ * Returns the object of the chunk with the specified number. The lock of
+ * the chunk must be held. If the chunk is idle, the object is created and
+ * gets the region of the chunk in the difference storage from the chunk map.
+ * Since only the owner of the lock can change the entry of the chunk in the
+ * chunk map, there is no race here.
+ */
+static struct chunk *diff_area_chunk_take(struct diff_area *diff_area,
+					  unsigned long number,
+					  const bool is_nowait)
+{
+	int ret;
+	void *entry;
+	struct chunk *chunk;
+	gfp_t gfp_mask = is_nowait ? GFP_NOWAIT : GFP_NOIO;
+
+	entry = xa_load(&diff_area->chunk_map, number);
+	if (entry && (xa_pointer_tag(entry) != CHUNK_MAP_REGION_TAG))
+		return entry;
+
+	chunk = chunk_alloc(diff_area, number, gfp_mask);
+	if (unlikely(!chunk))
+		return ERR_PTR(is_nowait ? -EAGAIN : -ENOMEM);
+
+	chunk->sector_count = diff_area_chunk_sectors(diff_area);
+	if (number == (diff_area->chunk_count - 1))
+		recalculate_last_chunk_size(chunk);
+
+	ret = xa_err(xa_store(&diff_area->chunk_map, number, chunk, gfp_mask));
+	if (unlikely(ret)) {
+		chunk_free(chunk);
+		return ERR_PTR(is_nowait ? -EAGAIN : ret);
+	}
+	if (entry)
+		chunk->diff_region = xa_untag_pointer(entry);
+
+	return chunk;
+}
+
 static void diff_area_take_chunk_from_cache(struct diff_area *diff_area,
 					    struct chunk *chunk)
 {
 	spin_lock(&diff_area->caches_lock);
-	if (!list_is_first(&chunk->cache_link, &chunk->cache_link)) {
-		list_del_init(&chunk->cache_link);
-
-		if (chunk_state_check(chunk, CHUNK_ST_DIRTY))
-			atomic_dec(&diff_area->write_cache_count);
-		else
-			atomic_dec(&diff_area->read_cache_count);
+	if (list_is_first(&chunk->cache_link, &chunk->cache_link)) {
+		spin_unlock(&diff_area->caches_lock);
+		return;
 	}
+	list_del_init(&chunk->cache_link);
+
+	if (chunk_state_check(chunk, CHUNK_ST_DIRTY))
+		atomic_dec(&diff_area->write_cache_count);
+	else if (chunk_state_check(chunk, CHUNK_ST_PREFETCHED))
+		atomic_dec(&diff_area->prefetch_cache_count);
+	else if (chunk_state_check(chunk, CHUNK_ST_HOT))
+		atomic_dec(&diff_area->hot_cache_count);
+	else
+		atomic_dec(&diff_area->read_cache_count);
 	spin_unlock(&diff_area->caches_lock);
+
+	cache_manager_uncharge(diff_area, 1);
+}
+
+/*
+ * Returns the mask of the sub-blocks of the chunk that are covered by the
+ * range of sectors.
+ */
+static inline unsigned long diff_area_subblock_mask(struct diff_area *diff_area,
+						    struct chunk *chunk,
+						    sector_t sector,
+						    sector_t count)
+{
+	unsigned long long shift = diff_area->subblock_shift - SECTOR_SHIFT;
+	sector_t first = chunk_sector(chunk);
+	sector_t last = first + chunk->sector_count;
+
+	if (sector > first)
+		first = sector;
+	if ((sector + count) < last)
+		last = sector + count;
+
+	return GENMASK((unsigned long)((last - 1 - chunk_sector(chunk)) >> shift),
+		       (unsigned long)((first - chunk_sector(chunk)) >> shift));
+}
+
+static inline int diff_area_copy_batch(struct chunk_batch **batch,
+				       const bool is_nowait)
+{
+	int ret;
+
+	if (!*batch)
+		return 0;
+
+	ret = chunk_batch_async_load_orig(*batch, is_nowait);
+	*batch = NULL;
+	return ret;
 }
 
 /*
@@ -345,42 +656,60 @@ int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
 {
 	int ret = 0;
 	sector_t offset;
-	struct chunk *chunk;
+	unsigned long number;
+	unsigned long mask;
+	struct chunk *chunk = NULL;
 	struct diff_buffer *diff_buffer;
+	struct chunk_batch *batch = NULL;
 	sector_t area_sect_first;
 	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
 
 	area_sect_first = round_down(sector, chunk_sectors);
 	for (offset = area_sect_first; offset < (sector + count);
 	     offset += chunk_sectors) {
-		chunk = xa_load(&diff_area->chunk_map,
-				chunk_number(diff_area, offset));
-		if (!chunk) {
-			diff_area_set_corrupted(diff_area, -EINVAL);
-			return -EINVAL;
+		number = chunk_number(diff_area, offset);
+		if (unlikely(number >= diff_area->chunk_count)) {
+			ret = -EINVAL;
+			diff_area_set_corrupted(diff_area, ret);
+			goto out;
 		}
-		WARN_ON(chunk_number(diff_area, offset) != chunk->number);
 		if (is_nowait) {
-			if (down_trylock(&chunk->lock))
-				return -EAGAIN;
+			if (!diff_area_chunk_trylock(diff_area, number)) {
+				ret = -EAGAIN;
+				goto out;
+			}
 		} else {
-			ret = down_killable(&chunk->lock);
+			ret = diff_area_chunk_lock(diff_area, number,
+						   TASK_KILLABLE);
 			if (unlikely(ret))
-				return ret;
+				goto out;
 		}
 
-		if (chunk_state_check(chunk, CHUNK_ST_FAILED | CHUNK_ST_DIRTY |
-						     CHUNK_ST_STORE_READY)) {
+		if (diff_area_chunk_state(diff_area, number) &
+		    (CHUNK_ST_FAILED | CHUNK_ST_DIRTY | CHUNK_ST_STORE_READY)) {
 			/*
 			 * The chunk has already been:
 			 * - Failed, when the snapshot is corrupted
 			 * - Overwritten in the snapshot image
 			 * - Already stored in the diff storage
+			 * There is no need to create its object.
 			 */
-			up(&chunk->lock);
+			diff_area_chunk_unlock(diff_area, number);
+			ret = diff_area_copy_batch(&batch, is_nowait);
+			if (unlikely(ret))
+				return ret;
 			continue;
 		}
 
+		chunk = diff_area_chunk_take(diff_area, number, is_nowait);
+		if (IS_ERR(chunk)) {
+			diff_area_chunk_unlock(diff_area, number);
+			ret = PTR_ERR(chunk);
+			if (ret != -EAGAIN)
+				diff_area_set_corrupted(diff_area, ret);
+			goto out;
+		}
+
 		if (unlikely(chunk_state_check(
 			    chunk, CHUNK_ST_LOADING | CHUNK_ST_STORING))) {
 			pr_err("Invalid chunk state\n");
@@ -388,6 +717,20 @@ int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
 			goto fail_unlock_chunk;
 		}
 
+		mask = diff_area_subblock_mask(diff_area, chunk, sector, count) &
+		       ~chunk->valid_map;
+		if (!mask) {
+			/*
+			 * All overwritten sub-blocks of the partially stored
+			 * chunk have already been stored.
+			 */
+			chunk_unlock(chunk);
+			ret = diff_area_copy_batch(&batch, is_nowait);
+			if (unlikely(ret))
+				return ret;
+			continue;
+		}
+
 		if (chunk_state_check(chunk, CHUNK_ST_BUFFER_READY)) {
 			diff_area_take_chunk_from_cache(diff_area, chunk);
 			/*
@@ -397,6 +740,10 @@ int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
 			ret = chunk_schedule_storing(chunk, is_nowait);
 			if (unlikely(ret))
 				goto fail_unlock_chunk;
+
+			ret = diff_area_copy_batch(&batch, is_nowait);
+			if (unlikely(ret))
+				return ret;
 		} else {
 			diff_buffer =
 				diff_buffer_take(chunk->diff_area, is_nowait);
@@ -407,16 +754,60 @@ int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
 			WARN(chunk->diff_buffer, "Chunks buffer has been lost");
 			chunk->diff_buffer = diff_buffer;
 
-			ret = chunk_async_load_orig(chunk, is_nowait);
+			if (mask != chunk_subblock_mask_full(chunk)) {
+				/*
+				 * Only a part of the chunk is overwritten, so
+				 * only its sub-blocks are copied.
+				 */
+				ret = chunk_async_copy_subblocks(chunk, mask,
+								 is_nowait);
+				if (unlikely(ret))
+					goto fail_unlock_chunk;
+
+				ret = diff_area_copy_batch(&batch, is_nowait);
+				if (unlikely(ret))
+					return ret;
+				continue;
+			}
+
+			/*
+			 * Adjacent chunks are loaded from the original block
+			 * device and stored in the difference storage together.
+			 */
+			ret = chunk_batch_add(&batch, chunk, is_nowait);
 			if (unlikely(ret))
 				goto fail_unlock_chunk;
+
+			if (chunk_batch_is_full(batch)) {
+				ret = diff_area_copy_batch(&batch, is_nowait);
+				if (unlikely(ret))
+					return ret;
+			}
 		}
 	}
+out:
+	if (batch) {
+		int err = diff_area_copy_batch(&batch, is_nowait);
 
+		if (!ret)
+			ret = err;
+	}
 	return ret;
 fail_unlock_chunk:
 	WARN_ON(!chunk);
+	if (ret == -EAGAIN) {
+		/*
+		 * The copy cannot be started without waiting. The caller
+		 * will retry it, so the chunks are not marked as failed.
+		 */
+		chunk_store_cancel(chunk);
+		if (batch)
+			chunk_batch_cancel(batch);
+		return ret;
+	}
 	chunk_store_failed(chunk, ret);
+	if (batch)
+		chunk_batch_failed(batch, ret);
 	return ret;
 }
 
@@ -425,55 +816,201 @@ int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
 {
 	int ret = 0;
 	sector_t offset;
-	struct chunk *chunk;
+	unsigned long number;
+	unsigned int state;
 	sector_t area_sect_first;
 	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
 
 	area_sect_first = round_down(sector, chunk_sectors);
 	for (offset = area_sect_first; offset < (sector + count);
 	     offset += chunk_sectors) {
-		chunk = xa_load(&diff_area->chunk_map,
-				chunk_number(diff_area, offset));
-		if (!chunk) {
-			diff_area_set_corrupted(diff_area, -EINVAL);
-			return -EINVAL;
-		}
-		WARN_ON(chunk_number(diff_area, offset) != chunk->number);
+		number = chunk_number(diff_area, offset);
+		if (unlikely(number >= diff_area->chunk_count))
+			break;
+
+		/*
+		 * The lock of the chunk is held while the chunk is being
+		 * copied. There is no need for the chunk object here.
+		 */
 		if (is_nowait) {
-			if (down_trylock(&chunk->lock))
+			if (!diff_area_chunk_trylock(diff_area, number))
 				return -EAGAIN;
 		} else {
-			ret = down_killable(&chunk->lock);
+			ret = diff_area_chunk_lock(diff_area, number,
+						   TASK_KILLABLE);
 			if (unlikely(ret))
 				return ret;
 		}
+		state = diff_area_chunk_state(diff_area, number);
+		diff_area_chunk_unlock(diff_area, number);
 
-		if (chunk_state_check(chunk, CHUNK_ST_FAILED)) {
+		if (state & CHUNK_ST_FAILED) {
 			/*
-			 * The chunk has already been:
-			 * - Failed, when the snapshot is corrupted
-			 * - Overwritten in the snapshot image
-			 * - Already stored in the diff storage
+			 * The chunk has already been failed, when the snapshot
+			 * is corrupted.
 			 */
-			up(&chunk->lock);
 			ret = -EFAULT;
 			break;
 		}
+	}
 
-		if (chunk_state_check(chunk, CHUNK_ST_BUFFER_READY |
-				      CHUNK_ST_DIRTY | CHUNK_ST_STORE_READY)) {
-			/*
-			 * The chunk has already been:
-			 * - Read
-			 * - Overwritten in the snapshot image
-			 * - Already stored in the diff storage
-			 */
-			up(&chunk->lock);
-			continue;
+	return ret;
+}
+
+static void diff_area_image_passthrough_unlock(struct diff_area *diff_area,
+					       unsigned long first,
+					       unsigned long last)
+{
+	unsigned long number;
+
+	for (number = first; number <= last; number++)
+		diff_area_chunk_unlock(diff_area, number);
+}
+
+/*
+ * Releases the difference area in the worker, since the last reference can
+ * be put in the interrupt context.
+ */
+static void diff_area_free_deferred(struct kref *kref)
+{
+	struct diff_area *diff_area =
+		container_of(kref, struct diff_area, kref);
+
+	queue_work(diff_io_wq, &diff_area->free_work);
+}
+
+static void diff_area_image_passthrough_notify(void *ctx, struct bio *bio)
+{
+	struct diff_area *diff_area = ctx;
+
+	diff_area_image_passthrough_unlock(diff_area,
+		chunk_number(diff_area, bio->bi_iter.bi_sector),
+		chunk_number(diff_area, bio_end_sector(bio) - 1));
+	kref_put(&diff_area->kref, diff_area_free_deferred);
+}
+
+/*
+ * Redirects reading from the snapshot image to the original block device if
+ * none of the chunks covered by the I/O unit have been copied or loaded.
+ * The data is read directly into the pages of the I/O unit.
+ * The locks of the chunks are held until reading is completed, so the
+ * copy-on-write algorithm cannot let a write to the original block device
+ * change the data of these chunks in the meantime. The chunk objects are
+ * not needed for this. The reference to the difference area is held until
+ * reading is completed too, so the structure cannot be released before.
+ *
+ * Returns true if the I/O unit has been redirected.
+ */
+bool diff_area_image_passthrough(struct diff_area *diff_area, struct bio *bio)
+{
+	unsigned long first;
+	unsigned long last;
+	unsigned long number;
+
+	if (op_is_write(bio_op(bio)) || !bio_sectors(bio) ||
+	    diff_area_is_corrupted(diff_area))
+		return false;
+
+	first = chunk_number(diff_area, bio->bi_iter.bi_sector);
+	last = chunk_number(diff_area, bio_end_sector(bio) - 1);
+	if (unlikely(last >= diff_area->chunk_count))
+		return false;
+
+	for (number = first; number <= last; number++) {
+		if (diff_area_chunk_lock(diff_area, number, TASK_KILLABLE))
+			break;
+
+		if (diff_area_chunk_state(diff_area, number) &
+		    (CHUNK_ST_FAILED | CHUNK_ST_DIRTY | CHUNK_ST_BUFFER_READY |
+		     CHUNK_ST_STORE_READY | CHUNK_ST_PARTIAL)) {
+			diff_area_chunk_unlock(diff_area, number);
+			break;
 		}
 	}
+	if (number <= last) {
+		if (number > first)
+			diff_area_image_passthrough_unlock(diff_area, first,
+							   number - 1);
+		return false;
+	}
 
-	return ret;
+	diff_area_get(diff_area);
+	if (diff_io_clone_submit(bio, diff_area->orig_bdev,
+				 diff_area_image_passthrough_notify,
+				 diff_area)) {
+		diff_area_put(diff_area);
+		diff_area_image_passthrough_unlock(diff_area, first, last);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Starts asynchronous loading of all chunks covered by the I/O unit to the
+ * snapshot image, and also of the readahead window of following chunks.
+ * Chunks that are currently in use or whose data is already in the buffer
+ * are skipped. Chunks of the readahead window that have not been stored in
+ * the difference storage are skipped too, since reading them is redirected
+ * to the original block device. Partially stored chunks are skipped, since
+ * their data is assembled from both devices by the image I/O processing.
+ * Since the lock of the chunk is released only when
+ * loading is completed, the image I/O processing will wait for the data of
+ * each chunk.
+ */
+void diff_area_image_prefetch(struct diff_area *diff_area, sector_t sector,
+			      sector_t count, unsigned int readahead)
+{
+	unsigned long number;
+	unsigned long covered;
+	unsigned long last;
+	unsigned int state;
+	struct chunk *chunk;
+	struct diff_buffer *diff_buffer;
+
+	if (unlikely(!count || diff_area_is_corrupted(diff_area)))
+		return;
+
+	number = chunk_number(diff_area, sector);
+	covered = chunk_number(diff_area, sector + count - 1);
+	last = covered + readahead;
+	if (last >= diff_area->chunk_count)
+		last = diff_area->chunk_count - 1;
+
+	for (; number <= last; number++) {
+		if (!diff_area_chunk_trylock(diff_area, number))
+			continue;
+
+		state = diff_area_chunk_state(diff_area, number);
+		if ((state & (CHUNK_ST_FAILED | CHUNK_ST_BUFFER_READY |
+			      CHUNK_ST_PARTIAL)) ||
+		    ((number > covered) && !(state & CHUNK_ST_STORE_READY))) {
+			diff_area_chunk_unlock(diff_area, number);
+			continue;
+		}
+
+		chunk = diff_area_chunk_take(diff_area, number, true);
+		if (IS_ERR(chunk)) {
+			diff_area_chunk_unlock(diff_area, number);
+			break;
+		}
+
+		diff_buffer = diff_buffer_take(diff_area, true);
+		if (IS_ERR(diff_buffer)) {
+			chunk_unlock(chunk);
+			break;
+		}
+		WARN_ON(chunk->diff_buffer);
+		chunk->diff_buffer = diff_buffer;
+		if (number > covered)
+			chunk_state_set(chunk, CHUNK_ST_PREFETCHED);
+
+		if (chunk_async_load_image(chunk, true)) {
+			chunk_diff_buffer_release(chunk);
+			chunk_unlock(chunk);
+			break;
+		}
+	}
 }
 
 static inline void diff_area_image_put_chunk(struct chunk *chunk, bool is_write)
@@ -500,6 +1037,7 @@ void diff_area_image_ctx_done(struct diff_area_image_ctx *io_ctx)
 static int diff_area_load_chunk_from_storage(struct diff_area *diff_area,
 					     struct chunk *chunk)
 {
+	int ret;
 	struct diff_buffer *diff_buffer;
 
 	diff_buffer = diff_buffer_take(diff_area, false);
@@ -512,7 +1050,15 @@ static int diff_area_load_chunk_from_storage(struct diff_area *diff_area,
 	if (chunk_state_check(chunk, CHUNK_ST_STORE_READY))
 		return chunk_load_diff(chunk);
 
-	return chunk_load_orig(chunk);
+	ret = chunk_load_orig(chunk);
+	if (ret || !chunk_state_check(chunk, CHUNK_ST_PARTIAL))
+		return ret;
+
+	/*
+	 * The sub-blocks that have been overwritten on the original block
+	 * device are read from the difference storage.
+	 */
+	return chunk_load_diff_subblocks(chunk);
 }
 
 static struct chunk *
@@ -538,14 +1084,19 @@ diff_area_image_context_get_chunk(struct diff_area_image_ctx *io_ctx,
 	}
 
 	/* Take a next chunk. */
-	chunk = xa_load(&diff_area->chunk_map, new_chunk_number);
-	if (unlikely(!chunk))
+	if (unlikely(new_chunk_number >= diff_area->chunk_count))
 		return ERR_PTR(-EINVAL);
 
-	ret = down_killable(&chunk->lock);
+	ret = diff_area_chunk_lock(diff_area, new_chunk_number, TASK_KILLABLE);
 	if (ret)
 		return ERR_PTR(ret);
 
+	chunk = diff_area_chunk_take(diff_area, new_chunk_number, false);
+	if (IS_ERR(chunk)) {
+		diff_area_chunk_unlock(diff_area, new_chunk_number);
+		return chunk;
+	}
+
 	if (unlikely(chunk_state_check(chunk, CHUNK_ST_FAILED))) {
 		pr_err("Chunk #%ld corrupted\n", chunk->number);
 
@@ -571,15 +1122,26 @@ diff_area_image_context_get_chunk(struct diff_area_image_ctx *io_ctx,
 
 		/* Set the flag that the buffer contains the required data. */
 		chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
-	} else
+	} else {
 		diff_area_take_chunk_from_cache(diff_area, chunk);
+		/*
+		 * The chunk loaded in advance is read, so now it will
+		 * be placed in the read cache. The chunk that is accessed
+		 * again will be placed in the hot cache.
+		 */
+		if (chunk_state_check(chunk, CHUNK_ST_PREFETCHED))
+			chunk_state_unset(chunk, CHUNK_ST_PREFETCHED);
+		else
+			chunk_state_set(chunk, CHUNK_ST_HOT);
+	}
 
 	io_ctx->chunk = chunk;
 	return chunk;
 
 fail_unlock_chunk:
 	pr_err("Failed to load chunk #%ld\n", chunk->number);
-	up(&chunk->lock);
+	chunk_diff_buffer_release(chunk);
+	chunk_unlock(chunk);
 	return ERR_PTR(ret);
 }
 
@@ -650,7 +1212,7 @@ static inline void diff_area_event_corrupted(struct diff_area *diff_area,
 		.err_code = abs(err_code),
 	};
 
-	event_gen(&diff_area->diff_storage->event_queue, GFP_NOIO,
+	event_gen(&diff_area->diff_storage->event_queue,
 		  blk_snap_event_code_corrupted, &data,
 		  sizeof(struct blk_snap_event_corrupted));
 }
@@ -683,19 +1245,12 @@ void diff_area_throttling_io(struct diff_area *diff_area)
 int diff_area_get_sector_state(struct diff_area *diff_area, sector_t sector,
 			       unsigned int *chunk_state)
 {
-	struct chunk *chunk;
-	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
-	sector_t offset = round_down(sector, chunk_sectors);
+	unsigned long number = chunk_number(diff_area, sector);
 
-	chunk = xa_load(&diff_area->chunk_map, chunk_number(diff_area, offset));
-	if (!chunk)
+	if (number >= diff_area->chunk_count)
 		return -EINVAL;
 
-	WARN_ON(chunk_number(diff_area, offset) != chunk->number);
-	down(&chunk->lock);
-	*chunk_state = atomic_read(&chunk->state);
-	up(&chunk->lock);
-
+	*chunk_state = diff_area_chunk_state(diff_area, number);
 	return 0;
 }
 
@@ -9,6 +9,8 @@
 #include <linux/spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/xarray.h>
+#include <linux/bitops.h>
+#include <linux/wait_bit.h>
 #include "event_queue.h"
 
 struct diff_storage;
@@ -29,8 +31,17 @@ struct chunk;
  * @chunk_count:
  *	Count of chunks. The number of chunks into which the block device
  *	is divided.
+ * @subblock_shift:
+ *	Power of 2 used to specify the sub-block size. The copy-on-write
+ *	algorithm copies only the sub-blocks of the chunk that are overwritten.
+ *	Equal to @chunk_shift if the chunks are always copied entirely.
  * @chunk_map:
- *	A map of chunks.
+ *	A map of chunks. It contains the objects of the chunks that are in use
+ *	and the regions of idle chunks stored in the difference storage.
+ *	A chunk that is not in the map has never been stored.
+ * @chunk_states:
+ *	The chunk state map. A slot of CHUNK_STATE_BITS bits for each chunk
+ *	contains its CHUNK_ST_* flags and its lock bit.
  * @in_memory:
  *	A sign that difference storage is not prepared and all differences are
  *	stored in RAM.
@@ -38,16 +49,29 @@ struct chunk;
  *	This spinlock guarantees consistency of the linked lists of chunk
  *	caches.
  * @read_cache_queue:
- *	Queue for the read cache.
+ *	Queue for the read cache. The chunks that have been read once are
+ *	kept in it on probation.
  * @read_cache_count:
  *	The number of chunks in the read cache.
+ * @hot_cache_queue:
+ *	Queue for the hot cache. The chunks that have been read again while
+ *	they were in the cache are kept in it.
+ * @hot_cache_count:
+ *	The number of chunks in the hot cache.
  * @write_cache_queue:
  *	Queue for the write cache.
  * @write_cache_count:
  *	The number of chunks in the write cache.
+ * @prefetch_cache_queue:
+ *	Queue for the chunks loaded in advance and not read yet.
+ * @prefetch_cache_count:
+ *	The number of chunks in the prefetch cache.
  * @cache_release_work:
  *	The workqueue work item. This worker limits the number of chunks
  *	that store their data in RAM.
+ * @cache_manager_link:
+ *	The list header allows the cache manager to keep the list of all
+ *	difference areas.
  * @free_diff_buffers_lock:
  *	This spinlock guarantees consistency of the linked lists of
  *	free difference buffers.
@@ -55,7 +79,11 @@ struct chunk;
  *	Linked list of free difference buffers allows to reduce the number
  *	of buffer allocation and release operations.
  * @free_diff_buffers_count:
- *	The number of free difference buffers in the linked list.
+ *	The number of free difference buffers in the linked list and in the
+ *	per-CPU caches.
+ * @cpu_diff_buffers:
+ *	Per-CPU caches of free difference buffers. They allow to take and
+ *	release a buffer without the shared spinlock.
  * @corrupt_flag:
  *	The flag is set if an error occurred in the operation of the data
  *	saving mechanism in the diff area. In this case, an error will be
@@ -63,6 +91,11 @@ struct chunk;
  * @pending_io_count:
  *	Counter of incomplete I/O operations. Allows to wait for all I/O
  *	operations to be completed before releasing this structure.
+ * @free_work:
+ *	The workqueue work item. Each read from the snapshot image redirected
+ *	to the original block device holds a reference to the difference
+ *	area. Since such reads are completed in the interrupt context, the
+ *	last reference released there frees the structure in this worker.
  *
  * The &struct diff_area is created for each block device in the snapshot.
  * It is used to save the differences between the original block device and
@@ -81,13 +114,24 @@ struct chunk;
  * limited.
  *
  * To provide high performance, a read cache and a write cache for chunks are
- * used. The cache algorithm is the simplest. If the data of the chunk was
- * read to the difference buffer, then the buffer is not released immediately,
- * but is placed at the end of the queue. The worker thread checks the number
- * of chunks in the queue and releases a difference buffer for the first chunk
- * in the queue, but only if the binary semaphore of the chunk is not locked.
- * If the read thread accesses the chunk from the cache again, it returns
- * back to the end of the queue.
+ * used. If the data of the chunk was read to the difference buffer, then the
+ * buffer is not released immediately, but is placed at the end of the read
+ * cache queue. If the read thread accesses the chunk from the cache again,
+ * the chunk is moved to the end of the hot cache queue. When the cache manager
+ * reports that the difference area uses too much memory, the worker thread
+ * releases a difference buffer for the first chunk in the queue, but only if
+ * the chunk is not locked. The chunks of the read cache are released first,
+ * while the read cache takes more than 1/DIFF_AREA_READ_CACHE_SHARE of the
+ * clean cache. Thus, reading the snapshot image sequentially does not evict
+ * the chunks that are used frequently.
+ *
+ * The dirty chunks are stored in groups. The chunks of a group are sorted by
+ * their location in the difference storage, so the writes are sequential.
+ *
+ * Chunks loaded in advance when reading the snapshot image are placed in
+ * a separate prefetch queue with its own limit. A chunk gets into the read
+ * cache only after it has actually been read. Thus, the readahead of a
+ * sequential stream does not evict the frequently used chunks.
  *
  * The linked list of difference buffers allows to have a certain number of
  * "hot" buffers. This allows to reduce the number of allocations and releases
@@ -103,27 +147,126 @@ struct diff_area {
 
 	unsigned long long chunk_shift;
 	unsigned long chunk_count;
+	unsigned long long subblock_shift;
 	struct xarray chunk_map;
+	unsigned long *chunk_states;
 #ifdef BLK_SNAP_ALLOW_DIFF_STORAGE_IN_MEMORY
 	bool in_memory;
 #endif
 	spinlock_t caches_lock;
 	struct list_head read_cache_queue;
 	atomic_t read_cache_count;
+	struct list_head hot_cache_queue;
+	atomic_t hot_cache_count;
 	struct list_head write_cache_queue;
 	atomic_t write_cache_count;
+	struct list_head prefetch_cache_queue;
+	atomic_t prefetch_cache_count;
 	struct work_struct cache_release_work;
+	struct list_head cache_manager_link;
 
 	spinlock_t free_diff_buffers_lock;
 	struct list_head free_diff_buffers;
 	atomic_t free_diff_buffers_count;
+	struct diff_buffer_cpu __percpu *cpu_diff_buffers;
 
 	unsigned long corrupt_flag;
 	atomic_t pending_io_count;
+	struct work_struct free_work;
 };
 
+/*
+ * Each chunk has a slot in the chunk state map. The lower bits of the slot
+ * contain the CHUNK_ST_* flags, and the upper bit is the lock of the chunk.
+ * Waiting for the lock uses the hashed bit wait queues, so there is no need
+ * for a wait queue for each chunk.
+ */
+#define CHUNK_STATE_BITS 16
+#define CHUNK_STATE_MASK ((1UL << (CHUNK_STATE_BITS - 1)) - 1)
+#define CHUNK_LOCK_BIT (CHUNK_STATE_BITS - 1)
+#define CHUNK_STATE_PER_LONG (BITS_PER_LONG / CHUNK_STATE_BITS)
+
+static inline unsigned long *diff_area_chunk_word(struct diff_area *diff_area,
+						  unsigned long number)
+{
+	return &diff_area->chunk_states[number / CHUNK_STATE_PER_LONG];
+};
+static inline unsigned int diff_area_chunk_shift(unsigned long number)
+{
+	return (number % CHUNK_STATE_PER_LONG) * CHUNK_STATE_BITS;
+};
+static inline unsigned int diff_area_chunk_state(struct diff_area *diff_area,
+						 unsigned long number)
+{
+	return (READ_ONCE(*diff_area_chunk_word(diff_area, number)) >>
+		diff_area_chunk_shift(number)) & CHUNK_STATE_MASK;
+};
+static inline void diff_area_chunk_state_set(struct diff_area *diff_area,
+					     unsigned long number,
+					     unsigned int st)
+{
+	set_mask_bits(diff_area_chunk_word(diff_area, number), 0UL,
+		      (unsigned long)st << diff_area_chunk_shift(number));
+};
+static inline void diff_area_chunk_state_unset(struct diff_area *diff_area,
+					       unsigned long number,
+					       unsigned int st)
+{
+	set_mask_bits(diff_area_chunk_word(diff_area, number),
+		      (unsigned long)st << diff_area_chunk_shift(number), 0UL);
+};
+static inline bool diff_area_chunk_trylock(struct diff_area *diff_area,
+					   unsigned long number)
+{
+	return !test_and_set_bit_lock(
+		diff_area_chunk_shift(number) + CHUNK_LOCK_BIT,
+		diff_area_chunk_word(diff_area, number));
+};
+static inline int diff_area_chunk_lock(struct diff_area *diff_area,
+				       unsigned long number, int mode)
+{
+	return wait_on_bit_lock(diff_area_chunk_word(diff_area, number),
+				diff_area_chunk_shift(number) + CHUNK_LOCK_BIT,
+				mode);
+};
+static inline void diff_area_chunk_unlock(struct diff_area *diff_area,
+					  unsigned long number)
+{
+	unsigned long *word = diff_area_chunk_word(diff_area, number);
+	int bit = diff_area_chunk_shift(number) + CHUNK_LOCK_BIT;
+
+	clear_bit_unlock(bit, word);
+	smp_mb__after_atomic();
+	wake_up_bit(word, bit);
+};
+
+/*
+ * The read cache is released first while it takes more than this part of
+ * the read and hot caches.
+ */
+#define DIFF_AREA_READ_CACHE_SHARE 4
+
+/*
+ * The maximum number of dirty chunks that are stored as one group.
+ */
+#define DIFF_AREA_WRITEBACK_BATCH 16
+
+/*
+ * The number of chunks in the cache queue that are checked when looking for
+ * a chunk to release. The chunks at the head of the queue are rarely locked,
+ * so there is no need to walk the whole queue under the spinlock.
+ */
+#define DIFF_AREA_CACHE_SCAN_MAX 16
+
+/*
+ * The power of 2 for the maximum chunk size that can be requested for
+ * a snapshot.
+ */
+#define DIFF_AREA_CHUNK_SHIFT_MAX 24
+
 struct diff_area *diff_area_new(dev_t dev_id,
-				struct diff_storage *diff_storage);
+				struct diff_storage *diff_storage,
+				unsigned int chunk_shift);
 void diff_area_free(struct kref *kref);
 static inline void diff_area_get(struct diff_area *diff_area)
 {
@@ -146,6 +289,17 @@ static inline sector_t diff_area_chunk_sectors(struct diff_area *diff_area)
 int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
 		   const bool is_nowait);
 
+static inline int diff_area_cache_count(struct diff_area *diff_area)
+{
+	return atomic_read(&diff_area->read_cache_count) +
+	       atomic_read(&diff_area->hot_cache_count) +
+	       atomic_read(&diff_area->write_cache_count) +
+	       atomic_read(&diff_area->prefetch_cache_count);
+};
+unsigned long diff_area_cache_clean_count(struct diff_area *diff_area);
+unsigned long diff_area_cache_shrink(struct diff_area *diff_area,
+				     unsigned long nr_to_scan);
+
 int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
 		   const bool is_nowait);
 /**
@@ -174,6 +328,9 @@ static inline void diff_area_image_ctx_init(struct diff_area_image_ctx *io_ctx,
 	io_ctx->chunk = NULL;
 };
 void diff_area_image_ctx_done(struct diff_area_image_ctx *io_ctx);
+bool diff_area_image_passthrough(struct diff_area *diff_area, struct bio *bio);
+void diff_area_image_prefetch(struct diff_area *diff_area, sector_t sector,
+			      sector_t count, unsigned int readahead);
 blk_status_t diff_area_image_io(struct diff_area_image_ctx *io_ctx,
 				const struct bio_vec *bvec, sector_t *pos);
 
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 #define pr_fmt(fmt) KBUILD_MODNAME "-diff-buffer: " fmt
 
+#include <linux/percpu.h>
 #include "memory_checker.h"
 #include "diff_buffer.h"
 #include "diff_area.h"
@@ -28,11 +29,21 @@ static void diff_buffer_free(struct diff_buffer *diff_buffer)
 	memory_object_dec(memory_object_diff_buffer);
 }
 
+/*
+ * The buffer is allocated by blocks of physically contiguous pages, so that
+ * the I/O units for the buffer consist of a few large segments. The order of
+ * the block is limited so as not to put pressure on the memory allocator.
+ * If there are no free blocks of this order, smaller blocks are used.
+ * Each block is split into single pages, so the buffer is still accessed and
+ * released page by page.
+ */
 static struct diff_buffer *
 diff_buffer_new(size_t page_count, size_t buffer_size, gfp_t gfp_mask)
 {
 	struct diff_buffer *diff_buffer;
 	size_t inx = 0;
+	unsigned int order;
+	unsigned int offset;
 	struct page *page;
 
 	if (unlikely(page_count <= 0))
@@ -53,13 +64,29 @@ diff_buffer_new(size_t page_count, size_t buffer_size, gfp_t gfp_mask)
 	diff_buffer->size = buffer_size;
 	diff_buffer->page_count = page_count;
 
-	for (inx = 0; inx < page_count; inx++) {
-		page = alloc_page(gfp_mask);
+	while (inx < page_count) {
+		order = min_t(unsigned int, ilog2(page_count - inx),
+			      PAGE_ALLOC_COSTLY_ORDER);
+		for (;;) {
+			if (order)
+				page = alloc_pages(gfp_mask | __GFP_NORETRY |
+							   __GFP_NOWARN,
+						   order);
+			else
+				page = alloc_page(gfp_mask);
+			if (page || !order)
+				break;
+			order--;
+		}
 		if (!page)
 			goto fail;
-		memory_object_inc(memory_object_page);
+		if (order)
+			split_page(page, order);
 
-		diff_buffer->pages[inx] = page;
+		for (offset = 0; offset < (1U << order); offset++) {
+			memory_object_inc(memory_object_page);
+			diff_buffer->pages[inx++] = nth_page(page, offset);
+		}
 	}
 	return diff_buffer;
 fail:
@@ -67,14 +94,51 @@ fail:
 	return NULL;
 }
 
+int diff_buffer_init(struct diff_area *diff_area)
+{
+	int cpu;
+
+	diff_area->cpu_diff_buffers = alloc_percpu(struct diff_buffer_cpu);
+	if (!diff_area->cpu_diff_buffers)
+		return -ENOMEM;
+	memory_object_inc(memory_object_diff_buffer_cpu);
+
+	for_each_possible_cpu(cpu) {
+		struct diff_buffer_cpu *cpu_buffers =
+			per_cpu_ptr(diff_area->cpu_diff_buffers, cpu);
+
+		spin_lock_init(&cpu_buffers->lock);
+		INIT_LIST_HEAD(&cpu_buffers->list);
+		cpu_buffers->count = 0;
+	}
+	return 0;
+}
+
 struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 				     const bool is_nowait)
 {
 	struct diff_buffer *diff_buffer = NULL;
+	struct diff_buffer_cpu *cpu_buffers;
 	sector_t chunk_sectors;
 	size_t page_count;
 	size_t buffer_size;
 
+	cpu_buffers = get_cpu_ptr(diff_area->cpu_diff_buffers);
+	spin_lock(&cpu_buffers->lock);
+	diff_buffer = list_first_entry_or_null(&cpu_buffers->list,
+					       struct diff_buffer, link);
+	if (diff_buffer) {
+		list_del(&diff_buffer->link);
+		cpu_buffers->count--;
+		atomic_dec(&diff_area->free_diff_buffers_count);
+	}
+	spin_unlock(&cpu_buffers->lock);
+	put_cpu_ptr(diff_area->cpu_diff_buffers);
+
+	/* Return free buffer if it was found in the cache of the CPU */
+	if (diff_buffer)
+		return diff_buffer;
+
 	spin_lock(&diff_area->free_diff_buffers_lock);
 	diff_buffer = list_first_entry_or_null(&diff_area->free_diff_buffers,
 					       struct diff_buffer, link);
@@ -95,7 +159,7 @@ struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 
 	diff_buffer =
 		diff_buffer_new(page_count, buffer_size,
-				is_nowait ? (GFP_NOIO | GFP_NOWAIT) : GFP_NOIO);
+				is_nowait ? GFP_NOWAIT : GFP_NOIO);
 	if (unlikely(!diff_buffer)) {
 		if (is_nowait)
 			return ERR_PTR(-EAGAIN);
@@ -109,11 +173,29 @@ struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 void diff_buffer_release(struct diff_area *diff_area,
 			 struct diff_buffer *diff_buffer)
 {
+	struct diff_buffer_cpu *cpu_buffers;
+	bool is_cached = false;
+
 	if (atomic_read(&diff_area->free_diff_buffers_count) >
 	    free_diff_buffer_pool_size) {
 		diff_buffer_free(diff_buffer);
 		return;
 	}
+
+	cpu_buffers = get_cpu_ptr(diff_area->cpu_diff_buffers);
+	spin_lock(&cpu_buffers->lock);
+	if (cpu_buffers->count < DIFF_BUFFER_CPU_CACHE_SIZE) {
+		list_add(&diff_buffer->link, &cpu_buffers->list);
+		cpu_buffers->count++;
+		atomic_inc(&diff_area->free_diff_buffers_count);
+		is_cached = true;
+	}
+	spin_unlock(&cpu_buffers->lock);
+	put_cpu_ptr(diff_area->cpu_diff_buffers);
+
+	if (is_cached)
+		return;
+
 	spin_lock(&diff_area->free_diff_buffers_lock);
 	list_add_tail(&diff_buffer->link, &diff_area->free_diff_buffers);
 	atomic_inc(&diff_area->free_diff_buffers_count);
@@ -121,8 +203,55 @@ void diff_buffer_release(struct diff_area *diff_area,
 }
 
 void diff_buffer_cleanup(struct diff_area *diff_area)
+{
+	diff_buffer_shrink(diff_area);
+
+	if (diff_area->cpu_diff_buffers) {
+		free_percpu(diff_area->cpu_diff_buffers);
+		diff_area->cpu_diff_buffers = NULL;
+		memory_object_dec(memory_object_diff_buffer_cpu);
+	}
+}
+
+/*
+ * Releases the buffers from the caches of all CPUs. It allows the shrinker
+ * and the cache manager to get back the memory held by idle CPUs.
+ */
+static unsigned long diff_buffer_shrink_cpu(struct diff_area *diff_area)
+{
+	struct diff_buffer *diff_buffer;
+	struct diff_buffer *tmp;
+	unsigned long freed = 0;
+	LIST_HEAD(list);
+	int cpu;
+
+	if (!diff_area->cpu_diff_buffers)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		struct diff_buffer_cpu *cpu_buffers =
+			per_cpu_ptr(diff_area->cpu_diff_buffers, cpu);
+
+		spin_lock(&cpu_buffers->lock);
+		list_splice_init(&cpu_buffers->list, &list);
+		atomic_sub(cpu_buffers->count,
+			   &diff_area->free_diff_buffers_count);
+		cpu_buffers->count = 0;
+		spin_unlock(&cpu_buffers->lock);
+	}
+
+	list_for_each_entry_safe(diff_buffer, tmp, &list, link) {
+		list_del(&diff_buffer->link);
+		diff_buffer_free(diff_buffer);
+		freed++;
+	}
+	return freed;
+}
+
+unsigned long diff_buffer_shrink(struct diff_area *diff_area)
 {
 	struct diff_buffer *diff_buffer = NULL;
+	unsigned long freed = diff_buffer_shrink_cpu(diff_area);
 
 	do {
 		spin_lock(&diff_area->free_diff_buffers_lock);
@@ -135,7 +264,11 @@ void diff_buffer_cleanup(struct diff_area *diff_area)
 		}
 		spin_unlock(&diff_area->free_diff_buffers_lock);
 
-		if (diff_buffer)
+		if (diff_buffer) {
 			diff_buffer_free(diff_buffer);
+			freed++;
+		}
 	} while (diff_buffer);
+
+	return freed;
 }
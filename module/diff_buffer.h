@@ -29,6 +29,31 @@ struct diff_buffer {
 	struct page *pages[0];
 };
 
+/*
+ * The maximum number of free buffers in the cache of each CPU.
+ */
+#define DIFF_BUFFER_CPU_CACHE_SIZE 2
+
+/**
+ * struct diff_buffer_cpu - Per-CPU cache of free difference buffers.
+ * @lock:
+ *	The spinlock allows the shrinker to drain the cache of another CPU.
+ *	Otherwise, it is taken only by its own CPU and is not contended.
+ * @list:
+ *	Linked list of free difference buffers.
+ * @count:
+ *	The number of buffers in the list.
+ *
+ * The cache is used by its CPU with preemption disabled. If the cache is
+ * empty or full, the shared pool of the difference area is used. The buffers
+ * in the cache are counted in the pool size of the difference area.
+ */
+struct diff_buffer_cpu {
+	spinlock_t lock;
+	struct list_head list;
+	unsigned int count;
+};
+
 /**
  * struct diff_buffer_iter - Iterator for &struct diff_buffer.
  * @page:
@@ -75,5 +100,7 @@ struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 				     const bool is_nowait);
 void diff_buffer_release(struct diff_area *diff_area,
 			 struct diff_buffer *diff_buffer);
+int diff_buffer_init(struct diff_area *diff_area);
 void diff_buffer_cleanup(struct diff_area *diff_area);
+unsigned long diff_buffer_shrink(struct diff_area *diff_area);
 #endif /* __BLK_SNAP_DIFF_BUFFER_H */
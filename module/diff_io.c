@@ -6,11 +6,16 @@
 #endif
 #include <linux/blkdev.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/percpu.h>
 #include "memory_checker.h"
 #include "diff_io.h"
 #include "diff_buffer.h"
 #include "log.h"
 
+extern int diff_storage_flush_interval;
+extern int chunk_maximum_in_prefetch;
+
 #ifdef STANDALONE_BDEVFILTER
 #ifndef PAGE_SECTORS
 #define PAGE_SECTORS	(1 << (PAGE_SHIFT - SECTOR_SHIFT))
@@ -18,16 +23,191 @@
 #endif
 
 struct bio_set diff_io_bioset;
+struct bio_set diff_io_clone_bioset;
+struct workqueue_struct *diff_io_wq;
+
+struct diff_io_latency {
+	u64 read[DIFF_IO_LATENCY_BUCKETS];
+	u64 write[DIFF_IO_LATENCY_BUCKETS];
+};
+static DEFINE_PER_CPU(struct diff_io_latency, diff_io_latency);
+
+static struct kmem_cache *diff_io_cache;
+static mempool_t diff_io_pool;
+static struct kmem_cache *diff_region_cache;
+static mempool_t diff_region_pool;
+
+/*
+ * The number of chunks in I/O, for which the reserve of the pools is kept,
+ * in addition to the prefetch cache.
+ */
+#define DIFF_IO_POOL_RESERVE 32
+
+/*
+ * The reserve of the pools is enough for many chunks and for all chunks of
+ * the prefetch cache to be in I/O at the same time. This guarantees
+ * the progress of the copy-on-write algorithm under memory pressure.
+ */
+static inline int diff_io_pool_size(void)
+{
+	return DIFF_IO_POOL_RESERVE + max(chunk_maximum_in_prefetch, 1);
+}
 
 int diff_io_init(void)
 {
-	return bioset_init(&diff_io_bioset, 64, 0,
-			   BIOSET_NEED_BVECS | BIOSET_NEED_RESCUER);
+	int ret;
+
+	/*
+	 * The completions are processed in the memory reclaim context too,
+	 * so the workqueue needs a rescuer.
+	 */
+	diff_io_wq = alloc_workqueue("blksnap-diff-io",
+				     WQ_MEM_RECLAIM | WQ_HIGHPRI | WQ_UNBOUND,
+				     0);
+	if (!diff_io_wq)
+		return -ENOMEM;
+
+	ret = bioset_init(&diff_io_bioset, 64, 0,
+			  BIOSET_NEED_BVECS | BIOSET_NEED_RESCUER);
+	if (ret)
+		goto fail_bioset;
+
+	ret = bioset_init(&diff_io_clone_bioset, 64,
+			  offsetof(struct diff_io_clone, bio), 0);
+	if (ret)
+		goto fail_clone_bioset;
+
+	diff_io_cache = kmem_cache_create("blksnap_diff_io",
+					  sizeof(struct diff_io), 0, 0, NULL);
+	if (!diff_io_cache) {
+		ret = -ENOMEM;
+		goto fail_diff_io_cache;
+	}
+	ret = mempool_init_slab_pool(&diff_io_pool, diff_io_pool_size(),
+				     diff_io_cache);
+	if (ret)
+		goto fail_diff_io_pool;
+
+	diff_region_cache = kmem_cache_create("blksnap_diff_region",
+					      sizeof(struct diff_region), 0, 0,
+					      NULL);
+	if (!diff_region_cache) {
+		ret = -ENOMEM;
+		goto fail_diff_region_cache;
+	}
+	ret = mempool_init_slab_pool(&diff_region_pool, diff_io_pool_size(),
+				     diff_region_cache);
+	if (ret)
+		goto fail_diff_region_pool;
+
+	return 0;
+
+fail_diff_region_pool:
+	kmem_cache_destroy(diff_region_cache);
+fail_diff_region_cache:
+	mempool_exit(&diff_io_pool);
+fail_diff_io_pool:
+	kmem_cache_destroy(diff_io_cache);
+fail_diff_io_cache:
+	bioset_exit(&diff_io_clone_bioset);
+fail_clone_bioset:
+	bioset_exit(&diff_io_bioset);
+fail_bioset:
+	destroy_workqueue(diff_io_wq);
+	diff_io_wq = NULL;
+	return ret;
 }
 
 void diff_io_done(void)
 {
+	mempool_exit(&diff_region_pool);
+	kmem_cache_destroy(diff_region_cache);
+	mempool_exit(&diff_io_pool);
+	kmem_cache_destroy(diff_io_cache);
+	bioset_exit(&diff_io_clone_bioset);
 	bioset_exit(&diff_io_bioset);
+	destroy_workqueue(diff_io_wq);
+	diff_io_wq = NULL;
+}
+
+static inline void diff_io_latency_account(struct diff_io *diff_io)
+{
+	s64 us = ktime_us_delta(ktime_get(), diff_io->start_time);
+	unsigned int inx = 0;
+
+	if (us > 1)
+		inx = min_t(unsigned int, ilog2(us),
+			    DIFF_IO_LATENCY_BUCKETS - 1);
+
+	if (diff_io->is_write)
+		this_cpu_inc(diff_io_latency.write[inx]);
+	else
+		this_cpu_inc(diff_io_latency.read[inx]);
+}
+
+/**
+ * diff_io_latency_get() - Get the histogram of the completion latency.
+ * @read:
+ *	Array of DIFF_IO_LATENCY_BUCKETS counters for read requests.
+ * @write:
+ *	Array of DIFF_IO_LATENCY_BUCKETS counters for write requests.
+ * @is_reset:
+ *	Reset the counters after reading. The requests that are completed at
+ *	the same time may be lost.
+ */
+void diff_io_latency_get(u64 *read, u64 *write, bool is_reset)
+{
+	int cpu;
+	int inx;
+
+	memset(read, 0, sizeof(u64) * DIFF_IO_LATENCY_BUCKETS);
+	memset(write, 0, sizeof(u64) * DIFF_IO_LATENCY_BUCKETS);
+	for_each_possible_cpu(cpu) {
+		struct diff_io_latency *latency =
+			per_cpu_ptr(&diff_io_latency, cpu);
+
+		for (inx = 0; inx < DIFF_IO_LATENCY_BUCKETS; inx++) {
+			read[inx] += READ_ONCE(latency->read[inx]);
+			write[inx] += READ_ONCE(latency->write[inx]);
+		}
+		if (is_reset)
+			memset(latency, 0, sizeof(struct diff_io_latency));
+	}
+}
+
+/*
+ * Allocates the region from the pool. Unlike kzalloc(), the reserve of
+ * the pool can be used even when waiting is not allowed.
+ */
+struct diff_region *diff_region_new(gfp_t gfp_mask)
+{
+	struct diff_region *diff_region;
+
+	diff_region = mempool_alloc(&diff_region_pool, gfp_mask);
+	if (unlikely(!diff_region))
+		return NULL;
+	memory_object_inc(memory_object_diff_region);
+
+	memset(diff_region, 0, sizeof(struct diff_region));
+	return diff_region;
+}
+
+void diff_region_free(struct diff_region *diff_region)
+{
+	if (unlikely(!diff_region))
+		return;
+
+	mempool_free(diff_region, &diff_region_pool);
+	memory_object_dec(memory_object_diff_region);
+}
+
+void diff_io_free(struct diff_io *diff_io)
+{
+	if (unlikely(!diff_io))
+		return;
+
+	mempool_free(diff_io, &diff_io_pool);
+	memory_object_dec(memory_object_diff_io);
 }
 
 static void diff_io_notify_cb(struct work_struct *work)
@@ -36,6 +216,8 @@ static void diff_io_notify_cb(struct work_struct *work)
 		container_of(work, struct diff_io_async, work);
 
 	might_sleep();
+	diff_io_latency_account(
+		container_of(async, struct diff_io, notify.async));
 	async->notify_cb(async->ctx);
 }
 
@@ -54,7 +236,7 @@ static void diff_io_endio(struct bio *bio)
 		if (diff_io->is_sync_io)
 			complete(&diff_io->notify.sync.completion);
 		else
-			queue_work(system_wq, &diff_io->notify.async.work);
+			queue_work(diff_io_wq, &diff_io->notify.async.work);
 	}
 
 	bio_put(bio);
@@ -63,13 +245,14 @@ static void diff_io_endio(struct bio *bio)
 static inline struct diff_io *diff_io_new(bool is_write, bool is_nowait)
 {
 	struct diff_io *diff_io;
-	gfp_t gfp_mask = is_nowait ? (GFP_NOIO | GFP_NOWAIT) : GFP_NOIO;
+	gfp_t gfp_mask = is_nowait ? GFP_NOWAIT : GFP_NOIO;
 
-	diff_io = kzalloc(sizeof(struct diff_io), gfp_mask);
+	diff_io = mempool_alloc(&diff_io_pool, gfp_mask);
 	if (unlikely(!diff_io))
 		return NULL;
 	memory_object_inc(memory_object_diff_io);
 
+	memset(diff_io, 0, sizeof(struct diff_io));
 	diff_io->error = 0;
 	diff_io->is_write = is_write;
 	atomic_set(&diff_io->bio_count, 0);
@@ -123,44 +306,52 @@ static inline unsigned int bio_max_segs(unsigned int nr_segs)
 }
 #endif
 
+static inline size_t calc_buffers_page_count(struct diff_buffer **diff_buffers,
+					     unsigned int buffer_count)
+{
+	size_t page_count = 0;
+	unsigned int inx;
+
+	for (inx = 0; inx < buffer_count; inx++)
+		page_count += diff_buffers[inx]->page_count;
+	return page_count;
+}
+
 /*
- * diff_io_do() - Perform an I/O operation.
- *
- * Returns zero if successful. Failure is possible if the is_nowait flag is set
- * and a failure was occured when allocating memory. In this case, the error
- * code -EAGAIN is returned. The error code -EINVAL means that the input
- * arguments are incorrect.
+ * The cursor points to the page of the buffers from which the next I/O unit
+ * is filled.
  */
-int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
-	       struct diff_buffer *diff_buffer, const bool is_nowait)
+struct diff_io_cursor {
+	struct diff_buffer **buffer_ptr;
+	size_t page_inx;
+};
+
+/*
+ * Appends to the list the I/O units for the sectors of the block device.
+ * The I/O units are filled with the pages of the buffers starting from the
+ * cursor position.
+ */
+static int diff_io_add_bios(struct diff_io *diff_io, struct bio_list *bio_list,
+			    struct block_device *bdev, sector_t sector,
+			    sector_t count, struct diff_io_cursor *cursor,
+			    const bool is_nowait)
 {
 	struct bio *bio;
-	struct bio_list bio_list_head = BIO_EMPTY_LIST;
-	struct page **current_page_ptr;
 	sector_t processed = 0;
-	gfp_t gfp = GFP_NOIO | (is_nowait ? GFP_NOWAIT : 0);
+	gfp_t gfp = is_nowait ? GFP_NOWAIT : GFP_NOIO;
 	unsigned int opf = diff_io->is_write ? REQ_OP_WRITE : REQ_OP_READ;
-	unsigned op_flags = REQ_SYNC | (diff_io->is_write ? REQ_FUA : 0);
+	unsigned op_flags = REQ_SYNC;
 
-	if (unlikely(!check_page_aligned(diff_region->sector))) {
-		pr_err("Difference storage block should be aligned to PAGE_SIZE\n");
-		return -EINVAL;
-	}
-
-	if (unlikely(calc_page_count(diff_region->count) >
-		     diff_buffer->page_count)) {
-		pr_err("The difference storage block is larger than the buffer size\n");
-		return -EINVAL;
-	}
+	if (diff_io->is_write && (diff_storage_flush_interval <= 0))
+		op_flags |= REQ_FUA;
 
 	/* Append bio with datas to bio_list */
-	current_page_ptr = diff_buffer->pages;
-	while (processed < diff_region->count) {
+	while (processed < count) {
 		sector_t offset = 0;
 		sector_t portion;
 		unsigned short nr_iovecs;
 
-		portion = diff_region->count - processed;
+		portion = count - processed;
 		nr_iovecs = calc_page_count(portion);
 
 		if (nr_iovecs > bio_max_segs(nr_iovecs)) {
@@ -169,58 +360,247 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 		}
 
 #ifdef HAVE_BDEV_BIO_ALLOC
-		bio = bio_alloc_bioset(diff_region->bdev, nr_iovecs,
+		bio = bio_alloc_bioset(bdev, nr_iovecs,
 				       opf | op_flags,  gfp, &diff_io_bioset);
 #else
 		bio = bio_alloc_bioset(gfp, nr_iovecs, &diff_io_bioset);
 #endif
 		if (unlikely(!bio))
-			goto fail;
+			return -EAGAIN;
 
 #ifndef STANDALONE_BDEVFILTER
 		bio_set_flag(bio, BIO_FILTERED);
 #endif
 		bio->bi_end_io = diff_io_endio;
 		bio->bi_private = diff_io;
-		bio_set_dev(bio, diff_region->bdev);
-		bio->bi_iter.bi_sector = diff_region->sector + processed;
+		bio_set_dev(bio, bdev);
+		bio->bi_iter.bi_sector = sector + processed;
 
 #ifndef HAVE_BDEV_BIO_ALLOC
 		bio_set_op_attrs(bio, opf, op_flags);
 #endif
 
 		while (offset < portion) {
-			sector_t bvec_len_sect;
-			unsigned int bvec_len;
-
-			bvec_len_sect = min_t(sector_t, PAGE_SECTORS,
-					      portion - offset);
-			bvec_len =
-				(unsigned int)(bvec_len_sect << SECTOR_SHIFT);
+			struct page *page;
+			sector_t bvec_len_sect = 0;
+
+			if (cursor->page_inx ==
+			    (*cursor->buffer_ptr)->page_count) {
+				cursor->buffer_ptr++;
+				cursor->page_inx = 0;
+			}
+
+			/*
+			 * The pages of the buffer that follow each other in
+			 * memory are added to the bio as one segment.
+			 */
+			page = (*cursor->buffer_ptr)->pages[cursor->page_inx];
+			do {
+				bvec_len_sect += min_t(sector_t, PAGE_SECTORS,
+						       portion - offset -
+							       bvec_len_sect);
+				cursor->page_inx++;
+			} while (((offset + bvec_len_sect) < portion) &&
+				 (cursor->page_inx <
+				  (*cursor->buffer_ptr)->page_count) &&
+				 ((*cursor->buffer_ptr)->pages[cursor->page_inx] ==
+				  nth_page(page, bvec_len_sect / PAGE_SECTORS)));
 
 			/* All pages offset aligned to PAGE_SIZE */
-			__bio_add_page(bio, *current_page_ptr, bvec_len, 0);
+			__bio_add_page(bio, page,
+				       (unsigned int)(bvec_len_sect << SECTOR_SHIFT),
+				       0);
 
-			current_page_ptr++;
 			offset += bvec_len_sect;
 		}
 
-		bio_list_add(&bio_list_head, bio);
+		bio_list_add(bio_list, bio);
 		atomic_inc(&diff_io->bio_count);
 
 		processed += offset;
 	}
 
+	return 0;
+}
+
+static int diff_io_submit(struct diff_io *diff_io, struct bio_list *bio_list,
+			  int ret)
+{
+	struct bio *bio;
+	struct blk_plug plug;
+
+	if (unlikely(ret)) {
+		while ((bio = bio_list_pop(bio_list)))
+			bio_put(bio);
+		return ret;
+	}
+
 	/* sumbit all bios */
-	while ((bio = bio_list_pop(&bio_list_head)))
+	diff_io->start_time = ktime_get();
+	blk_start_plug(&plug);
+	while ((bio = bio_list_pop(bio_list)))
 		submit_bio_noacct(bio);
+	blk_finish_plug(&plug);
 
 	if (diff_io->is_sync_io)
 		wait_for_completion_io(&diff_io->notify.sync.completion);
 
 	return 0;
-fail:
-	while ((bio = bio_list_pop(&bio_list_head)))
-		bio_put(bio);
-	return -EAGAIN;
+}
+
+/*
+ * diff_io_do_regions() - Perform an I/O operation for several buffers.
+ *
+ * The regions are filled with the pages of the buffers one after another.
+ * This allows to read or write the data of several adjacent chunks with
+ * large I/O units, even if the difference storage does not have a single
+ * free extent for all of them. The I/O units of all regions are completed
+ * together.
+ *
+ * Returns zero if successful. Failure is possible if the is_nowait flag is set
+ * and a failure was occured when allocating memory. In this case, the error
+ * code -EAGAIN is returned. The error code -EINVAL means that the input
+ * arguments are incorrect.
+ */
+int diff_io_do_regions(struct diff_io *diff_io, struct diff_region *regions,
+		       unsigned int region_count,
+		       struct diff_buffer **diff_buffers,
+		       unsigned int buffer_count, const bool is_nowait)
+{
+	struct bio_list bio_list_head = BIO_EMPTY_LIST;
+	struct diff_io_cursor cursor = {
+		.buffer_ptr = diff_buffers,
+		.page_inx = 0,
+	};
+	unsigned long page_count = 0;
+	unsigned int inx;
+	int ret = 0;
+
+	for (inx = 0; inx < region_count; inx++) {
+		if (unlikely(!check_page_aligned(regions[inx].sector))) {
+			pr_err("Difference storage block should be aligned to PAGE_SIZE\n");
+			return -EINVAL;
+		}
+		page_count += calc_page_count(regions[inx].count);
+	}
+
+	if (unlikely(page_count >
+		     calc_buffers_page_count(diff_buffers, buffer_count))) {
+		pr_err("The difference storage block is larger than the buffer size\n");
+		return -EINVAL;
+	}
+
+	for (inx = 0; (inx < region_count) && !ret; inx++)
+		ret = diff_io_add_bios(diff_io, &bio_list_head,
+				       regions[inx].bdev, regions[inx].sector,
+				       regions[inx].count, &cursor, is_nowait);
+	return diff_io_submit(diff_io, &bio_list_head, ret);
+}
+
+/*
+ * diff_io_do_blocks() - Perform an I/O operation for several blocks of the
+ *	region.
+ *
+ * The region and the buffer are divided into blocks of the same size. Only
+ * the blocks whose bits are set in the mask are read or written. Each
+ * continuous run of blocks is processed by its own I/O units, but all of them
+ * are completed together.
+ *
+ * The size of the block must be a multiple of PAGE_SIZE.
+ */
+int diff_io_do_blocks(struct diff_io *diff_io, struct diff_region *diff_region,
+		      struct diff_buffer *diff_buffer, unsigned long mask,
+		      unsigned int block_shift, const bool is_nowait)
+{
+	struct bio_list bio_list_head = BIO_EMPTY_LIST;
+	sector_t block_sectors = 1ull << (block_shift - SECTOR_SHIFT);
+	unsigned long first;
+	unsigned long last;
+	int ret = 0;
+
+	if (unlikely(!check_page_aligned(diff_region->sector) ||
+		     (block_shift < PAGE_SHIFT))) {
+		pr_err("Difference storage block should be aligned to PAGE_SIZE\n");
+		return -EINVAL;
+	}
+
+	for (first = find_first_bit(&mask, BITS_PER_LONG);
+	     first < BITS_PER_LONG;
+	     first = find_next_bit(&mask, BITS_PER_LONG, last)) {
+		struct diff_io_cursor cursor = {
+			.buffer_ptr = &diff_buffer,
+			.page_inx = first << (block_shift - PAGE_SHIFT),
+		};
+		sector_t sector = first * block_sectors;
+		sector_t count;
+
+		last = find_next_zero_bit(&mask, BITS_PER_LONG, first);
+		count = (last - first) * block_sectors;
+		if (sector >= diff_region->count)
+			break;
+		if (sector + count > diff_region->count)
+			count = diff_region->count - sector;
+
+		ret = diff_io_add_bios(diff_io, &bio_list_head,
+				       diff_region->bdev,
+				       diff_region->sector + sector, count,
+				       &cursor, is_nowait);
+		if (ret)
+			break;
+	}
+	if (!ret && bio_list_empty(&bio_list_head))
+		ret = -EINVAL;
+
+	return diff_io_submit(diff_io, &bio_list_head, ret);
+}
+
+static void diff_io_clone_endio(struct bio *bio)
+{
+	struct diff_io_clone *clone =
+		container_of(bio, struct diff_io_clone, bio);
+	struct bio *orig_bio = clone->orig_bio;
+
+	orig_bio->bi_status = bio->bi_status;
+	clone->notify_cb(clone->ctx, orig_bio);
+	bio_put(bio);
+
+	bio_endio(orig_bio);
+}
+
+/*
+ * diff_io_clone_submit() - Redirect an I/O unit to the block device.
+ *
+ * The clone shares the data pages with the original I/O unit and addresses
+ * the same sectors. The original I/O unit is completed when the clone is
+ * completed.
+ */
+int diff_io_clone_submit(struct bio *orig_bio, struct block_device *bdev,
+			 void (*notify_cb)(void *ctx, struct bio *orig_bio),
+			 void *ctx)
+{
+	struct bio *bio;
+	struct diff_io_clone *clone;
+
+#ifdef HAVE_BDEV_BIO_ALLOC
+	bio = bio_alloc_clone(bdev, orig_bio, GFP_NOIO, &diff_io_clone_bioset);
+#else
+	bio = bio_clone_fast(orig_bio, GFP_NOIO, &diff_io_clone_bioset);
+#endif
+	if (unlikely(!bio))
+		return -ENOMEM;
+
+#ifndef HAVE_BDEV_BIO_ALLOC
+	bio_set_dev(bio, bdev);
+#endif
+#ifndef STANDALONE_BDEVFILTER
+	bio_set_flag(bio, BIO_FILTERED);
+#endif
+	clone = container_of(bio, struct diff_io_clone, bio);
+	clone->orig_bio = orig_bio;
+	clone->notify_cb = notify_cb;
+	clone->ctx = ctx;
+	bio->bi_end_io = diff_io_clone_endio;
+
+	submit_bio_noacct(bio);
+	return 0;
 }
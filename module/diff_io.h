@@ -2,8 +2,10 @@
 #ifndef __BLK_SNAP_DIFF_IO_H
 #define __BLK_SNAP_DIFF_IO_H
 
+#include <linux/blk_types.h>
 #include <linux/workqueue.h>
 #include <linux/completion.h>
+#include <linux/ktime.h>
 
 struct diff_buffer;
 
@@ -66,6 +68,9 @@ struct diff_io_async {
  *	Indicates that a write operation is being performed.
  * @is_sync_io:
  *	Indicates that the operation is being performed synchronously.
+ * @start_time:
+ *	The time when the I/O units were submitted. Allows to account the
+ *	completion latency of asynchronous requests.
  * @notify:
  *	This union may contain the diff_io_sync or diff_io_async structure
  *	for synchronous or asynchronous request.
@@ -79,21 +84,59 @@ struct diff_io {
 	atomic_t bio_count;
 	bool is_write;
 	bool is_sync_io;
+	ktime_t start_time;
 	union {
 		struct diff_io_sync sync;
 		struct diff_io_async async;
 	} notify;
 };
 
+/**
+ * struct diff_io_clone - Structure for redirecting an I/O unit.
+ * @orig_bio:
+ *	The I/O unit that is completed when the clone is completed.
+ * @notify_cb:
+ *	A pointer to the callback function that will be executed when
+ *	the clone is completed, but before the original I/O unit is completed.
+ *	It is called in the interrupt context.
+ * @ctx:
+ *	The context for the callback function &notify_cb.
+ * @bio:
+ *	The clone of the original I/O unit. Must be the last member.
+ *
+ * Allows to redirect an I/O unit to another block device without copying
+ * its data.
+ */
+struct diff_io_clone {
+	struct bio *orig_bio;
+	void (*notify_cb)(void *ctx, struct bio *orig_bio);
+	void *ctx;
+	struct bio bio;
+};
+
+/*
+ * The workqueue for the completion of asynchronous requests and for
+ * releasing the chunk caches. The copy-on-write algorithm waits for them,
+ * so they should not wait behind the work of other subsystems.
+ */
+extern struct workqueue_struct *diff_io_wq;
+
+/*
+ * The number of buckets in the histogram of the completion latency of
+ * asynchronous requests. The bucket N counts the requests that were
+ * completed in 2^N to 2^(N+1) microseconds. The last bucket counts all
+ * slower requests.
+ */
+#define DIFF_IO_LATENCY_BUCKETS 24
+
 int diff_io_init(void);
 void diff_io_done(void);
+void diff_io_latency_get(u64 *read, u64 *write, bool is_reset);
 
-static inline void diff_io_free(struct diff_io *diff_io)
-{
-	kfree(diff_io);
-	if (diff_io)
-		memory_object_dec(memory_object_diff_io);
-}
+void diff_io_free(struct diff_io *diff_io);
+
+struct diff_region *diff_region_new(gfp_t gfp_mask);
+void diff_region_free(struct diff_region *diff_region);
 
 struct diff_io *diff_io_new_sync(bool is_write);
 static inline struct diff_io *diff_io_new_sync_read(void)
@@ -118,6 +161,33 @@ diff_io_new_async_write(void (*notify_cb)(void *ctx), void *ctx, bool is_nowait)
 	return diff_io_new_async(true, is_nowait, notify_cb, ctx);
 };
 
-int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
-	       struct diff_buffer *diff_buffer, const bool is_nowait);
+int diff_io_do_regions(struct diff_io *diff_io, struct diff_region *regions,
+		       unsigned int region_count,
+		       struct diff_buffer **diff_buffers,
+		       unsigned int buffer_count, const bool is_nowait);
+static inline int diff_io_do_batch(struct diff_io *diff_io,
+				   struct diff_region *diff_region,
+				   struct diff_buffer **diff_buffers,
+				   unsigned int buffer_count,
+				   const bool is_nowait)
+{
+	return diff_io_do_regions(diff_io, diff_region, 1, diff_buffers,
+				  buffer_count, is_nowait);
+}
+static inline int diff_io_do(struct diff_io *diff_io,
+			     struct diff_region *diff_region,
+			     struct diff_buffer *diff_buffer,
+			     const bool is_nowait)
+{
+	return diff_io_do_batch(diff_io, diff_region, &diff_buffer, 1,
+				is_nowait);
+}
+
+int diff_io_do_blocks(struct diff_io *diff_io, struct diff_region *diff_region,
+		      struct diff_buffer *diff_buffer, unsigned long mask,
+		      unsigned int block_shift, const bool is_nowait);
+
+int diff_io_clone_submit(struct bio *orig_bio, struct block_device *bdev,
+			 void (*notify_cb)(void *ctx, struct bio *orig_bio),
+			 void *ctx);
 #endif /* __BLK_SNAP_DIFF_IO_H */
@@ -4,6 +4,7 @@
 #include <linux/slab.h>
 #include <linux/sched/mm.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/spinlock.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
@@ -18,11 +19,24 @@
 #include "log.h"
 
 extern int diff_storage_minimum;
+extern int diff_storage_flush_interval;
 
 #ifndef PAGE_SECTORS
 #define PAGE_SECTORS	(1 << (PAGE_SHIFT - SECTOR_SHIFT))
 #endif
 
+/*
+ * The interval for calculating the fill rate of the difference storage.
+ */
+#define DIFF_STORAGE_RATE_INTERVAL (HZ / 10)
+
+/*
+ * If the difference storage is filled quickly, the low free space event is
+ * generated early enough for user space to append the next portion in this
+ * number of seconds.
+ */
+#define DIFF_STORAGE_LOW_SPACE_SECONDS 2
+
 /**
  * struct storage_bdev - Information about the opened block device.
  *
@@ -32,49 +46,211 @@ extern int diff_storage_minimum;
  *	ID of the block device.
  * @bdev:
  *	A pointer to an open block device.
+ * @free_extents:
+ *	The tree of free extents of the block device sorted by the first
+ *	sector.
+ * @appended_extents:
+ *	The tree of all ranges appended to the difference storage on the block
+ *	device, both free and already allocated. It allows to reject a range
+ *	that overlaps the space already given to the difference storage.
+ * @cursor:
+ *	The free extent from which the regions are allocated. The allocation
+ *	continues from it while it has enough space, so that the regions on
+ *	the block device are located sequentially.
  */
 struct storage_bdev {
 	struct list_head link;
 	dev_t dev_id;
 	struct block_device *bdev;
+	struct rb_root free_extents;
+	struct rb_root appended_extents;
+	struct storage_extent *cursor;
 };
 
 /**
- * struct storage_block - A storage unit reserved for storing differences.
+ * struct storage_extent - A range of the difference storage.
  *
- * @link:
- *	Allows to combine structures into a linked list.
- * @bdev:
- *	A pointer to a block device.
+ * @node:
+ *	The node of the tree of extents of the block device.
  * @sector:
- *	The number of the first sector of the range of allocated space for
- *	storing the difference.
+ *	The number of the first sector.
  * @count:
- *	The count of sectors in the range of allocated space for storing the
- *	difference.
- * @used:
- *	The count of used sectors in the range of allocated space for storing
- *	the difference.
+ *	The count of sectors.
+ * @is_wasted:
+ *	The free extent was too small for a region and is counted as wasted
+ *	space of the difference storage.
+ *
+ * The ranges appended by the user space are merged with the adjacent
+ * extents of both trees of the block device. The regions are allocated from
+ * the beginning of a free extent, and the exhausted free extent is removed
+ * from the tree.
  */
-struct storage_block {
-	struct list_head link;
-	struct block_device *bdev;
+struct storage_extent {
+	struct rb_node node;
 	sector_t sector;
 	sector_t count;
-	sector_t used;
+	bool is_wasted;
 };
 
+/*
+ * The free extent that was too small for a region is not counted as free
+ * space when the low free space event is generated. Must be called under
+ * the lock of the difference storage.
+ */
+static inline void storage_extent_waste(struct diff_storage *diff_storage,
+					struct storage_extent *extent)
+{
+	if (extent->is_wasted)
+		return;
+	extent->is_wasted = true;
+	diff_storage->wasted += extent->count;
+}
+
+/*
+ * The wasted extent becomes free space again before it is resized. Must be
+ * called under the lock of the difference storage.
+ */
+static inline void storage_extent_reuse(struct diff_storage *diff_storage,
+					struct storage_extent *extent)
+{
+	if (!extent->is_wasted)
+		return;
+	extent->is_wasted = false;
+	diff_storage->wasted -= extent->count;
+}
+
+static inline struct storage_extent *storage_extent_new(sector_t sector,
+							 sector_t count)
+{
+	struct storage_extent *extent;
+
+	extent = kzalloc(sizeof(struct storage_extent), GFP_KERNEL);
+	if (!extent)
+		return NULL;
+	memory_object_inc(memory_object_storage_extent);
+
+	RB_CLEAR_NODE(&extent->node);
+	extent->sector = sector;
+	extent->count = count;
+	return extent;
+}
+
+static inline void storage_extent_free(struct storage_extent *extent)
+{
+	kfree(extent);
+	memory_object_dec(memory_object_storage_extent);
+}
+
+static inline void storage_extent_tree_free(struct rb_root *root)
+{
+	struct storage_extent *extent;
+	struct storage_extent *tmp;
+
+	rbtree_postorder_for_each_entry_safe(extent, tmp, root, node)
+		storage_extent_free(extent);
+}
+
 static inline void diff_storage_event_low(struct diff_storage *diff_storage)
 {
 	struct blk_snap_event_low_free_space data = {
 		.requested_nr_sect = diff_storage_minimum,
 	};
+	sector_t requested;
 
+	spin_lock(&diff_storage->lock);
+	data.capacity_nr_sect = diff_storage->capacity;
+	data.filled_nr_sect = diff_storage->filled;
+	data.fill_rate = diff_storage->fill_rate;
 	diff_storage->requested += data.requested_nr_sect;
+	requested = diff_storage->requested;
+	spin_unlock(&diff_storage->lock);
+
 	pr_debug("Diff storage low free space. Portion: %llu sectors, requested: %llu\n",
-		data.requested_nr_sect, diff_storage->requested);
-	event_gen(&diff_storage->event_queue, GFP_NOIO,
-		  blk_snap_event_code_low_free_space, &data, sizeof(data));
+		data.requested_nr_sect, requested);
+	event_gen(&diff_storage->event_queue, blk_snap_event_code_low_free_space,
+		  &data, sizeof(data));
+}
+
+static int diff_storage_flush_bdev(struct block_device *bdev)
+{
+	int ret;
+	struct bio *bio;
+
+#ifdef HAVE_BDEV_BIO_ALLOC
+	bio = bio_alloc(bdev, 0, REQ_OP_WRITE | REQ_PREFLUSH, GFP_NOIO);
+#else
+	bio = bio_alloc(GFP_NOIO, 0);
+	bio_set_dev(bio, bdev);
+	bio->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH;
+#endif
+#ifndef STANDALONE_BDEVFILTER
+	bio_set_flag(bio, BIO_FILTERED);
+#endif
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+
+	return ret;
+}
+
+/*
+ * Flushes the write cache of all block devices of the difference storage.
+ * Storage block devices are only added to the list while the difference
+ * storage exists, so the lock is released while waiting for the flush.
+ */
+static void diff_storage_flush(struct diff_storage *diff_storage)
+{
+	int ret;
+	struct storage_bdev *storage_bdev;
+
+	if (!test_and_clear_bit(0, &diff_storage->flush_pending))
+		return;
+
+	spin_lock(&diff_storage->lock);
+	storage_bdev = list_first_entry_or_null(&diff_storage->storage_bdevs,
+						struct storage_bdev, link);
+	spin_unlock(&diff_storage->lock);
+
+	while (storage_bdev) {
+		ret = diff_storage_flush_bdev(storage_bdev->bdev);
+		if (ret)
+			pr_err("Failed to flush difference storage [%u:%u]. errno=%d\n",
+			       MAJOR(storage_bdev->dev_id),
+			       MINOR(storage_bdev->dev_id), abs(ret));
+
+		spin_lock(&diff_storage->lock);
+		if (list_is_last(&storage_bdev->link,
+				 &diff_storage->storage_bdevs))
+			storage_bdev = NULL;
+		else
+			storage_bdev = list_next_entry(storage_bdev, link);
+		spin_unlock(&diff_storage->lock);
+	}
+}
+
+static void diff_storage_flush_work(struct work_struct *work)
+{
+	struct diff_storage *diff_storage =
+		container_of(to_delayed_work(work), struct diff_storage,
+			     flush_work);
+	unsigned int current_flag;
+
+	current_flag = memalloc_noio_save();
+	diff_storage_flush(diff_storage);
+	memalloc_noio_restore(current_flag);
+}
+
+/*
+ * Called when writing to the difference storage is completed. If the FUA flag
+ * is not used, flushing of the write cache is scheduled.
+ */
+void diff_storage_written(struct diff_storage *diff_storage)
+{
+	if (diff_storage_flush_interval <= 0)
+		return;
+
+	if (!test_and_set_bit(0, &diff_storage->flush_pending))
+		queue_delayed_work(system_wq, &diff_storage->flush_work,
+			msecs_to_jiffies(diff_storage_flush_interval));
 }
 
 struct diff_storage *diff_storage_new(void)
@@ -89,8 +265,11 @@ struct diff_storage *diff_storage_new(void)
 	kref_init(&diff_storage->kref);
 	spin_lock_init(&diff_storage->lock);
 	INIT_LIST_HEAD(&diff_storage->storage_bdevs);
-	INIT_LIST_HEAD(&diff_storage->empty_blocks);
-	INIT_LIST_HEAD(&diff_storage->filled_blocks);
+	diff_storage->cursor_bdev = NULL;
+	diff_storage->policy = diff_storage_policy_linear;
+	diff_storage->flush_pending = 0;
+	diff_storage->rate_time = jiffies;
+	INIT_DELAYED_WORK(&diff_storage->flush_work, diff_storage_flush_work);
 
 	event_queue_init(&diff_storage->event_queue);
 	diff_storage_event_low(diff_storage);
@@ -98,20 +277,6 @@ struct diff_storage *diff_storage_new(void)
 	return diff_storage;
 }
 
-static inline struct storage_block *
-first_empty_storage_block(struct diff_storage *diff_storage)
-{
-	return list_first_entry_or_null(&diff_storage->empty_blocks,
-					struct storage_block, link);
-};
-
-static inline struct storage_block *
-first_filled_storage_block(struct diff_storage *diff_storage)
-{
-	return list_first_entry_or_null(&diff_storage->filled_blocks,
-					struct storage_block, link);
-};
-
 static inline struct storage_bdev *
 first_storage_bdev(struct diff_storage *diff_storage)
 {
@@ -123,22 +288,18 @@ void diff_storage_free(struct kref *kref)
 {
 	struct diff_storage *diff_storage =
 		container_of(kref, struct diff_storage, kref);
-	struct storage_block *blk;
 	struct storage_bdev *storage_bdev;
 
-	while ((blk = first_empty_storage_block(diff_storage))) {
-		list_del(&blk->link);
-		kfree(blk);
-		memory_object_dec(memory_object_storage_block);
-	}
-
-	while ((blk = first_filled_storage_block(diff_storage))) {
-		list_del(&blk->link);
-		kfree(blk);
-		memory_object_dec(memory_object_storage_block);
-	}
+	/*
+	 * Releasing the difference storage is a consistency point. All data
+	 * written to it must reach the storage block devices.
+	 */
+	cancel_delayed_work_sync(&diff_storage->flush_work);
+	diff_storage_flush(diff_storage);
 
 	while ((storage_bdev = first_storage_bdev(diff_storage))) {
+		storage_extent_tree_free(&storage_bdev->free_extents);
+		storage_extent_tree_free(&storage_bdev->appended_extents);
 		blkdev_put(storage_bdev->bdev, FMODE_READ | FMODE_WRITE);
 		list_del(&storage_bdev->link);
 		kfree(storage_bdev);
@@ -150,25 +311,25 @@ void diff_storage_free(struct kref *kref)
 	memory_object_dec(memory_object_diff_storage);
 }
 
-static struct block_device *
+static struct storage_bdev *
 diff_storage_bdev_by_id(struct diff_storage *diff_storage, dev_t dev_id)
 {
-	struct block_device *bdev = NULL;
+	struct storage_bdev *found = NULL;
 	struct storage_bdev *storage_bdev;
 
 	spin_lock(&diff_storage->lock);
 	list_for_each_entry(storage_bdev, &diff_storage->storage_bdevs, link) {
 		if (storage_bdev->dev_id == dev_id) {
-			bdev = storage_bdev->bdev;
+			found = storage_bdev;
 			break;
 		}
 	}
 	spin_unlock(&diff_storage->lock);
 
-	return bdev;
+	return found;
 }
 
-static inline struct block_device *
+static inline struct storage_bdev *
 diff_storage_add_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
 {
 	struct block_device *bdev;
@@ -178,7 +339,7 @@ diff_storage_add_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
 	if (IS_ERR(bdev)) {
 		pr_err("Failed to open device. errno=%d\n",
 		       abs((int)PTR_ERR(bdev)));
-		return bdev;
+		return ERR_CAST(bdev);
 	}
 
 	storage_bdev = kzalloc(sizeof(struct storage_bdev), GFP_KERNEL);
@@ -190,41 +351,127 @@ diff_storage_add_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
 
 	storage_bdev->bdev = bdev;
 	storage_bdev->dev_id = dev_id;
+	storage_bdev->free_extents = RB_ROOT;
+	storage_bdev->appended_extents = RB_ROOT;
+	storage_bdev->cursor = NULL;
 	INIT_LIST_HEAD(&storage_bdev->link);
 
 	spin_lock(&diff_storage->lock);
 	list_add_tail(&storage_bdev->link, &diff_storage->storage_bdevs);
 	spin_unlock(&diff_storage->lock);
 
-	return bdev;
+	return storage_bdev;
+}
+
+/*
+ * Inserts the extent into the tree of the block device. If the extent is
+ * adjacent to the extents in the tree, they are merged, and the merged
+ * extents are released. The extent that overlaps the extents in the tree is
+ * rejected. Must be called under the lock of the difference storage.
+ */
+static int storage_extent_insert(struct diff_storage *diff_storage,
+				 struct rb_root *root,
+				 struct storage_extent *extent,
+				 struct storage_extent **pcursor)
+{
+	struct rb_node **link = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct storage_extent *prev = NULL;
+	struct storage_extent *next = NULL;
+
+	while (*link) {
+		struct storage_extent *entry =
+			rb_entry(*link, struct storage_extent, node);
+
+		parent = *link;
+		if (extent->sector < entry->sector) {
+			next = entry;
+			link = &parent->rb_left;
+		} else {
+			prev = entry;
+			link = &parent->rb_right;
+		}
+	}
+
+	if ((prev && (prev->sector + prev->count > extent->sector)) ||
+	    (next && (extent->sector + extent->count > next->sector)))
+		return -EINVAL;
+
+	if (prev && (prev->sector + prev->count == extent->sector)) {
+		storage_extent_reuse(diff_storage, prev);
+		prev->count += extent->count;
+		storage_extent_free(extent);
+
+		if (next && (prev->sector + prev->count == next->sector)) {
+			storage_extent_reuse(diff_storage, next);
+			prev->count += next->count;
+			rb_erase(&next->node, root);
+			if (pcursor && (*pcursor == next))
+				*pcursor = prev;
+			storage_extent_free(next);
+		}
+		return 0;
+	}
+
+	if (next && (extent->sector + extent->count == next->sector)) {
+		storage_extent_reuse(diff_storage, next);
+		next->sector = extent->sector;
+		next->count += extent->count;
+		storage_extent_free(extent);
+		return 0;
+	}
+
+	rb_link_node(&extent->node, parent, link);
+	rb_insert_color(&extent->node, root);
+	return 0;
 }
 
 static inline int diff_storage_add_range(struct diff_storage *diff_storage,
-					 struct block_device *bdev,
+					 struct storage_bdev *storage_bdev,
 					 sector_t sector, sector_t count)
 {
-	struct storage_block *storage_block;
+	int ret;
+	struct storage_extent *extent;
+	struct storage_extent *appended;
 
 	pr_debug("Add range to diff storage: [%u:%u] %llu:%llu\n",
-		 MAJOR(bdev->bd_dev), MINOR(bdev->bd_dev), sector, count);
+		 MAJOR(storage_bdev->dev_id), MINOR(storage_bdev->dev_id),
+		 sector, count);
 
-	storage_block = kzalloc(sizeof(struct storage_block), GFP_KERNEL);
-	if (!storage_block)
-		return -ENOMEM;
-	memory_object_inc(memory_object_storage_block);
+	if (!count)
+		return 0;
 
-	INIT_LIST_HEAD(&storage_block->link);
-	storage_block->bdev = bdev;
-	storage_block->sector = sector;
-	storage_block->count = count;
+	extent = storage_extent_new(sector, count);
+	if (!extent)
+		return -ENOMEM;
+	appended = storage_extent_new(sector, count);
+	if (!appended) {
+		storage_extent_free(extent);
+		return -ENOMEM;
+	}
 
 	spin_lock(&diff_storage->lock);
-	list_add_tail(&storage_block->link, &diff_storage->empty_blocks);
-
-	diff_storage->capacity += count;
+	ret = storage_extent_insert(diff_storage,
+				    &storage_bdev->appended_extents, appended,
+				    NULL);
+	if (!ret) {
+		/*
+		 * The free extents are a subset of the appended ones, so
+		 * the range cannot overlap them.
+		 */
+		storage_extent_insert(diff_storage, &storage_bdev->free_extents,
+				      extent, &storage_bdev->cursor);
+		diff_storage->capacity += count;
+	}
 	spin_unlock(&diff_storage->lock);
 
-	return 0;
+	if (ret) {
+		pr_err("The range %llu:%llu overlaps the difference storage\n",
+		       sector, count);
+		storage_extent_free(appended);
+		storage_extent_free(extent);
+	}
+	return ret;
 }
 
 int diff_storage_append_block(struct diff_storage *diff_storage, dev_t dev_id,
@@ -233,105 +480,268 @@ int diff_storage_append_block(struct diff_storage *diff_storage, dev_t dev_id,
 {
 	int ret;
 	int inx;
-	struct block_device *bdev;
+	struct storage_bdev *storage_bdev;
 	struct blk_snap_block_range range;
 	const unsigned long range_size = sizeof(struct blk_snap_block_range);
+	bool is_enough;
 
 	pr_debug("Append %u blocks\n", range_count);
 
-	bdev = diff_storage_bdev_by_id(diff_storage, dev_id);
-	if (!bdev) {
-		bdev = diff_storage_add_storage_bdev(diff_storage, dev_id);
-		if (IS_ERR(bdev))
-			return PTR_ERR(bdev);
+	storage_bdev = diff_storage_bdev_by_id(diff_storage, dev_id);
+	if (!storage_bdev) {
+		storage_bdev = diff_storage_add_storage_bdev(diff_storage,
+							     dev_id);
+		if (IS_ERR(storage_bdev))
+			return PTR_ERR(storage_bdev);
 	}
 
 	for (inx = 0; inx < range_count; inx++) {
 		if (unlikely(copy_from_user(&range, ranges+inx, range_size)))
 			return -EINVAL;
 
-		ret = diff_storage_add_range(diff_storage, bdev,
+		ret = diff_storage_add_range(diff_storage, storage_bdev,
 					     range.sector_offset,
 					     range.sector_count);
 		if (unlikely(ret))
 			return ret;
 	}
 
-	if (atomic_read(&diff_storage->low_space_flag) &&
-	    (diff_storage->capacity >= diff_storage->requested))
+	/*
+	 * User space can append more than requested to get ahead of the
+	 * filling of the difference storage.
+	 */
+	spin_lock(&diff_storage->lock);
+	if (diff_storage->capacity > diff_storage->requested)
+		diff_storage->requested = diff_storage->capacity;
+	is_enough = (diff_storage->capacity >= diff_storage->requested);
+	spin_unlock(&diff_storage->lock);
+
+	if (is_enough && atomic_read(&diff_storage->low_space_flag))
 		atomic_set(&diff_storage->low_space_flag, 0);
 
 	return 0;
 }
 
-static inline bool is_halffull(const sector_t sectors_left)
+static inline bool is_halffull(const sector_t sectors_left,
+			       const sector_t fill_rate)
 {
-	return sectors_left <= ((diff_storage_minimum >> 1) & ~(PAGE_SECTORS - 1));
+	sector_t threshold = (diff_storage_minimum >> 1) & ~(PAGE_SECTORS - 1);
+
+	return (sectors_left <= threshold) ||
+	       (sectors_left <= fill_rate * DIFF_STORAGE_LOW_SPACE_SECONDS);
 }
 
-struct diff_region *diff_storage_new_region(struct diff_storage *diff_storage,
-					   sector_t count)
+/*
+ * Calculates the average fill rate. Must be called under the lock of the
+ * difference storage.
+ */
+static inline void diff_storage_update_rate(struct diff_storage *diff_storage)
+{
+	unsigned long elapsed = jiffies - diff_storage->rate_time;
+	sector_t rate;
+
+	if (elapsed < DIFF_STORAGE_RATE_INTERVAL)
+		return;
+
+	rate = div_u64((u64)(diff_storage->filled - diff_storage->rate_filled) *
+			       HZ, elapsed);
+	/* The exponential moving average with the weight 1/4 */
+	diff_storage->fill_rate = (diff_storage->fill_rate * 3 + rate) >> 2;
+
+	diff_storage->rate_time = jiffies;
+	diff_storage->rate_filled = diff_storage->filled;
+}
+
+static inline struct storage_bdev *
+next_storage_bdev(struct diff_storage *diff_storage,
+		  struct storage_bdev *storage_bdev)
+{
+	if (list_is_last(&storage_bdev->link, &diff_storage->storage_bdevs))
+		return first_storage_bdev(diff_storage);
+	return list_next_entry(storage_bdev, link);
+}
+
+/*
+ * Finds the free extent of the block device that has enough space for the
+ * region and makes it the cursor. The search starts from the cursor, so the
+ * regions are allocated sequentially, and the tails of the extents that were
+ * too small for a chunk remain available for smaller regions. Until then,
+ * they are counted as wasted, unless the region is only tried.
+ */
+static struct storage_extent *
+storage_bdev_find_extent(struct diff_storage *diff_storage,
+			 struct storage_bdev *storage_bdev, sector_t count,
+			 const bool is_try)
+{
+	struct storage_extent *cursor = storage_bdev->cursor;
+	struct storage_extent *extent;
+	struct rb_node *node;
+
+	if (likely(cursor && (cursor->count >= count)))
+		return cursor;
+	if (cursor && !is_try)
+		storage_extent_waste(diff_storage, cursor);
+
+	node = cursor ? rb_next(&cursor->node) :
+			rb_first(&storage_bdev->free_extents);
+	for (; node; node = rb_next(node)) {
+		extent = rb_entry(node, struct storage_extent, node);
+		if (extent->count >= count)
+			goto found;
+		if (!is_try)
+			storage_extent_waste(diff_storage, extent);
+	}
+	if (!cursor)
+		return NULL;
+
+	for (node = rb_first(&storage_bdev->free_extents); node != &cursor->node;
+	     node = rb_next(node)) {
+		extent = rb_entry(node, struct storage_extent, node);
+		if (extent->count >= count)
+			goto found;
+		if (!is_try)
+			storage_extent_waste(diff_storage, extent);
+	}
+	return NULL;
+found:
+	storage_bdev->cursor = extent;
+	return extent;
+}
+
+/*
+ * Selects the block device for the region according to the placement policy.
+ * With the linear policy, the regions are allocated on the same block device
+ * while it has free space. With the round-robin policy, each next region is
+ * allocated on the next block device, so the copy-on-write writes are spread
+ * over all of them. Must be called under the lock of the difference storage.
+ */
+static struct storage_extent *
+diff_storage_find_extent(struct diff_storage *diff_storage, sector_t count,
+			 const bool is_try, struct storage_bdev **pstorage_bdev)
+{
+	struct storage_bdev *start_bdev;
+	struct storage_bdev *storage_bdev;
+	struct storage_extent *extent;
+
+	start_bdev = diff_storage->cursor_bdev;
+	if (!start_bdev)
+		start_bdev = first_storage_bdev(diff_storage);
+	else if (diff_storage->policy == diff_storage_policy_round_robin)
+		start_bdev = next_storage_bdev(diff_storage, start_bdev);
+	if (!start_bdev)
+		return NULL;
+
+	storage_bdev = start_bdev;
+	do {
+		extent = storage_bdev_find_extent(diff_storage, storage_bdev,
+						  count, is_try);
+		if (extent) {
+			diff_storage->cursor_bdev = storage_bdev;
+			*pstorage_bdev = storage_bdev;
+			return extent;
+		}
+		storage_bdev = next_storage_bdev(diff_storage, storage_bdev);
+	} while (storage_bdev != start_bdev);
+
+	return NULL;
+}
+
+static struct diff_region *
+__diff_storage_new_region(struct diff_storage *diff_storage, sector_t count,
+			  const bool is_try)
 {
 	int ret = 0;
 	struct diff_region *diff_region;
+	struct storage_extent *extent;
+	struct storage_bdev *storage_bdev;
 	sector_t sectors_left;
+	sector_t fill_rate;
 
 	if (atomic_read(&diff_storage->overflow_flag))
 		return ERR_PTR(-ENOSPC);
 
-	diff_region = kzalloc(sizeof(struct diff_region), GFP_NOIO);
+	diff_region = diff_region_new(GFP_NOIO);
 	if (!diff_region)
 		return ERR_PTR(-ENOMEM);
-	memory_object_inc(memory_object_diff_region);
 
 	spin_lock(&diff_storage->lock);
-	do {
-		struct storage_block *storage_block;
-		sector_t available;
-
-		storage_block = first_empty_storage_block(diff_storage);
-		if (unlikely(!storage_block)) {
-			atomic_inc(&diff_storage->overflow_flag);
-			ret = -ENOSPC;
-			break;
+	extent = diff_storage_find_extent(diff_storage, count, is_try,
+					  &storage_bdev);
+	if (likely(extent)) {
+		storage_extent_reuse(diff_storage, extent);
+		diff_region->bdev = storage_bdev->bdev;
+		diff_region->sector = extent->sector;
+		diff_region->count = count;
+
+		extent->sector += count;
+		extent->count -= count;
+		if (!extent->count) {
+			struct rb_node *next = rb_next(&extent->node);
+
+			rb_erase(&extent->node, &storage_bdev->free_extents);
+			storage_bdev->cursor =
+				rb_entry_safe(next, struct storage_extent, node);
+			storage_extent_free(extent);
 		}
-
-		available = storage_block->count - storage_block->used;
-		if (likely(available >= count)) {
-			diff_region->bdev = storage_block->bdev;
-			diff_region->sector =
-				storage_block->sector + storage_block->used;
-			diff_region->count = count;
-
-			storage_block->used += count;
-			diff_storage->filled += count;
-			break;
-		}
-
-		list_del(&storage_block->link);
-		list_add_tail(&storage_block->link,
-			      &diff_storage->filled_blocks);
-		/*
-		 * If there is still free space in the storage block, but
-		 * it is not enough to store a piece, then such a block is
-		 * considered used.
-		 * We believe that the storage blocks are large enough
-		 * to accommodate several pieces entirely.
-		 */
-		diff_storage->filled += available;
-	} while (1);
-	sectors_left = diff_storage->requested - diff_storage->filled;
+		diff_storage->filled += count;
+	} else {
+		if (!is_try)
+			atomic_inc(&diff_storage->overflow_flag);
+		ret = -ENOSPC;
+	}
+	diff_storage_update_rate(diff_storage);
+	/*
+	 * The wasted tails of the extents cannot hold a chunk, so they are not
+	 * counted as free space.
+	 */
+	sectors_left = diff_storage->requested - diff_storage->filled -
+		       diff_storage->wasted;
+	fill_rate = diff_storage->fill_rate;
 	spin_unlock(&diff_storage->lock);
 
 	if (ret) {
-		pr_err("Cannot get empty storage block\n");
+		if (!is_try)
+			pr_err("Cannot get empty storage block\n");
 		diff_storage_free_region(diff_region);
 		return ERR_PTR(ret);
 	}
 
-	if (is_halffull(sectors_left) &&
+	if (is_halffull(sectors_left, fill_rate) &&
 	    (atomic_inc_return(&diff_storage->low_space_flag) == 1))
 		diff_storage_event_low(diff_storage);
 
 	return diff_region;
 }
+
+struct diff_region *diff_storage_new_region(struct diff_storage *diff_storage,
+					    sector_t count)
+{
+	return __diff_storage_new_region(diff_storage, count, false);
+}
+
+/*
+ * Unlike diff_storage_new_region(), the lack of a free extent of the requested
+ * size does not overflow the difference storage. The caller can retry with
+ * a smaller region.
+ */
+struct diff_region *
+diff_storage_try_new_region(struct diff_storage *diff_storage, sector_t count)
+{
+	return __diff_storage_new_region(diff_storage, count, true);
+}
+
+int diff_storage_set_policy(struct diff_storage *diff_storage, int policy)
+{
+	if ((policy != diff_storage_policy_linear) &&
+	    (policy != diff_storage_policy_round_robin)) {
+		pr_err("Invalid difference storage policy %d\n", policy);
+		return -EINVAL;
+	}
+
+	spin_lock(&diff_storage->lock);
+	WRITE_ONCE(diff_storage->policy, policy);
+	spin_unlock(&diff_storage->lock);
+
+	pr_debug("Difference storage policy %d\n", policy);
+	return 0;
+}
@@ -2,10 +2,27 @@
 #ifndef __BLK_SNAP_DIFF_STORAGE_H
 #define __BLK_SNAP_DIFF_STORAGE_H
 
+#include <linux/workqueue.h>
 #include "event_queue.h"
+#include "diff_io.h"
 
 struct blk_snap_block_range;
 struct diff_region;
+struct storage_bdev;
+struct storage_extent;
+
+/**
+ * enum diff_storage_policy - The placement of the regions on the block devices
+ *	of the difference storage.
+ * @diff_storage_policy_linear:
+ *	The regions are allocated on one block device while it has free space.
+ * @diff_storage_policy_round_robin:
+ *	Each next region is allocated on the next block device.
+ */
+enum diff_storage_policy {
+	diff_storage_policy_linear = 0,
+	diff_storage_policy_round_robin,
+};
 
 /**
  * struct diff_storage - Difference storage.
@@ -13,25 +30,36 @@ struct diff_region;
  * @kref:
  *	The reference counter.
  * @lock:
- *	Spinlock allows to guarantee the safety of linked lists.
+ *	Spinlock allows to guarantee the safety of the list of block devices
+ *	and of the trees of free extents.
  * @storage_bdevs:
  *	List of opened block devices. Blocks for storing snapshot data can be
  *	located on different block devices. So, all opened block devices are
- *	located in this list. Blocks on opened block devices are allocated for
- *	storing the chunks data.
- * @empty_blocks:
- *	List of empty blocks on storage. This list can be updated while
- *	holding a snapshot. This allows us to dynamically increase the
- *	storage size for these snapshots.
- * @filled_blocks:
- *	List of filled blocks. When the blocks from the list of empty blocks are filled,
- *	we move them to the list of filled blocks.
+ *	located in this list. Each of them has a tree of free extents, from
+ *	which the regions for storing the chunks data are allocated.
+ *	The trees can be updated while holding a snapshot. This allows us to
+ *	dynamically increase the storage size for these snapshots.
+ * @cursor_bdev:
+ *	The block device from which the last region was allocated.
+ * @policy:
+ *	The policy of placement of the regions on the block devices. See
+ *	&enum diff_storage_policy.
  * @capacity:
  *	Total amount of available storage space.
  * @filled:
  *	The number of sectors already filled in.
+ * @wasted:
+ *	The number of free sectors in the extents that were too small for
+ *	a region. They are not counted as free space.
  * @requested:
- *	The number of sectors already requested from user space.
+ *	The number of sectors already requested from user space. If user space
+ *	appends more than requested, it is increased to the capacity.
+ * @rate_time:
+ *	The time in jiffies when the fill rate was last calculated.
+ * @rate_filled:
+ *	The number of filled sectors when the fill rate was last calculated.
+ * @fill_rate:
+ *	The average number of sectors filled per second.
  * @low_space_flag:
  *	The flag is set if the number of free regions available in the
  *	difference storage is less than the allowed minimum.
@@ -42,6 +70,12 @@ struct diff_region;
  *	A queue of events to pass events to user space. Diff storage and its
  *	owner can notify its snapshot about events like snapshot overflow,
  *	low free space and snapshot terminated.
+ * @flush_pending:
+ *	The flag is set if there were writes to the difference storage that
+ *	have not been flushed yet.
+ * @flush_work:
+ *	The delayed work that flushes the write cache of the difference
+ *	storage block devices.
  *
  * The difference storage manages the regions of block devices that are used
  * to store the data of the original block devices in the snapshot.
@@ -54,17 +88,25 @@ struct diff_storage {
 	spinlock_t lock;
 
 	struct list_head storage_bdevs;
-	struct list_head empty_blocks;
-	struct list_head filled_blocks;
+	struct storage_bdev *cursor_bdev;
+	int policy;
 
 	sector_t capacity;
 	sector_t filled;
+	sector_t wasted;
 	sector_t requested;
 
+	unsigned long rate_time;
+	sector_t rate_filled;
+	sector_t fill_rate;
+
 	atomic_t low_space_flag;
 	atomic_t overflow_flag;
 
 	struct event_queue event_queue;
+
+	unsigned long flush_pending;
+	struct delayed_work flush_work;
 };
 
 struct diff_storage *diff_storage_new(void);
@@ -85,11 +127,23 @@ int diff_storage_append_block(struct diff_storage *diff_storage, dev_t dev_id,
 			      unsigned int range_count);
 struct diff_region *diff_storage_new_region(struct diff_storage *diff_storage,
 					    sector_t count);
+struct diff_region *
+diff_storage_try_new_region(struct diff_storage *diff_storage, sector_t count);
+void diff_storage_written(struct diff_storage *diff_storage);
+int diff_storage_set_policy(struct diff_storage *diff_storage, int policy);
+
+/*
+ * With the round-robin policy, each chunk needs its own region, so that the
+ * adjacent chunks are stored on different block devices.
+ */
+static inline bool diff_storage_is_striped(struct diff_storage *diff_storage)
+{
+	return READ_ONCE(diff_storage->policy) ==
+	       diff_storage_policy_round_robin;
+}
 
 static inline void diff_storage_free_region(struct diff_region *region)
 {
-	kfree(region);
-	if (region)
-		memory_object_dec(memory_object_diff_region);
+	diff_region_free(region);
 }
 #endif /* __BLK_SNAP_DIFF_STORAGE_H */
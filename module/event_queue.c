@@ -1,89 +1,199 @@
 // SPDX-License-Identifier: GPL-2.0
 #define pr_fmt(fmt) KBUILD_MODNAME "-event_queue: " fmt
 
-#include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/sched.h>
-#include "memory_checker.h"
+#include <linux/eventfd.h>
+#include <linux/jiffies.h>
 #include "event_queue.h"
 #include "log.h"
 
 void event_queue_init(struct event_queue *event_queue)
 {
-	INIT_LIST_HEAD(&event_queue->list);
+	event_queue->head = 0;
+	event_queue->count = 0;
+	event_queue->lost = 0;
 	spin_lock_init(&event_queue->lock);
 	init_waitqueue_head(&event_queue->wq_head);
+	event_queue->eventfd = NULL;
+}
+
+static inline void event_queue_signal(struct event_queue *event_queue)
+{
+	if (!event_queue->eventfd)
+		return;
+#ifdef HAVE_EVENTFD_SIGNAL_COUNT
+	eventfd_signal(event_queue->eventfd, 1);
+#else
+	eventfd_signal(event_queue->eventfd);
+#endif
 }
 
 void event_queue_done(struct event_queue *event_queue)
 {
-	struct event *event;
+	struct eventfd_ctx *eventfd;
 
 	spin_lock(&event_queue->lock);
-	while (!list_empty(&event_queue->list)) {
-		event = list_first_entry(&event_queue->list, struct event,
-					 link);
-		list_del(&event->link);
-		event_free(event);
+	event_queue->count = 0;
+	eventfd = event_queue->eventfd;
+	event_queue->eventfd = NULL;
+	spin_unlock(&event_queue->lock);
+
+	if (eventfd)
+		eventfd_ctx_put(eventfd);
+}
+
+/**
+ * event_queue_set_eventfd() - Attach the eventfd to the queue.
+ * @event_queue:
+ *	Pointer to &struct event_queue.
+ * @fd:
+ *	The file descriptor of the eventfd of the current process. If it is
+ *	negative, the previous eventfd is only detached.
+ *
+ * If the queue already contains events, the eventfd is signaled at once,
+ * so that the events generated before it was attached are not missed.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+int event_queue_set_eventfd(struct event_queue *event_queue, int fd)
+{
+	struct eventfd_ctx *eventfd = NULL;
+	struct eventfd_ctx *prev;
+
+	if (fd >= 0) {
+		eventfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
 	}
+
+	spin_lock(&event_queue->lock);
+	prev = event_queue->eventfd;
+	event_queue->eventfd = eventfd;
+	if (event_queue->count)
+		event_queue_signal(event_queue);
 	spin_unlock(&event_queue->lock);
+
+	if (prev)
+		eventfd_ctx_put(prev);
+	return 0;
 }
 
-int event_gen(struct event_queue *event_queue, gfp_t flags, int code,
-	      const void *data, int data_size)
+/*
+ * The event is stored in the ring of the queue. If the ring is full, the
+ * event is lost. The user space is informed about the number of lost events.
+ */
+int event_gen(struct event_queue *event_queue, int code, const void *data,
+	      int data_size)
 {
 	struct event *event;
+	ktime_t time = ktime_get();
 
-	event = kzalloc(sizeof(struct event) + data_size, flags);
-	if (!event)
-		return -ENOMEM;
-	memory_object_inc(memory_object_event);
+	if (WARN_ON_ONCE(data_size > EVENT_DATA_SIZE_MAX))
+		return -EINVAL;
 
-	event->time = ktime_get();
+	pr_debug("Generate event: time=%lld code=%d data_size=%d\n",
+		 time, code, data_size);
+
+	spin_lock(&event_queue->lock);
+	if (event_queue->count == EVENT_QUEUE_SIZE) {
+		event_queue->lost++;
+		spin_unlock(&event_queue->lock);
+
+		pr_warn("The event queue is full. Event code=%d is lost\n", code);
+		return -ENOSPC;
+	}
+
+	event = &event_queue->ring[(event_queue->head + event_queue->count) %
+				   EVENT_QUEUE_SIZE];
+	event->time = time;
 	event->code = code;
 	event->data_size = data_size;
 	memcpy(event->data, data, data_size);
+	event_queue->count++;
 
-	pr_debug("Generate event: time=%lld code=%d data_size=%d\n",
-		 event->time, event->code, event->data_size);
-
-	spin_lock(&event_queue->lock);
-	list_add_tail(&event->link, &event_queue->list);
+	event_queue_signal(event_queue);
 	spin_unlock(&event_queue->lock);
 
 	wake_up(&event_queue->wq_head);
 	return 0;
 }
 
-struct event *event_wait(struct event_queue *event_queue,
-			 unsigned long timeout_ms)
+/**
+ * event_wait() - Wait for the events and take them from the queue.
+ * @event_queue:
+ *	Pointer to &struct event_queue.
+ * @timeout_ms:
+ *	Timeout for waiting in milliseconds.
+ * @events:
+ *	An array for the received events.
+ * @pcount:
+ *	The size of the array on input and the number of received events on
+ *	output.
+ * @plost:
+ *	If not NULL, receives the number of events that were lost since the
+ *	previous request.
+ *
+ * Return: 0 if at least one event was received, -ENOENT if the timeout
+ *	expired, negative errno otherwise.
+ */
+int event_wait(struct event_queue *event_queue, unsigned long timeout_ms,
+	       struct event *events, unsigned int *pcount, unsigned int *plost)
 {
 	int ret;
+	unsigned int inx;
+	unsigned int count;
 
-	ret = wait_event_interruptible_timeout(event_queue->wq_head,
-					       !list_empty(&event_queue->list),
-					       timeout_ms);
-
-	if (ret > 0) {
-		struct event *event;
-
-		spin_lock(&event_queue->lock);
-		event = list_first_entry(&event_queue->list, struct event,
-					 link);
-		list_del(&event->link);
-		spin_unlock(&event_queue->lock);
+	if (!*pcount)
+		return -EINVAL;
 
-		pr_debug("Event received: time=%lld code=%d\n", event->time,
-			 event->code);
-		return event;
-	}
+	ret = wait_event_interruptible_timeout(event_queue->wq_head,
+					       READ_ONCE(event_queue->count),
+					       msecs_to_jiffies(timeout_ms));
 	if (ret == 0)
-		return ERR_PTR(-ENOENT);
+		return -ENOENT;
 
 	if (ret == -ERESTARTSYS) {
 		pr_debug("event waiting interrupted\n");
-		return ERR_PTR(-EINTR);
+		return -EINTR;
 	}
 
-	pr_err("Failed to wait event. errno=%d\n", abs(ret));
-	return ERR_PTR(ret);
+	if (ret < 0) {
+		pr_err("Failed to wait event. errno=%d\n", abs(ret));
+		return ret;
+	}
+
+	spin_lock(&event_queue->lock);
+	count = min(*pcount, event_queue->count);
+	for (inx = 0; inx < count; inx++) {
+		events[inx] = event_queue->ring[event_queue->head];
+		event_queue->head = (event_queue->head + 1) % EVENT_QUEUE_SIZE;
+	}
+	event_queue->count -= count;
+	if (plost) {
+		*plost = event_queue->lost;
+		event_queue->lost = 0;
+	}
+	spin_unlock(&event_queue->lock);
+
+	pr_debug("Received %u events\n", count);
+	*pcount = count;
+	return 0;
+}
+
+/**
+ * event_lost() - Count the events as lost.
+ * @event_queue:
+ *	Pointer to &struct event_queue.
+ * @count:
+ *	The number of events.
+ *
+ * The events that were taken from the queue by event_wait(), but could not
+ * be delivered to the user space, are reported as lost by the next request.
+ */
+void event_lost(struct event_queue *event_queue, unsigned int count)
+{
+	spin_lock(&event_queue->lock);
+	event_queue->lost += count;
+	spin_unlock(&event_queue->lock);
 }
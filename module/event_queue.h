@@ -4,14 +4,22 @@
 
 #include <linux/types.h>
 #include <linux/ktime.h>
-#include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
 
+struct eventfd_ctx;
+
+/*
+ * The maximum size of the event data.
+ */
+#define EVENT_DATA_SIZE_MAX 48
+/*
+ * The number of events that the queue can hold.
+ */
+#define EVENT_QUEUE_SIZE 64
+
 /**
  * struct event - An event to be passed to the user space.
- * @link:
- *	The list header allows to combine events from the queue.
  * @time:
  *	A timestamp indicates when an event occurred.
  * @code:
@@ -22,44 +30,57 @@
  *	An array of event data.
  *
  * Events can be different, so they contain different data. The size of the
- * data array is not defined exactly, but it has limitations. The size of
- * the event structure may exceed the PAGE_SIZE.
+ * data of each event is limited, so that the events can be stored in the
+ * preallocated ring of the queue.
  */
 struct event {
-	struct list_head link;
 	ktime_t time;
 	int code;
 	int data_size;
-	char data[1]; /* up to PAGE_SIZE - sizeof(struct blk_snap_snapshot_event) */
+	char data[EVENT_DATA_SIZE_MAX];
 };
 
 /**
  * struct event_queue - A queue of &struct event.
- * @list:
- *	Linked list for storing events.
+ * @ring:
+ *	The ring buffer for storing events.
+ * @head:
+ *	The index of the oldest event in the ring.
+ * @count:
+ *	The number of events in the ring.
+ * @lost:
+ *	The number of events that were not stored because the ring was full
+ *	or were taken from the ring but not delivered to the user space.
  * @lock:
- *	Spinlock allows to guarantee safety of the linked list.
+ *	Spinlock allows to guarantee safety of the ring.
  * @wq_head:
  *	A wait queue allows to put a user thread in a waiting state until
- *	an event appears in the linked list.
+ *	an event appears in the ring.
+ * @eventfd:
+ *	The eventfd that is signaled when an event appears in the ring.
+ *	It allows the user space to wait for the events of several queues in
+ *	one thread. Protected by the spinlock.
+ *
+ * The ring is a part of the queue, so the generation of an event does not
+ * need to allocate memory in the I/O processing context.
  */
 struct event_queue {
-	struct list_head list;
+	struct event ring[EVENT_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int count;
+	unsigned int lost;
 	spinlock_t lock;
 	struct wait_queue_head wq_head;
+	struct eventfd_ctx *eventfd;
 };
 
 void event_queue_init(struct event_queue *event_queue);
 void event_queue_done(struct event_queue *event_queue);
+int event_queue_set_eventfd(struct event_queue *event_queue, int fd);
 
-int event_gen(struct event_queue *event_queue, gfp_t flags, int code,
-	      const void *data, int data_size);
-struct event *event_wait(struct event_queue *event_queue,
-			 unsigned long timeout_ms);
-static inline void event_free(struct event *event)
-{
-	kfree(event);
-	if (event)
-		memory_object_dec(memory_object_event);
-};
+int event_gen(struct event_queue *event_queue, int code, const void *data,
+	      int data_size);
+int event_wait(struct event_queue *event_queue, unsigned long timeout_ms,
+	       struct event *events, unsigned int *pcount, unsigned int *plost);
+void event_lost(struct event_queue *event_queue, unsigned int count);
 #endif /* __BLK_SNAP_EVENT_QUEUE_H */
@@ -9,10 +9,13 @@
 #include <uapi/linux/blksnap.h>
 #endif
 #include "memory_checker.h"
+#include "cache_manager.h"
 #include "snapimage.h"
 #include "snapshot.h"
 #include "tracker.h"
 #include "diff_io.h"
+#include "diff_storage.h"
+#include "chunk.h"
 #include "version.h"
 #include "log.h"
 
@@ -58,6 +61,18 @@ static_assert(sizeof(uuid_t) == sizeof(struct blk_snap_uuid),
 #ifdef HAVE_BLK_CLEANUP_DISK
 #pragma message("The function blk_cleanup_disk() was found.")
 #endif
+#ifdef HAVE_BDEV_NONROT
+#pragma message("The function bdev_nonrot() was found.")
+#endif
+#ifdef HAVE_SHRINKER_ALLOC
+#pragma message("The function shrinker_alloc() was found.")
+#endif
+#ifdef HAVE_REGISTER_SHRINKER_NAME
+#pragma message("The function register_shrinker() has a name.")
+#endif
+#ifdef HAVE_EVENTFD_SIGNAL_COUNT
+#pragma message("The function eventfd_signal() has a counter.")
+#endif
 
 /*
  * The power of 2 for minimum tracking block size.
@@ -88,6 +103,23 @@ int tracking_block_maximum_count = 2097152;
  */
 int chunk_minimum_shift = 18;
 
+/*
+ * The power of 2 for minimum chunk size for non-rotational devices.
+ * Random access to such devices is cheap, so the chunk can be smaller. This
+ * reduces the amount of data copied to the difference storage when small
+ * random writes are performed, for example, by databases.
+ */
+int chunk_minimum_shift_nonrot = 14;
+
+/*
+ * The power of 2 for sub-block size.
+ * When a small part of a chunk is overwritten, only the sub-blocks that are
+ * overwritten are copied to the difference storage instead of the whole
+ * chunk. The sub-block is increased if there are too many sub-blocks in the
+ * chunk. Zero means that chunks are always copied entirely.
+ */
+int chunk_subblock_shift = 14;
+
 /*
  * The maximum number of chunks.
  * To store information about the state of all the chunks, a table is created
@@ -99,14 +131,40 @@ int chunk_minimum_shift = 18;
 int chunk_maximum_count = 2097152;
 
 /*
- * The maximum number of chunks in memory cache.
+ * The limit of memory for the chunk cache of all snapshots in MiB.
  * Since reading and writing to snapshots is performed in large chunks,
  * a cache is implemented to optimize reading small portions of data
- * from the snapshot image. As the number of chunks in the cache
- * increases, memory consumption also increases.
- * The minimum recommended value is four.
+ * from the snapshot image. The memory is shared between all block devices
+ * of the snapshots. A busy device can use the memory not used by others,
+ * but when the limit is exceeded, each device keeps only its fair share.
+ */
+int chunk_cache_memory_limit = 256;
+
+/*
+ * Deprecated. The maximum number of chunks in memory cache of each block
+ * device. It is replaced by the chunk_cache_memory_limit. The parameter is
+ * accepted so that the existing configurations of the module still load,
+ * but its value is ignored.
  */
-int chunk_maximum_in_cache = 32;
+static int chunk_maximum_in_cache;
+
+/*
+ * The maximum number of chunks that are loaded in advance when reading the
+ * snapshot image.
+ * All chunks covered by the I/O unit are loaded simultaneously. If sequential
+ * reading is detected, the loading of several following chunks is started
+ * too. The readahead window grows twice with each sequential I/O unit up to
+ * this value and is reset on random access. The value should be less than
+ * the maximum number of chunks in the prefetch cache.
+ */
+int chunk_readahead_count = 16;
+
+/*
+ * The maximum number of chunks in the prefetch cache.
+ * Chunks loaded in advance are kept in their own queue until they are read,
+ * so they do not evict the frequently used chunks from the read cache.
+ */
+int chunk_maximum_in_prefetch = 32;
 
 /*
  * The size of the pool of preallocated difference buffers.
@@ -125,6 +183,17 @@ int free_diff_buffer_pool_size = 128;
  */
 int diff_storage_minimum = 2097152;
 
+/*
+ * The interval in milliseconds for flushing the difference storage.
+ * If the value is zero, each chunk is written to the difference storage with
+ * the FUA flag. Otherwise, chunks are written without the FUA flag, and the
+ * write cache of the difference storage block devices is flushed with the
+ * specified interval after the writes, as well as when the difference storage
+ * is released. This significantly increases the write speed on devices
+ * with a volatile write cache.
+ */
+int diff_storage_flush_interval;
+
 #ifdef STANDALONE_BDEVFILTER
 static const struct blk_snap_version version = {
 	.major = VERSION_MAJOR,
@@ -284,43 +353,33 @@ static int ioctl_tracker_mark_dirty_blocks(unsigned long arg)
 	return ret;
 }
 
-static int ioctl_snapshot_create(unsigned long arg)
+static int do_snapshot_create(__u32 count, struct blk_snap_dev *user_dev_ids,
+			      unsigned int chunk_shift, struct blk_snap_uuid *id)
 {
 	int ret;
-	struct blk_snap_snapshot_create karg;
 	struct blk_snap_dev *dev_id_array = NULL;
 	uuid_t new_id;
 
-	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
-		pr_err("Unable to create snapshot: invalid user buffer\n");
-		return -ENODATA;
-	}
-
-	dev_id_array =
-		kcalloc(karg.count, sizeof(struct blk_snap_dev), GFP_KERNEL);
+	dev_id_array = kcalloc(count, sizeof(struct blk_snap_dev), GFP_KERNEL);
 	if (dev_id_array == NULL) {
 		pr_err("Unable to create snapshot: too many devices %d\n",
-		       karg.count);
+		       count);
 		return -ENOMEM;
 	}
 	memory_object_inc(memory_object_blk_snap_dev);
 
-	if (copy_from_user(dev_id_array, (void *)karg.dev_id_array,
-			   karg.count * sizeof(struct blk_snap_dev))) {
+	if (copy_from_user(dev_id_array, (void *)user_dev_ids,
+			   count * sizeof(struct blk_snap_dev))) {
 		pr_err("Unable to create snapshot: invalid user buffer\n");
 		ret = -ENODATA;
 		goto out;
 	}
 
-	ret = snapshot_create(dev_id_array, karg.count, &new_id);
+	ret = snapshot_create(dev_id_array, count, chunk_shift, &new_id);
 	if (ret)
 		goto out;
 
-	export_uuid(karg.id.b, &new_id);
-	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
-		pr_err("Unable to create snapshot: invalid user buffer\n");
-		ret = -ENODATA;
-	}
+	export_uuid(id->b, &new_id);
 out:
 	kfree(dev_id_array);
 	memory_object_dec(memory_object_blk_snap_dev);
@@ -328,6 +387,28 @@ out:
 	return ret;
 }
 
+static int ioctl_snapshot_create(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_create karg;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to create snapshot: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	ret = do_snapshot_create(karg.count, karg.dev_id_array, 0, &karg.id);
+	if (ret)
+		return ret;
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to create snapshot: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
 static int ioctl_snapshot_destroy(unsigned long arg)
 {
 	struct blk_snap_snapshot_destroy karg;
@@ -378,41 +459,32 @@ static int ioctl_snapshot_wait_event(unsigned long arg)
 	int ret = 0;
 	struct blk_snap_snapshot_event *karg;
 	uuid_t id;
-	struct event *event;
+	struct event event;
+	unsigned int count = 1;
 
 	karg = kzalloc(sizeof(struct blk_snap_snapshot_event), GFP_KERNEL);
 	if (!karg)
 		return -ENOMEM;
 	memory_object_inc(memory_object_blk_snap_snapshot_event);
 
-	/* Copy only snapshot ID */
-	if (copy_from_user(&karg->id,
-			   &((struct blk_snap_snapshot_event *)arg)->id,
-			   sizeof(struct blk_snap_uuid))) {
+	/* Copy only snapshot ID and timeout */
+	if (copy_from_user(karg, (void *)arg,
+			   offsetof(struct blk_snap_snapshot_event, code))) {
 		pr_err("Unable to get snapshot event. Invalid user buffer\n");
 		ret = -EINVAL;
 		goto out;
 	}
 
 	import_uuid(&id, karg->id.b);
-	event = snapshot_wait_event(&id, karg->timeout_ms);
-	if (IS_ERR(event)) {
-		ret = PTR_ERR(event);
+	ret = snapshot_wait_event(&id, karg->timeout_ms, &event, &count, NULL);
+	if (ret)
 		goto out;
-	}
-
-	pr_debug("Received event=%lld code=%d data_size=%d\n", event->time,
-		 event->code, event->data_size);
-	karg->code = event->code;
-	karg->time_label = event->time;
 
-	if (event->data_size > sizeof(karg->data)) {
-		pr_err("Event size %d is too big\n", event->data_size);
-		ret = -ENOSPC;
-		/* If we can't copy all the data, we copy only part of it. */
-	}
-	memcpy(karg->data, event->data, event->data_size);
-	event_free(event);
+	pr_debug("Received event=%lld code=%d data_size=%d\n", event.time,
+		 event.code, event.data_size);
+	karg->code = event.code;
+	karg->time_label = event.time;
+	memcpy(karg->data, event.data, event.data_size);
 
 	if (copy_to_user((void *)arg, karg,
 			 sizeof(struct blk_snap_snapshot_event))) {
@@ -500,6 +572,13 @@ static const struct blk_snap_mod modification = {
 #ifdef BLK_SNAP_FILELOG
 	(1ull << blk_snap_compat_flag_setlog) |
 #endif
+	(1ull << blk_snap_compat_flag_cbt_ranges) |
+	(1ull << blk_snap_compat_flag_snapshot_create_ex) |
+	(1ull << blk_snap_compat_flag_cache_limit) |
+	(1ull << blk_snap_compat_flag_get_latency) |
+	(1ull << blk_snap_compat_flag_event_fd) |
+	(1ull << blk_snap_compat_flag_wait_events) |
+	(1ull << blk_snap_compat_flag_storage_policy) |
 	0
 };
 
@@ -585,10 +664,223 @@ static int ioctl_get_sector_state(unsigned long arg)
 #endif
 }
 
+static int ioctl_tracker_read_cbt_ranges(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_tracker_read_cbt_ranges karg;
+	sector_t sector;
+	unsigned int count;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	if (karg.snap_number > U8_MAX) {
+		pr_err("Unable to read CBT ranges: invalid snapshot number\n");
+		return -EINVAL;
+	}
+
+	sector = (sector_t)karg.sector;
+	count = karg.count;
+	ret = tracker_read_cbt_ranges(MKDEV(karg.dev_id.mj, karg.dev_id.mn),
+				      (u8)karg.snap_number, &sector,
+				      karg.ranges, &count);
+	if (ret)
+		return ret;
+
+	karg.sector = (__u64)sector;
+	karg.count = count;
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int ioctl_snapshot_create_ex(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_create_ex karg;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to create snapshot: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	ret = do_snapshot_create(karg.count, karg.dev_id_array,
+				 karg.chunk_shift, &karg.id);
+	if (ret)
+		return ret;
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to create snapshot: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int ioctl_cache_limit(unsigned long arg)
+{
+	struct blk_snap_cache_limit karg;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set cache limit: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	if (karg.limit)
+		cache_manager_set_limit(karg.limit);
+
+	karg.limit = cache_manager_limit();
+	karg.used = cache_manager_used();
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to set cache limit: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static_assert(BLK_SNAP_LATENCY_BUCKETS == DIFF_IO_LATENCY_BUCKETS,
+	"The number of buckets in the latency histogram does not match.");
+
+static int ioctl_get_latency(unsigned long arg)
+{
+	struct blk_snap_get_latency karg;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to get latency: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	diff_io_latency_get(karg.read, karg.write, !!karg.reset);
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to get latency: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int ioctl_snapshot_event_fd(unsigned long arg)
+{
+	struct blk_snap_snapshot_event_fd karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set snapshot eventfd: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	return snapshot_set_event_fd(&id, karg.fd);
+}
+
+static_assert(BLK_SNAP_EVENT_RECORD_DATA_SIZE == EVENT_DATA_SIZE_MAX,
+	"The size of the event data does not match.");
+
+static int ioctl_snapshot_wait_events(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_wait_events karg;
+	struct event *events;
+	unsigned int count;
+	unsigned int inx;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to get snapshot events: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	if (!karg.count) {
+		pr_err("Unable to get snapshot events: invalid count\n");
+		return -EINVAL;
+	}
+	count = min_t(unsigned int, karg.count, EVENT_QUEUE_SIZE);
+
+	events = kcalloc(count, sizeof(struct event), GFP_KERNEL);
+	if (!events)
+		return -ENOMEM;
+	memory_object_inc(memory_object_event);
+
+	import_uuid(&id, karg.id.b);
+	ret = snapshot_wait_event(&id, karg.timeout_ms, events, &count,
+				  &karg.lost);
+	if (ret)
+		goto out;
+
+	for (inx = 0; inx < count; inx++) {
+		struct blk_snap_event_record record = {
+			.time_label = events[inx].time,
+			.code = events[inx].code,
+			.data_size = events[inx].data_size,
+		};
+
+		memcpy(record.data, events[inx].data, events[inx].data_size);
+		if (copy_to_user(&karg.records[inx], &record, sizeof(record))) {
+			pr_err("Unable to get snapshot events: invalid user buffer\n");
+			ret = -ENODATA;
+			goto fail;
+		}
+	}
+
+	karg.count = count;
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to get snapshot events: invalid user buffer\n");
+		ret = -ENODATA;
+		goto fail;
+	}
+	goto out;
+fail:
+	/*
+	 * The events have already been taken from the queue. So that they do
+	 * not disappear silently, they are reported as lost by the next
+	 * request, together with the events lost before.
+	 */
+	snapshot_lost_events(&id, karg.lost + count);
+out:
+	kfree(events);
+	memory_object_dec(memory_object_event);
+	return ret;
+}
+
+static_assert((int)blk_snap_storage_policy_linear ==
+	      (int)diff_storage_policy_linear,
+	"The storage policy does not match.");
+static_assert((int)blk_snap_storage_policy_round_robin ==
+	      (int)diff_storage_policy_round_robin,
+	"The storage policy does not match.");
+
+static int ioctl_snapshot_storage_policy(unsigned long arg)
+{
+	struct blk_snap_snapshot_storage_policy karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set storage policy: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	return snapshot_set_storage_policy(&id, karg.policy);
+}
+
 static int (*const blk_snap_ioctl_table_mod[])(unsigned long arg) = {
 	ioctl_mod,
 	ioctl_setlog,
 	ioctl_get_sector_state,
+	ioctl_tracker_read_cbt_ranges,
+	ioctl_snapshot_create_ex,
+	ioctl_cache_limit,
+	ioctl_get_latency,
+	ioctl_snapshot_event_fd,
+	ioctl_snapshot_wait_events,
+	ioctl_snapshot_storage_policy,
 };
 static_assert(
 	sizeof(blk_snap_ioctl_table_mod) ==
@@ -647,16 +939,32 @@ static int __init blk_snap_init(void)
 	pr_debug("tracking_block_maximum_count: %d\n",
 		 tracking_block_maximum_count);
 	pr_debug("chunk_minimum_shift: %d\n", chunk_minimum_shift);
+	pr_debug("chunk_minimum_shift_nonrot: %d\n", chunk_minimum_shift_nonrot);
+	pr_debug("chunk_subblock_shift: %d\n", chunk_subblock_shift);
 	pr_debug("chunk_maximum_count: %d\n", chunk_maximum_count);
-	pr_debug("chunk_maximum_in_cache: %d\n", chunk_maximum_in_cache);
+	pr_debug("chunk_cache_memory_limit: %d\n", chunk_cache_memory_limit);
+	pr_debug("chunk_readahead_count: %d\n", chunk_readahead_count);
+	if (chunk_maximum_in_cache)
+		pr_warn("The parameter chunk_maximum_in_cache is deprecated and ignored, use chunk_cache_memory_limit\n");
+	pr_debug("chunk_maximum_in_prefetch: %d\n", chunk_maximum_in_prefetch);
 	pr_debug("free_diff_buffer_pool_size: %d\n",
 		 free_diff_buffer_pool_size);
 	pr_debug("diff_storage_minimum: %d\n", diff_storage_minimum);
+	pr_debug("diff_storage_flush_interval: %d\n",
+		 diff_storage_flush_interval);
 
 	ret = diff_io_init();
 	if (ret)
 		goto fail_diff_io_init;
 
+	ret = chunk_init();
+	if (ret)
+		goto fail_chunk_init;
+
+	ret = cache_manager_init();
+	if (ret)
+		goto fail_cache_manager_init;
+
 	ret = tracker_init();
 	if (ret)
 		goto fail_tracker_init;
@@ -670,6 +978,10 @@ static int __init blk_snap_init(void)
 fail_misc_register:
 	tracker_done();
 fail_tracker_init:
+	cache_manager_done();
+fail_cache_manager_init:
+	chunk_done();
+fail_chunk_init:
 	diff_io_done();
 fail_diff_io_init:
 	log_done();
@@ -686,9 +998,20 @@ static void __exit blk_snap_exit(void)
 #endif
 	misc_deregister(&blksnap_ctrl_misc);
 
-	diff_io_done();
 	snapshot_done();
 	tracker_done();
+	/*
+	 * The difference areas released by the completion of the reads
+	 * redirected to the original block devices are freed on the workqueue.
+	 */
+	flush_workqueue(diff_io_wq);
+	cache_manager_done();
+	/*
+	 * The pools are destroyed after all snapshots, since their chunks and
+	 * regions are returned to the pools.
+	 */
+	chunk_done();
+	diff_io_done();
 	log_done();
 	memory_object_print(true);
 	pr_debug("Module was unloaded\n");
@@ -708,12 +1031,30 @@ MODULE_PARM_DESC(tracking_block_maximum_count,
 module_param_named(chunk_minimum_shift, chunk_minimum_shift, int, 0644);
 MODULE_PARM_DESC(chunk_minimum_shift,
 		 "The power of 2 for minimum chunk size");
+module_param_named(chunk_minimum_shift_nonrot, chunk_minimum_shift_nonrot,
+		   int, 0644);
+MODULE_PARM_DESC(chunk_minimum_shift_nonrot,
+		 "The power of 2 for minimum chunk size for non-rotational devices");
+module_param_named(chunk_subblock_shift, chunk_subblock_shift, int, 0644);
+MODULE_PARM_DESC(chunk_subblock_shift,
+		 "The power of 2 for sub-block size copied on write");
 module_param_named(chunk_maximum_count, chunk_maximum_count, int, 0644);
 MODULE_PARM_DESC(chunk_maximum_count,
 		 "The maximum number of chunks");
+module_param_named(chunk_cache_memory_limit, chunk_cache_memory_limit, int,
+		   0644);
+MODULE_PARM_DESC(chunk_cache_memory_limit,
+		 "The limit of memory for the chunk cache of all snapshots in MiB");
 module_param_named(chunk_maximum_in_cache, chunk_maximum_in_cache, int, 0644);
 MODULE_PARM_DESC(chunk_maximum_in_cache,
-		 "The maximum number of chunks in memory cache");
+		 "Deprecated and ignored, use chunk_cache_memory_limit");
+module_param_named(chunk_readahead_count, chunk_readahead_count, int, 0644);
+MODULE_PARM_DESC(chunk_readahead_count,
+		 "The maximum number of chunks loaded in advance when reading the snapshot image");
+module_param_named(chunk_maximum_in_prefetch, chunk_maximum_in_prefetch, int,
+		   0644);
+MODULE_PARM_DESC(chunk_maximum_in_prefetch,
+		 "The maximum number of chunks in the prefetch cache");
 module_param_named(free_diff_buffer_pool_size, free_diff_buffer_pool_size, int,
 		   0644);
 MODULE_PARM_DESC(free_diff_buffer_pool_size,
@@ -721,6 +1062,10 @@ MODULE_PARM_DESC(free_diff_buffer_pool_size,
 module_param_named(diff_storage_minimum, diff_storage_minimum, int, 0644);
 MODULE_PARM_DESC(diff_storage_minimum,
 	"The minimum allowable size of the difference storage in sectors");
+module_param_named(diff_storage_flush_interval, diff_storage_flush_interval,
+		   int, 0644);
+MODULE_PARM_DESC(diff_storage_flush_interval,
+	"The interval in milliseconds for flushing the difference storage, zero means FUA for each write");
 
 MODULE_DESCRIPTION("Block Device Snapshots Module");
 MODULE_VERSION(VERSION_STR);
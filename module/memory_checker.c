@@ -15,14 +15,17 @@ char *memory_object_names[] = {
 	"cbt_map",
 	"cbt_buffer",
 	"chunk",
+	"chunk_batch",
+	"chunk_states",
 	"blk_snap_snaphot_event",
 	"diff_area",
 	"diff_io",
 	"diff_storage",
 	"storage_bdev",
-	"storage_block",
+	"storage_extent",
 	"diff_region",
 	"diff_buffer",
+	"diff_buffer_cpu",
 	"event",
 	"snapimage",
 	"snapshot",
@@ -46,6 +49,7 @@ static_assert(
 
 static atomic_t memory_counter[memory_object_count];
 static atomic_t memory_counter_max[memory_object_count];
+static atomic64_t memory_counter_total[memory_object_count];
 
 void memory_object_inc(enum memory_object_type type)
 {
@@ -54,6 +58,7 @@ void memory_object_inc(enum memory_object_type type)
 	if (unlikely(type >= memory_object_count))
 		return;
 
+	atomic64_inc(&memory_counter_total[type]);
 	value = atomic_inc_return(&memory_counter[type]);
 	if (value > atomic_read(&memory_counter_max[type]))
 		atomic_inc(&memory_counter_max[type]);
@@ -100,12 +105,14 @@ void memory_object_max_print(void)
 {
 	int inx;
 
-	pr_debug("Maximim objects in memory:\n");
+	pr_debug("Maximim objects in memory and total allocations:\n");
 	for (inx = 0; inx < memory_object_count; inx++) {
 		int count = atomic_read(&memory_counter_max[inx]);
 
 		if (count)
-			pr_debug("%s: %d\n", memory_object_names[inx], count);
+			pr_debug("%s: %d, allocated %lld\n",
+				 memory_object_names[inx], count,
+				 atomic64_read(&memory_counter_total[inx]));
 	}
 	pr_debug(".\n");
 }
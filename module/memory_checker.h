@@ -10,14 +10,17 @@ enum memory_object_type {
 	memory_object_cbt_map,
 	memory_object_cbt_buffer,
 	memory_object_chunk,
+	memory_object_chunk_batch,
+	memory_object_chunk_states,
 	memory_object_blk_snap_snapshot_event,
 	memory_object_diff_area,
 	memory_object_diff_io,
 	memory_object_diff_storage,
 	memory_object_storage_bdev,
-	memory_object_storage_block,
+	memory_object_storage_extent,
 	memory_object_diff_region,
 	memory_object_diff_buffer,
+	memory_object_diff_buffer_cpu,
 	memory_object_event,
 	memory_object_snapimage,
 	memory_object_snapshot,
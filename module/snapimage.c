@@ -4,6 +4,7 @@
 #include <linux/slab.h>
 #include <linux/cdrom.h>
 #include <linux/blk-mq.h>
+#include <linux/sched/mm.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
 #else
@@ -16,6 +17,42 @@
 #include "cbt_map.h"
 #include "log.h"
 
+extern int chunk_readahead_count;
+
+/*
+ * Detects sequential reading of the snapshot image and calculates the number
+ * of chunks that should be loaded in advance.
+ */
+static unsigned int snapimage_stream_readahead(struct snapimage *snapimage,
+					       struct bio *bio)
+{
+	unsigned int window;
+	sector_t range;
+	sector_t start = bio->bi_iter.bi_sector;
+	sector_t end = bio_end_sector(bio);
+
+	if (op_is_write(bio_op(bio)) || (chunk_readahead_count <= 0))
+		return 0;
+
+	spin_lock(&snapimage->stream_lock);
+	range = diff_area_chunk_sectors(snapimage->diff_area) *
+		max(snapimage->stream_window, 1U);
+	if ((start + range >= snapimage->stream_next) &&
+	    (start <= snapimage->stream_next + range)) {
+		window = snapimage->stream_window ?
+			 (snapimage->stream_window << 1) : 1;
+		window = min_t(unsigned int, window, chunk_readahead_count);
+		snapimage->stream_next = max(snapimage->stream_next, end);
+	} else {
+		window = 0;
+		snapimage->stream_next = end;
+	}
+	snapimage->stream_window = window;
+	spin_unlock(&snapimage->stream_lock);
+
+	return window;
+}
+
 static void snapimage_process_bio(struct snapimage *snapimage, struct bio *bio)
 {
 
@@ -23,8 +60,18 @@ static void snapimage_process_bio(struct snapimage *snapimage, struct bio *bio)
 	struct bio_vec bvec;
 	struct bvec_iter iter;
 	sector_t pos = bio->bi_iter.bi_sector;
+	unsigned int readahead = snapimage_stream_readahead(snapimage, bio);
 
 	diff_area_throttling_io(snapimage->diff_area);
+	/*
+	 * Reading of chunks that have never been copied is redirected to the
+	 * original block device without copying the data.
+	 */
+	if (diff_area_image_passthrough(snapimage->diff_area, bio))
+		return;
+
+	diff_area_image_prefetch(snapimage->diff_area, pos, bio_sectors(bio),
+				 readahead);
 	diff_area_image_ctx_init(&io_ctx, snapimage->diff_area,
 				 op_is_write(bio_op(bio)));
 	bio_for_each_segment(bvec, bio, iter) {
@@ -49,20 +96,27 @@ static inline struct bio *get_bio_from_queue(struct snapimage *snapimage)
 	return bio;
 }
 
-static int snapimage_kthread_worker_fn(void *param)
+static void snapimage_worker_fn(struct work_struct *work)
 {
-	struct snapimage *snapimage = param;
+	struct snapimage_worker *worker =
+		container_of(work, struct snapimage_worker, work);
+	struct snapimage *snapimage = worker->snapimage;
 	struct bio *bio;
+	unsigned int current_flag;
 
-	for (;;) {
-		while ((bio = get_bio_from_queue(snapimage)))
-			snapimage_process_bio(snapimage, bio);
-		if (kthread_should_stop())
-			break;
-		schedule();
-	}
+	current_flag = memalloc_noio_save();
+	while ((bio = get_bio_from_queue(snapimage)))
+		snapimage_process_bio(snapimage, bio);
+	memalloc_noio_restore(current_flag);
+}
 
-	return 0;
+static inline void snapimage_wake_up_worker(struct snapimage *snapimage)
+{
+	unsigned int inx;
+
+	inx = (unsigned int)atomic_inc_return(&snapimage->worker_next) %
+	      snapimage->worker_count;
+	queue_work(snapimage->workqueue, &snapimage->workers[inx].work);
 }
 
 #ifdef HAVE_QC_SUBMIT_BIO
@@ -85,7 +139,7 @@ static void snapimage_submit_bio(struct bio *bio)
 		bio_list_add(&snapimage->queue, bio);
 		spin_unlock(&snapimage->queue_lock);
 
-		wake_up_process(snapimage->worker);
+		snapimage_wake_up_worker(snapimage);
 	} else
 		bio_io_error(bio);
 
@@ -125,7 +179,11 @@ void snapimage_free(struct snapimage *snapimage)
 
 	del_gendisk(snapimage->disk);
 
-	kthread_stop(snapimage->worker);
+	/*
+	 * The workqueue is drained before being destroyed, so all the I/O
+	 * units remaining in the queue will be processed.
+	 */
+	destroy_workqueue(snapimage->workqueue);
 #ifdef HAVE_BLK_ALLOC_DISK
 #ifdef HAVE_BLK_CLEANUP_DISK
 	blk_cleanup_disk(snapimage->disk);
@@ -174,9 +232,11 @@ struct snapimage *snapimage_create(struct diff_area *diff_area,
 	dev_t dev_id = diff_area->orig_bdev->bd_dev;
 	struct snapimage *snapimage = NULL;
 	struct gendisk *disk;
-	struct task_struct *task;
+	unsigned int worker_count = num_online_cpus();
+	unsigned int inx;
 
-	snapimage = kzalloc(sizeof(struct snapimage), GFP_KERNEL);
+	snapimage = kzalloc(struct_size(snapimage, workers, worker_count),
+			    GFP_KERNEL);
 	if (snapimage == NULL)
 		return ERR_PTR(-ENOMEM);
 	memory_object_inc(memory_object_snapimage);
@@ -188,18 +248,25 @@ struct snapimage *snapimage_create(struct diff_area *diff_area,
 	spin_lock_init(&snapimage->queue_lock);
 	bio_list_init(&snapimage->queue);
 
-	task = kthread_create(snapimage_kthread_worker_fn, snapimage,
-			      "blksnap_%d_%d",
-			      MAJOR(dev_id), MINOR(dev_id));
-	if (IS_ERR(task)) {
-		ret = PTR_ERR(task);
-		pr_err("Failed to start worker thread. errno=%d\n", abs(ret));
-		goto fail_create_task;
+	spin_lock_init(&snapimage->stream_lock);
+	snapimage->stream_next = 0;
+	snapimage->stream_window = 0;
+
+	snapimage->workqueue = alloc_workqueue("blksnap_%d_%d",
+					       WQ_UNBOUND | WQ_MEM_RECLAIM, 0,
+					       MAJOR(dev_id), MINOR(dev_id));
+	if (!snapimage->workqueue) {
+		ret = -ENOMEM;
+		pr_err("Failed to allocate workqueue\n");
+		goto fail_create_workqueue;
 	}
 
-	snapimage->worker = task;
-	set_user_nice(task, MAX_NICE);
-	task->flags |= PF_LOCAL_THROTTLE | PF_MEMALLOC_NOIO;
+	atomic_set(&snapimage->worker_next, 0);
+	snapimage->worker_count = worker_count;
+	for (inx = 0; inx < worker_count; inx++) {
+		INIT_WORK(&snapimage->workers[inx].work, snapimage_worker_fn);
+		snapimage->workers[inx].snapimage = snapimage;
+	}
 
 	disk = blk_alloc_disk(NUMA_NO_NODE);
 	if (!disk) {
@@ -261,7 +328,7 @@ struct snapimage *snapimage_create(struct diff_area *diff_area,
 	return snapimage;
 
 fail_cleanup_disk:
-	kthread_stop(snapimage->worker);
+	destroy_workqueue(snapimage->workqueue);
 #ifdef HAVE_BLK_ALLOC_DISK
 #ifdef HAVE_BLK_CLEANUP_DISK
 	blk_cleanup_disk(disk);
@@ -274,8 +341,8 @@ fail_cleanup_disk:
 	return ERR_PTR(ret);
 
 fail_disk_alloc:
-	kthread_stop(snapimage->worker);
-fail_create_task:
+	destroy_workqueue(snapimage->workqueue);
+fail_create_workqueue:
 	kfree(snapimage);
 	memory_object_dec(memory_object_snapimage);
 	return ERR_PTR(ret);
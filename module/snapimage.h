@@ -6,10 +6,24 @@
 #include <linux/genhd.h>
 #endif
 #include <linux/blk-mq.h>
-#include <linux/kthread.h>
+#include <linux/workqueue.h>
 
 struct diff_area;
 struct cbt_map;
+struct snapimage;
+
+/**
+ * struct snapimage_worker - Worker for processing I/O units.
+ *
+ * @work:
+ *	The work that processes I/O units from the queue of the snapshot image.
+ * @snapimage:
+ *	A pointer to the snapshot image.
+ */
+struct snapimage_worker {
+	struct work_struct work;
+	struct snapimage *snapimage;
+};
 
 /**
  * struct snapimage - Snapshot image block device.
@@ -17,19 +31,31 @@ struct cbt_map;
  * @capacity:
  *	The size of the snapshot image in sectors must be equal to the size
  *	of the original device at the time of taking the snapshot.
- * @worker:
- *	A pointer to the &struct task of the worker thread that process I/O
- *      units.
+ * @workqueue:
+ *	The workqueue on which the workers are executed.
+ * @worker_next:
+ *	The counter for selecting the worker to wake up.
+ * @worker_count:
+ *	The number of workers.
  * @queue_lock:
  *      Lock for &queue.
  * @queue:
  *	A queue of I/O units waiting to be processed.
+ * @stream_lock:
+ *	Lock for &stream_next and &stream_window.
+ * @stream_next:
+ *	The sector following the end of the last read I/O unit.
+ * @stream_window:
+ *	The current readahead window in chunks. It is zero when there is
+ *	no sequential reading.
  * @disk:
  *	A pointer to the &struct gendisk for the image block device.
  * @diff_area:
  *	A pointer to the owned &struct diff_area.
  * @cbt_map:
  *	A pointer to the owned &struct cbt_map.
+ * @workers:
+ *	Workers that process I/O units.
  *
  * The snapshot image is presented in the system as a block device. But
  * when reading or writing a snapshot image, the data is redirected to
@@ -39,18 +65,37 @@ struct cbt_map;
  * from different threads in parallel. To avoid the problem with simultaneous
  * access, it is enough to open the snapshot image block device with the
  * FMODE_EXCL parameter.
+ *
+ * I/O units are processed by several workers in parallel. Each worker takes
+ * I/O units from the queue until it is empty. When an I/O unit is added to
+ * the queue, the next worker is woken up. Thus, with a deep queue of
+ * requests, independent chunks are loaded concurrently.
+ *
+ * A backup application usually reads the snapshot image sequentially.
+ * When a read I/O unit continues the previous one, the readahead window
+ * is doubled, and the chunks following the I/O unit are loaded in advance.
+ * Since the I/O units are processed by several workers, a small reordering
+ * within the readahead window is not considered a random access.
  */
 struct snapimage {
 	sector_t capacity;
 
-	struct task_struct *worker;
+	struct workqueue_struct *workqueue;
+	atomic_t worker_next;
+	unsigned int worker_count;
 	spinlock_t queue_lock;
 	struct bio_list queue;
 
+	spinlock_t stream_lock;
+	sector_t stream_next;
+	unsigned int stream_window;
+
 	struct gendisk *disk;
 
 	struct diff_area *diff_area;
 	struct cbt_map *cbt_map;
+
+	struct snapimage_worker workers[];
 };
 
 void snapimage_free(struct snapimage *snapimage);
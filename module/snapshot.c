@@ -316,7 +316,7 @@ static inline int check_same_devices(struct blk_snap_dev *devices,
 }
 
 int snapshot_create(struct blk_snap_dev *dev_id_array, unsigned int count,
-		    uuid_t *id)
+		    unsigned int chunk_shift, uuid_t *id)
 {
 	struct snapshot *snapshot = NULL;
 	int ret;
@@ -331,11 +331,19 @@ int snapshot_create(struct blk_snap_dev *dev_id_array, unsigned int count,
 	if (ret)
 		return ret;
 
+	if (chunk_shift && ((chunk_shift < PAGE_SHIFT) ||
+			    (chunk_shift > DIFF_AREA_CHUNK_SHIFT_MAX))) {
+		pr_err("Unable to create snapshot: invalid chunk size shift %u\n",
+		       chunk_shift);
+		return -EINVAL;
+	}
+
 	snapshot = snapshot_new(count);
 	if (IS_ERR(snapshot)) {
 		pr_err("Unable to create snapshot: failed to allocate snapshot structure\n");
 		return PTR_ERR(snapshot);
 	}
+	snapshot->chunk_shift = chunk_shift;
 
 	ret = -ENODEV;
 	for (inx = 0; inx < count; ++inx) {
@@ -664,8 +672,8 @@ int snapshot_take(uuid_t *id)
 		if (!tracker)
 			continue;
 
-		diff_area =
-			diff_area_new(tracker->dev_id, snapshot->diff_storage);
+		diff_area = diff_area_new(tracker->dev_id, snapshot->diff_storage,
+					  snapshot->chunk_shift);
 		if (IS_ERR(diff_area)) {
 			ret = PTR_ERR(diff_area);
 			goto fail;
@@ -727,19 +735,65 @@ out:
 	return ret;
 }
 
-struct event *snapshot_wait_event(uuid_t *id, unsigned long timeout_ms)
+int snapshot_wait_event(uuid_t *id, unsigned long timeout_ms,
+			struct event *events, unsigned int *pcount,
+			unsigned int *plost)
 {
+	int ret;
 	struct snapshot *snapshot;
-	struct event *event;
 
 	snapshot = snapshot_get_by_id(id);
 	if (!snapshot)
-		return ERR_PTR(-ESRCH);
+		return -ESRCH;
 
-	event = event_wait(&snapshot->diff_storage->event_queue, timeout_ms);
+	ret = event_wait(&snapshot->diff_storage->event_queue, timeout_ms,
+			 events, pcount, plost);
 
 	snapshot_put(snapshot);
-	return event;
+	return ret;
+}
+
+void snapshot_lost_events(uuid_t *id, unsigned int count)
+{
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return;
+
+	event_lost(&snapshot->diff_storage->event_queue, count);
+
+	snapshot_put(snapshot);
+}
+
+int snapshot_set_event_fd(uuid_t *id, int fd)
+{
+	int ret;
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	ret = event_queue_set_eventfd(&snapshot->diff_storage->event_queue, fd);
+
+	snapshot_put(snapshot);
+	return ret;
+}
+
+int snapshot_set_storage_policy(uuid_t *id, int policy)
+{
+	int ret;
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	ret = diff_storage_set_policy(snapshot->diff_storage, policy);
+
+	snapshot_put(snapshot);
+	return ret;
 }
 
 int snapshot_collect(unsigned int *pcount, struct blk_snap_uuid __user *id_array)
@@ -28,6 +28,9 @@ struct snapimage;
  *	Flag that the snapshot was taken.
  * @diff_storage:
  *	A pointer to the difference storage of this snapshot.
+ * @chunk_shift:
+ *	The power of 2 for the preferred chunk size. Zero if the chunk size
+ *	is selected for each block device automatically.
  * @count:
  *	The number of block devices in the snapshot. This number
  *	corresponds to the size of arrays of pointers to trackers
@@ -53,6 +56,7 @@ struct snapshot {
 	uuid_t id;
 	bool is_taken;
 	struct diff_storage *diff_storage;
+	unsigned int chunk_shift;
 	int count;
 	struct tracker **tracker_array;
 	struct snapimage **snapimage_array;
@@ -64,13 +68,18 @@ struct snapshot {
 void snapshot_done(void);
 
 int snapshot_create(struct blk_snap_dev *dev_id_array, unsigned int count,
-		    uuid_t *id);
+		    unsigned int chunk_shift, uuid_t *id);
 int snapshot_destroy(uuid_t *id);
 int snapshot_append_storage(uuid_t *id, struct blk_snap_dev dev_id,
 			    struct blk_snap_block_range __user *ranges,
 			    unsigned int range_count);
 int snapshot_take(uuid_t *id);
-struct event *snapshot_wait_event(uuid_t *id, unsigned long timeout_ms);
+int snapshot_wait_event(uuid_t *id, unsigned long timeout_ms,
+			struct event *events, unsigned int *pcount,
+			unsigned int *plost);
+void snapshot_lost_events(uuid_t *id, unsigned int count);
+int snapshot_set_event_fd(uuid_t *id, int fd);
+int snapshot_set_storage_policy(uuid_t *id, int policy);
 int snapshot_collect(unsigned int *pcount, struct blk_snap_uuid __user *id_array);
 int snapshot_collect_images(uuid_t *id,
 			    struct blk_snap_image_info __user *image_info_array,
@@ -410,6 +410,11 @@ int tracker_take_snapshot(struct tracker *tracker)
 #else
 	blk_mq_unfreeze_queue(orig_bdev->bd_queue);
 #endif
+	/*
+	 * The merging of the CBT tables does not require the queue to be
+	 * frozen.
+	 */
+	cbt_map_merge(tracker->cbt_map);
 	return 0;
 }
 
@@ -669,6 +674,54 @@ put_bdev:
 	return ret;
 }
 
+#ifdef BLK_SNAP_MODIFICATION
+int tracker_read_cbt_ranges(dev_t dev_id, u8 snap_number, sector_t *sector,
+			    struct blk_snap_block_range __user *user_ranges,
+			    unsigned int *count)
+{
+	int ret;
+	struct tracker *tracker;
+	struct block_device *bdev;
+
+	bdev = blkdev_get_by_dev(dev_id, 0, NULL);
+	if (IS_ERR(bdev)) {
+		pr_info("Cannot open device [%u:%u]\n", MAJOR(dev_id),
+		       MINOR(dev_id));
+		return PTR_ERR(bdev);
+	}
+
+	tracker = tracker_get_by_dev(bdev);
+	if (IS_ERR(tracker)) {
+		pr_err("Cannot get tracker for device [%u:%u]\n",
+			 MAJOR(dev_id), MINOR(dev_id));
+		ret = PTR_ERR(tracker);
+		goto put_bdev;
+	}
+	if (!tracker) {
+		pr_info("Unable to read CBT ranges for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_info("tracker not found\n");
+		ret = -ENODATA;
+		goto put_bdev;
+	}
+
+	if (atomic_read(&tracker->snapshot_is_taken)) {
+		ret = cbt_map_read_ranges_to_user(tracker->cbt_map, snap_number,
+						  sector, user_ranges, count);
+	} else {
+		pr_err("Unable to read CBT ranges for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_err("device is not captured by snapshot\n");
+		ret = -EPERM;
+	}
+
+	tracker_put(tracker);
+put_bdev:
+	blkdev_put(bdev, 0);
+	return ret;
+}
+#endif
+
 static inline void collect_cbt_info(dev_t dev_id,
 				    struct blk_snap_cbt_info *cbt_info)
 {
@@ -67,6 +67,11 @@ int tracker_collect(int max_count, struct blk_snap_cbt_info *cbt_info,
 		    int *pcount);
 int tracker_read_cbt_bitmap(dev_t dev_id, unsigned int offset, size_t length,
 			    char __user *user_buff);
+#ifdef BLK_SNAP_MODIFICATION
+int tracker_read_cbt_ranges(dev_t dev_id, u8 snap_number, sector_t *sector,
+			    struct blk_snap_block_range __user *user_ranges,
+			    unsigned int *count);
+#endif
 int tracker_mark_dirty_blocks(dev_t dev_id,
 			      struct blk_snap_block_range *block_ranges,
 			      unsigned int count);
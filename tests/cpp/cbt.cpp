@@ -1,15 +1,273 @@
 // SPDX-License-Identifier: GPL-2.0+
+#include <algorithm>
+#include <blksnap/Blksnap.h>
 #include <blksnap/Cbt.h>
+#include <blksnap/Service.h>
 #include <blksnap/Session.h>
 #include <boost/program_options.hpp>
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
+#include <string.h>
+
+#include "helpers/AlignedBuffer.hpp"
+#include "helpers/BlockDevice.h"
+#include "helpers/Log.h"
 
 namespace po = boost::program_options;
 using blksnap::sector_t;
+using blksnap::SRange;
+
+/*
+ * The test checks that the changed ranges read from the CBT table by the
+ * IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES and by ICbt::ForEachChangedRange()
+ * match the CBT map and cover all writes made between two snapshots.
+ */
+
+/*
+ * Appends the range to the sorted list, merging it with the last range if
+ * they are adjacent. The ranges can be split at the boundary of a portion.
+ */
+static void AppendRange(std::vector<SRange>& ranges, const SRange& range)
+{
+    if (!ranges.empty())
+    {
+        SRange& last = ranges.back();
+
+        if ((last.sector + last.count) == range.sector)
+        {
+            last.count += range.count;
+            return;
+        }
+    }
+    ranges.push_back(range);
+}
+
+static bool IsEqual(const std::vector<SRange>& left, const std::vector<SRange>& right)
+{
+    if (left.size() != right.size())
+        return false;
+
+    for (size_t inx = 0; inx < left.size(); inx++)
+        if ((left[inx].sector != right[inx].sector) || (left[inx].count != right[inx].count))
+            return false;
+    return true;
+}
+
+static std::string RangesToString(const std::vector<SRange>& ranges)
+{
+    std::stringstream ss;
+
+    for (const SRange& range : ranges)
+        ss << range.sector << ":" << range.count << " ";
+    return ss.str();
+}
+
+static std::vector<SRange> RangesFromMap(const std::shared_ptr<blksnap::SCbtInfo>& ptrPrevious,
+                                         const std::shared_ptr<blksnap::SCbtData>& ptrCbtData)
+{
+    const sector_t blockSectors = ptrPrevious->blockSize >> SECTOR_SHIFT;
+    const sector_t capacity = ptrPrevious->deviceCapacity >> SECTOR_SHIFT;
+    std::vector<SRange> ranges;
+
+    for (size_t inx = 0; inx < ptrCbtData->vec.size(); inx++)
+    {
+        if (ptrCbtData->vec[inx] <= ptrPrevious->snapNumber)
+            continue;
+
+        sector_t sector = inx * blockSectors;
+        AppendRange(ranges, SRange(sector, std::min(sector + blockSectors, capacity) - sector));
+    }
+    return ranges;
+}
+
+static std::vector<SRange> RangesFromIoctl(const std::shared_ptr<blksnap::SCbtInfo>& ptrPrevious)
+{
+    blksnap::CBlksnap blksnap;
+    struct blk_snap_dev devId = {.mj = ptrPrevious->originalMajor, .mn = ptrPrevious->originalMinor};
+    const sector_t capacity = ptrPrevious->deviceCapacity >> SECTOR_SHIFT;
+    uint64_t sector = 0;
+    std::vector<SRange> ranges;
+
+    while (sector < capacity)
+    {
+        /* A small portion makes the ranges continue in the next request */
+        std::vector<struct blk_snap_block_range> portion(4);
+        uint64_t from = sector;
+
+        blksnap.ReadCbtRanges(devId, ptrPrevious->snapNumber, sector, portion);
+        for (const struct blk_snap_block_range& rg : portion)
+            AppendRange(ranges, SRange(rg.sector_offset, rg.sector_count));
+
+        if ((sector <= from) && portion.empty())
+            throw std::runtime_error("Reading of the changed ranges does not progress at sector "
+                                     + std::to_string(sector));
+    }
+    return ranges;
+}
+
+static std::vector<SRange> RangesFromIterator(const std::shared_ptr<blksnap::SCbtInfo>& ptrPrevious)
+{
+    std::vector<SRange> ranges;
+
+    auto ptrCbt = blksnap::ICbt::Create();
+    if (!ptrCbt->ForEachChangedRange(ptrPrevious, [&ranges](const SRange& range) { AppendRange(ranges, range); }))
+        throw std::runtime_error("The CBT generation has been changed.");
+    return ranges;
+}
+
+static bool IsCovered(const std::vector<SRange>& ranges, const SRange& written)
+{
+    for (const SRange& range : ranges)
+        if ((range.sector <= written.sector) && ((written.sector + written.count) <= (range.sector + range.count)))
+            return true;
+    return false;
+}
+
+void CheckCbtRanges(const std::string& origDevName, const std::string& diffStorage, const int writesCount)
+{
+    std::vector<std::string> devices;
+    devices.push_back(origDevName);
+    std::vector<SRange> written;
+    bool isErrorFound = false;
+
+    logger.Info("--- Test: check CBT ranges ---");
+    logger.Info("version: " + blksnap::Version());
+    logger.Info("device: " + origDevName);
+    logger.Info("diffStorage: " + diffStorage);
+
+    logger.Info("-- Create snapshot to get the previous CBT state");
+    std::shared_ptr<blksnap::SCbtInfo> ptrPrevious;
+    {
+        auto ptrSession = blksnap::ISession::Create(devices, diffStorage);
+
+        ptrPrevious = blksnap::ICbt::Create()->GetCbtInfo(origDevName);
+        logger.Info("Previous CBT snap number= " + std::to_string(ptrPrevious->snapNumber));
+    }
+
+    logger.Info("-- Write " + std::to_string(writesCount) + " random ranges");
+    {
+        auto ptrBdev = std::make_shared<CBlockDevice>(origDevName, true);
+        const size_t blockSize = 4096;
+        const off_t blockCount = ptrBdev->Size() / blockSize;
+        std::stringstream ss;
+
+        for (int cnt = 0; cnt < writesCount; cnt++)
+        {
+            size_t size = ((std::rand() & 0x7) + 1) * blockSize;
+            off_t offset = (static_cast<off_t>(std::rand()) % blockCount) * blockSize;
+
+            if (offset > (ptrBdev->Size() - static_cast<off_t>(size)))
+                offset = ptrBdev->Size() - size;
+
+            AlignedBuffer<unsigned char> buffer(blockSize, size);
+            ::memset(buffer.Data(), cnt, size);
+            ptrBdev->Write(buffer.Data(), size, offset);
+
+            written.emplace_back(offset >> SECTOR_SHIFT, size >> SECTOR_SHIFT);
+            ss << (offset >> SECTOR_SHIFT) << ":" << (size >> SECTOR_SHIFT) << " ";
+        }
+        logger.Detail(ss);
+    }
+
+    logger.Info("-- Create snapshot to read the changes");
+    {
+        auto ptrSession = blksnap::ISession::Create(devices, diffStorage);
+        auto ptrCbt = blksnap::ICbt::Create();
+        auto ptrCurrent = ptrCbt->GetCbtInfo(origDevName);
+
+        if (uuid_compare(ptrPrevious->generationId, ptrCurrent->generationId))
+            throw std::runtime_error("The CBT generation has been changed.");
+
+        std::vector<SRange> mapRanges = RangesFromMap(ptrPrevious, ptrCbt->GetCbtData(ptrCurrent));
+        std::vector<SRange> ioctlRanges = RangesFromIoctl(ptrPrevious);
+        std::vector<SRange> iteratorRanges = RangesFromIterator(ptrPrevious);
+
+        logger.Info("Changed ranges in the CBT map: " + std::to_string(mapRanges.size()));
+        logger.Detail(RangesToString(mapRanges));
+
+        if (!IsEqual(ioctlRanges, mapRanges))
+        {
+            isErrorFound = true;
+            logger.Err("The ranges read by the ioctl do not match the CBT map: " + RangesToString(ioctlRanges));
+        }
+
+        if (!IsEqual(iteratorRanges, mapRanges))
+        {
+            isErrorFound = true;
+            logger.Err("The ranges of ForEachChangedRange() do not match the CBT map: "
+                       + RangesToString(iteratorRanges));
+        }
+
+        for (const SRange& range : written)
+        {
+            if (!IsCovered(mapRanges, range))
+            {
+                isErrorFound = true;
+                logger.Err("The written range " + std::to_string(range.sector) + ":" + std::to_string(range.count)
+                           + " is not marked as changed");
+            }
+        }
+
+        std::string errorMessage;
+        while (ptrSession->GetError(errorMessage))
+        {
+            isErrorFound = true;
+            logger.Err(errorMessage);
+        }
+    }
+
+    if (isErrorFound)
+        throw std::runtime_error("--- Failed: check CBT ranges ---");
+
+    logger.Info("--- Success: check CBT ranges ---");
+}
 
 void Main(int argc, char* argv[])
 {
-    std::runtime_error("It's not implemented yet.");
+    po::options_description desc;
+    std::string usage = std::string("Checking the reading of the changed ranges from the CBT table.\n"
+                                    "Attention! The contents of the device will be overwritten.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
+        ("device,d", po::value<std::string>(), "Device name. ")
+        ("diff_storage,s", po::value<std::string>(),
+            "Directory name for allocating diff storage files.")
+        ("count,c", po::value<int>()->default_value(64), "The number of random writes between the snapshots.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    if (vm.count("log"))
+    {
+        std::string filename = vm["log"].as<std::string>();
+        logger.Open(filename);
+    }
+
+    if (!vm.count("device"))
+        throw std::invalid_argument("Argument 'device' is missed.");
+    std::string origDevName = vm["device"].as<std::string>();
+
+    if (!vm.count("diff_storage"))
+        throw std::invalid_argument("Argument 'diff_storage' is missed.");
+    std::string diffStorage = vm["diff_storage"].as<std::string>();
+
+    int count = vm["count"].as<int>();
+    if (count <= 0)
+        throw std::invalid_argument("Argument 'count' should be positive.");
+
+    std::srand(std::time(0));
+    CheckCbtRanges(origDevName, diffStorage, count);
 }
 
 int main(int argc, char* argv[])
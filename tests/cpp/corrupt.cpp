@@ -226,6 +226,103 @@ void LogCurruptedSectors(const std::string& image, const std::vector<SRange>& ra
     }
 }
 
+/*
+ * Reads the range of the image and checks that it contains the data of the
+ * original device at the time the snapshot was taken.
+ */
+void CheckRange(const std::shared_ptr<CTestSectorGenetor>& ptrGen, const std::shared_ptr<CBlockDevice>& ptrImage,
+                off_t offset, size_t size, const int seqNumber, const clock_t seqTime)
+{
+    AlignedBuffer<unsigned char> portion(g_blksz, size);
+
+    ptrImage->Read(portion.Data(), size, offset);
+    ptrGen->Check(portion.Data(), size, offset >> SECTOR_SHIFT, seqNumber, seqTime);
+}
+
+/*
+ * Checks the chunk that is copied to the difference storage in parts.
+ * Several sub-blocks of the same chunk are overwritten on the original device
+ * at different times, then a part of the chunk is written to the snapshot
+ * image. The image should keep the data written to it, and the rest of the
+ * chunk should contain the data at the time the snapshot was taken.
+ */
+void CheckPartialChunk(const std::shared_ptr<CTestSectorGenetor>& ptrGen,
+                       const std::shared_ptr<CBlockDevice>& ptrOriginal, const std::vector<std::string>& devices,
+                       const std::string& diffStorage)
+{
+    /*
+     * The snapshot is created with an explicit chunk size, since the module
+     * selects a smaller chunk for non-rotational devices by default.
+     */
+    const unsigned int chunkShift = SECTOR_SHIFT + 9;
+    const off_t chunkSize = 1LL << chunkShift;
+    const off_t chunkOffset = (ptrOriginal->Size() / 2) & ~(chunkSize - 1);
+    const size_t blockSize = std::max(g_blksz, 4096);
+    bool isErrorFound = false;
+
+    logger.Info("-- Check partial chunk at offset " + std::to_string(chunkOffset));
+    auto ptrSession = blksnap::ISession::Create(devices, diffStorage, chunkShift);
+
+    int testSeqNumber = ptrGen->GetSequenceNumber();
+    clock_t testSeqTime = std::clock();
+    ptrGen->IncSequence();
+
+    auto ptrImage = std::make_shared<CBlockDevice>(ptrSession->GetImageDevice(devices[0]));
+
+    logger.Info("- Overwrite sub-blocks of the chunk at different times");
+    for (const off_t blockOffset : {static_cast<off_t>(0), chunkSize / 2, chunkSize / 4,
+                                    chunkSize - static_cast<off_t>(blockSize)})
+    {
+        FillBlocks(ptrGen, ptrOriginal, chunkOffset + blockOffset, blockSize);
+        ::sync();
+        CheckRange(ptrGen, ptrImage, chunkOffset, chunkSize, testSeqNumber, testSeqTime);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    logger.Info("- Write to a part of the chunk on the image");
+    const off_t imageOffset = chunkOffset + chunkSize / 8;
+    AlignedBuffer<unsigned char> imageData(g_blksz, blockSize * 2);
+    AlignedBuffer<unsigned char> readData(g_blksz, imageData.Size());
+
+    ptrGen->Generate(imageData.Data(), imageData.Size(), imageOffset >> SECTOR_SHIFT);
+    ptrImage->Write(imageData.Data(), imageData.Size(), imageOffset);
+
+    logger.Info("- Overwrite the same sub-blocks on the original device");
+    FillBlocks(ptrGen, ptrOriginal, imageOffset, blockSize);
+    FillBlocks(ptrGen, ptrOriginal, chunkOffset + chunkSize / 2, blockSize);
+    ::sync();
+
+    ptrImage->Read(readData.Data(), readData.Size(), imageOffset);
+    if (::memcmp(readData.Data(), imageData.Data(), imageData.Size()))
+    {
+        isErrorFound = true;
+        logger.Err("The data written to the image at offset " + std::to_string(imageOffset) + " was lost");
+    }
+    CheckRange(ptrGen, ptrImage, chunkOffset, imageOffset - chunkOffset, testSeqNumber, testSeqTime);
+    CheckRange(ptrGen, ptrImage, imageOffset + imageData.Size(), chunkOffset + chunkSize - imageOffset - imageData.Size(),
+               testSeqNumber, testSeqTime);
+    if (ptrGen->Fails() > 0)
+    {
+        isErrorFound = true;
+        LogCurruptedSectors(ptrImage->Name(), ptrGen->GetFails());
+    }
+
+    std::string errorMessage;
+    while (ptrSession->GetError(errorMessage))
+    {
+        isErrorFound = true;
+        logger.Err(errorMessage);
+    }
+
+    logger.Info("-- Destroy blksnap session");
+    ptrSession.reset();
+
+    if (isErrorFound)
+        throw std::runtime_error("--- Failed: check partial chunk ---");
+
+    logger.Info("-- Success: check partial chunk");
+}
+
 void CheckCorruption(const std::string& origDevName, const std::string& diffStorage, const int durationLimitSec,
                      const bool isSync, const int blocksCountMax)
 {
@@ -250,6 +347,8 @@ void CheckCorruption(const std::string& origDevName, const std::string& diffStor
     std::vector<std::string> devices;
     devices.push_back(origDevName);
 
+    CheckPartialChunk(ptrGen, ptrOrininal, devices, diffStorage);
+
     std::time_t startTime = std::time(nullptr);
     int elapsed;
     bool isErrorFound = false;
@@ -1,34 +1,353 @@
 // SPDX-License-Identifier: GPL-2.0+
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <blksnap/Blksnap.h>
 #include <blksnap/Service.h>
 #include <blksnap/Session.h>
 #include <boost/program_options.hpp>
 #include <errno.h>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <system_error>
 #include <unistd.h>
 
 #include "helpers/AlignedBuffer.hpp"
 #include "helpers/BlockDevice.h"
 #include "helpers/Log.h"
 #include "helpers/RandomHelper.h"
-#include "TestSector.h"
 
 namespace po = boost::program_options;
 using blksnap::sector_t;
 using blksnap::SRange;
 
-void CheckPerformance(const std::string& device, const std::string& diffStorage)
+/*
+ * The test measures the overhead that change tracking and the COW
+ * algorithm add to writes on the original block device.
+ * Each workload is executed three times: without tracking, with the
+ * change tracker only and with the snapshot held.
+ */
+
+struct SWorkload
+{
+    SWorkload(const std::string& inName, const size_t inBlockSize, const bool inIsRandom)
+        : name(inName)
+        , blockSize(inBlockSize)
+        , isRandom(inIsRandom)
+    {};
+
+    std::string name;
+    size_t blockSize;
+    bool isRandom;
+};
+
+struct SResult
+{
+    std::string mode;
+    std::string workload;
+    size_t blockSize;
+    unsigned long long operations;
+    unsigned long long bytesWritten;
+    double seconds;
+    double throughputMBs;
+    double iops;
+    double latencyP50us;
+    double latencyP99us;
+    double latencyP999us;
+    double latencyMaxUs;
+    unsigned long long diffStorageBytes;
+    std::string error;
+};
+
+static struct blk_snap_dev DeviceByName(const std::string& name)
 {
-    bool isErrorFound = false;
+    struct stat st;
+
+    if (::stat(name.c_str(), &st))
+        throw std::system_error(errno, std::generic_category(), "Failed to get status of '" + name + "'.");
+
+    if (!S_ISBLK(st.st_mode))
+        throw std::invalid_argument("'" + name + "' is not a block device.");
+
+    return {.mj = major(st.st_rdev), .mn = minor(st.st_rdev)};
+}
+
+static struct blk_snap_dev DeviceByPath(const std::string& path)
+{
+    struct stat st;
+
+    if (::stat(path.c_str(), &st))
+        throw std::system_error(errno, std::generic_category(), "Failed to get status of '" + path + "'.");
+
+    return {.mj = major(st.st_dev), .mn = minor(st.st_dev)};
+}
+
+/*
+ * Returns the count of bytes written on the block device since boot.
+ * The seventh field of the stat file is the number of sectors written.
+ */
+static unsigned long long WrittenBytes(const struct blk_snap_dev& dev)
+{
+    std::string filename = "/sys/dev/block/" + std::to_string(dev.mj) + ":" + std::to_string(dev.mn) + "/stat";
+    std::ifstream stat(filename);
+    unsigned long long value = 0;
+
+    if (!stat.is_open())
+        throw std::runtime_error("Failed to open '" + filename + "'.");
+
+    for (int inx = 0; inx < 7; inx++)
+        stat >> value;
+    if (stat.fail())
+        throw std::runtime_error("Failed to parse '" + filename + "'.");
+
+    return value << SECTOR_SHIFT;
+}
+
+static bool IsTracked(const struct blk_snap_dev& dev)
+{
+    blksnap::CBlksnap blksnap;
+    std::vector<struct blk_snap_cbt_info> cbtInfos;
+
+    blksnap.CollectTrackers(cbtInfos);
+    for (const struct blk_snap_cbt_info& info : cbtInfos)
+        if ((info.dev_id.mj == dev.mj) && (info.dev_id.mn == dev.mn))
+            return true;
+
+    return false;
+}
+
+static double Percentile(const std::vector<double>& sorted, const double ratio)
+{
+    if (sorted.empty())
+        return 0.0;
+
+    size_t inx = static_cast<size_t>(ratio * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(inx, sorted.size() - 1)];
+}
+
+static void ExecuteWorkload(const std::shared_ptr<CBlockDevice>& ptrBdev, const SWorkload& workload,
+                            const int duration, SResult& result)
+{
+    const off_t deviceSize = ptrBdev->Size() & ~static_cast<off_t>(workload.blockSize - 1);
+    const off_t blockCount = deviceSize / workload.blockSize;
+    AlignedBuffer<unsigned char> portion(4096, workload.blockSize);
+    std::vector<double> latencies;
+    off_t offset = 0;
+
+    if (blockCount == 0)
+        throw std::runtime_error("Device is too small for the workload '" + workload.name + "'.");
+
+    CRandomHelper::GenerateBuffer(portion.Data(), workload.blockSize);
+
+    logger.Info("Execute workload '" + workload.name + "' in mode '" + result.mode + "'");
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(duration);
+    auto start = std::chrono::steady_clock::now();
+    auto finish = start;
+    do
+    {
+        if (workload.isRandom)
+        {
+            unsigned int rnd = static_cast<unsigned int>(CRandomHelper::GenerateInt());
+
+            offset = static_cast<off_t>(rnd % blockCount) * workload.blockSize;
+        }
+        else if (offset >= deviceSize)
+            offset = 0;
+
+        auto before = std::chrono::steady_clock::now();
+        ptrBdev->Write(portion.Data(), workload.blockSize, offset);
+        finish = std::chrono::steady_clock::now();
+
+        latencies.push_back(std::chrono::duration<double, std::micro>(finish - before).count());
+        if (!workload.isRandom)
+            offset += workload.blockSize;
+    } while (finish < deadline);
+
+    std::sort(latencies.begin(), latencies.end());
+
+    result.workload = workload.name;
+    result.blockSize = workload.blockSize;
+    result.operations = latencies.size();
+    result.bytesWritten = result.operations * workload.blockSize;
+    result.seconds = std::chrono::duration<double>(finish - start).count();
+    result.throughputMBs = (result.bytesWritten / (1024.0 * 1024.0)) / result.seconds;
+    result.iops = result.operations / result.seconds;
+    result.latencyP50us = Percentile(latencies, 0.5);
+    result.latencyP99us = Percentile(latencies, 0.99);
+    result.latencyP999us = Percentile(latencies, 0.999);
+    result.latencyMaxUs = latencies.back();
+}
+
+static void LogResult(const SResult& result)
+{
+    std::stringstream ss;
+
+    ss << std::fixed << std::setprecision(1);
+    ss << result.mode << " " << result.workload << ": " << result.throughputMBs << " MiB/s, " << result.iops
+       << " IOPS, latency p50=" << result.latencyP50us << "us p99=" << result.latencyP99us
+       << "us p999=" << result.latencyP999us << "us max=" << result.latencyMaxUs
+       << "us, diff storage " << result.diffStorageBytes << " bytes";
+    logger.Info(ss);
+    if (!result.error.empty())
+        logger.Err(result.mode + " " + result.workload + ": " + result.error);
+}
+
+static std::string JsonEscape(const std::string& str)
+{
+    std::string result;
+
+    for (const char ch : str)
+    {
+        if ((ch == '"') || (ch == '\\'))
+            result.push_back('\\');
+        if (static_cast<unsigned char>(ch) < 0x20)
+            result.push_back(' ');
+        else
+            result.push_back(ch);
+    }
+    return result;
+}
+
+static void WriteJson(std::ostream& out, const std::string& device, const std::vector<SResult>& results)
+{
+    out << std::fixed << std::setprecision(3);
+    out << "{" << std::endl;
+    out << "  \"device\": \"" << JsonEscape(device) << "\"," << std::endl;
+    out << "  \"results\": [" << std::endl;
+    for (size_t inx = 0; inx < results.size(); inx++)
+    {
+        const SResult& result = results[inx];
+
+        out << "    {";
+        out << "\"mode\": \"" << result.mode << "\", ";
+        out << "\"workload\": \"" << result.workload << "\", ";
+        out << "\"block_size\": " << result.blockSize << ", ";
+        out << "\"operations\": " << result.operations << ", ";
+        out << "\"bytes_written\": " << result.bytesWritten << ", ";
+        out << "\"seconds\": " << result.seconds << ", ";
+        out << "\"throughput_mbs\": " << result.throughputMBs << ", ";
+        out << "\"iops\": " << result.iops << ", ";
+        out << "\"latency_p50_us\": " << result.latencyP50us << ", ";
+        out << "\"latency_p99_us\": " << result.latencyP99us << ", ";
+        out << "\"latency_p999_us\": " << result.latencyP999us << ", ";
+        out << "\"latency_max_us\": " << result.latencyMaxUs << ", ";
+        out << "\"diff_storage_bytes\": " << result.diffStorageBytes << ", ";
+        out << "\"error\": \"" << JsonEscape(result.error) << "\"";
+        out << "}" << ((inx + 1) < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+void CheckPerformance(const std::string& device, const std::string& diffStorage, const int duration,
+                      const std::string& jsonFilename)
+{
+    std::vector<std::string> devices;
+    devices.push_back(device);
+    const struct blk_snap_dev origDev = DeviceByName(device);
+    const struct blk_snap_dev diffStorageDev = DeviceByPath(diffStorage);
+    const bool isSameDevice = (origDev.mj == diffStorageDev.mj) && (origDev.mn == diffStorageDev.mn);
+    std::vector<SWorkload> workloads;
+    std::vector<SResult> results;
 
     logger.Info("--- Test: check performance ---");
+    logger.Info("device: " + device);
+    logger.Info("diffStorage: " + diffStorage);
+    logger.Info("duration: " + std::to_string(duration) + " seconds per workload");
 
-    throw std::runtime_error("Is not implemented yet.");
+    workloads.emplace_back("seq-4k", 4096, false);
+    workloads.emplace_back("rand-4k", 4096, true);
+    workloads.emplace_back("seq-1m", 1024 * 1024, false);
+    workloads.emplace_back("rand-1m", 1024 * 1024, true);
 
-    if (isErrorFound)
-        throw std::runtime_error("--- Failed: check performance ---");
+    if (IsTracked(origDev))
+    {
+        blksnap::CBlksnap blksnap;
+
+        logger.Info("-- Remove change tracker for the baseline");
+        blksnap.RemoveTracker(origDev);
+    }
+
+    for (const std::string& mode : {"none", "cbt", "snapshot"})
+    {
+        if (mode == "cbt")
+        {
+            /*
+             * The tracker is attached when the first snapshot is created
+             * and is kept after the snapshot is released.
+             */
+            logger.Info("-- Attach change tracker");
+            blksnap::ISession::Create(devices, diffStorage);
+        }
+
+        for (const SWorkload& workload : workloads)
+        {
+            std::shared_ptr<blksnap::ISession> ptrSession;
+            SResult result = {};
+            unsigned long long diffStorageBytes;
+
+            /*
+             * Each workload gets its own snapshot, so that it is not
+             * affected by the chunks already copied by the previous one.
+             */
+            if (mode == "snapshot")
+            {
+                logger.Info("-- Create snapshot");
+                ptrSession = blksnap::ISession::Create(devices, diffStorage);
+            }
+
+            result.mode = mode;
+            {
+                auto ptrBdev = std::make_shared<CBlockDevice>(device);
+
+                diffStorageBytes = WrittenBytes(diffStorageDev);
+                ExecuteWorkload(ptrBdev, workload, duration, result);
+            }
+            ::sync();
+            diffStorageBytes = WrittenBytes(diffStorageDev) - diffStorageBytes;
+            if (isSameDevice)
+                diffStorageBytes -= std::min(diffStorageBytes, result.bytesWritten);
+            result.diffStorageBytes = diffStorageBytes;
+
+            std::string errorMessage;
+            if (ptrSession && ptrSession->GetError(errorMessage))
+                result.error = errorMessage;
+
+            LogResult(result);
+            results.push_back(result);
+
+            if (ptrSession)
+            {
+                logger.Info("-- Destroy snapshot");
+                ptrSession.reset();
+            }
+        }
+    }
+
+    /*
+     * The log messages are printed to stdout, so by default the results
+     * are printed to stderr to keep the JSON document intact.
+     */
+    if (jsonFilename.empty())
+        WriteJson(std::cerr, device, results);
+    else
+    {
+        std::ofstream out(jsonFilename);
+
+        if (!out.is_open())
+            throw std::runtime_error("Failed to open '" + jsonFilename + "'.");
+        WriteJson(out, device, results);
+    }
+
+    for (const SResult& result : results)
+        if (!result.error.empty())
+            throw std::runtime_error("--- Failed: check performance ---");
 
     logger.Info("--- Success: check performance ---");
 }
@@ -36,14 +355,17 @@ void CheckPerformance(const std::string& device, const std::string& diffStorage)
 void Main(int argc, char* argv[])
 {
     po::options_description desc;
-    std::string usage = std::string("Checking the performance of the COW algorithm of the blksnap module.");
+    std::string usage = std::string("Checking the performance of the COW algorithm of the blksnap module.\n"
+                                    "Attention! The contents of the device will be overwritten.");
 
     desc.add_options()
         ("help,h", "Show usage information.")
         ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
         ("device,d", po::value<std::string>(), "Device name. ")
         ("diff_storage,s", po::value<std::string>(),
-            "Directory name for allocating diff storage files.");
+            "Directory name for allocating diff storage files.")
+        ("duration,u", po::value<int>()->default_value(10), "The test duration limit in seconds for each workload.")
+        ("json,j", po::value<std::string>(), "File name for the results in JSON format. By default, stderr is used.");
     po::variables_map vm;
     po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
     po::store(parsed, vm);
@@ -70,8 +392,16 @@ void Main(int argc, char* argv[])
         throw std::invalid_argument("Argument 'diff_storage' is missed.");
     std::string diffStorage = vm["diff_storage"].as<std::string>();
 
+    int duration = vm["duration"].as<int>();
+    if (duration <= 0)
+        throw std::invalid_argument("Argument 'duration' should be positive.");
+
+    std::string jsonFilename;
+    if (vm.count("json"))
+        jsonFilename = vm["json"].as<std::string>();
+
     std::srand(std::time(0));
-    CheckPerformance(origDevName, diffStorage);
+    CheckPerformance(origDevName, diffStorage, duration, jsonFilename);
 }
 
 int main(int argc, char* argv[])